@@ -0,0 +1,472 @@
+/*
+ * Copyright © 2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * leaninit-analyze -- Show where boot and shutdown time goes
+ *
+ * The records written by init(8)'s profiler are paired up into phases, which
+ * can be printed as a blame list, as the critical path through the service
+ * graph or as a timeline. The -m option is used by the RC system to record
+ * phases of its own, and -x shows how the processes reaped by init(8) exited.
+ */
+
+#include <leaninit.h>
+
+// Output modes
+#define BLAME    0
+#define CRITICAL 1
+#define TIMELINE 2
+#define SVG      3
+#define EXITS    4
+
+// Width of the bars drawn by --timeline
+#define TIMELINE_WIDTH 50
+
+// A phase rebuilt from its records (marks are phases where begin == end)
+struct phase {
+    const char *name;
+    const char *cause;
+    uint64_t begin;
+    uint64_t end;
+    uint8_t kind; // PROF_END, PROF_FAIL or PROF_MARK, or PROF_BEGIN when it never finished
+};
+
+static struct profile_record *records = NULL;
+static size_t nrecords = 0;
+static struct phase *phases = NULL;
+static size_t nphases = 0;
+
+// Show usage information
+static cold noreturn void usage(int ret)
+{
+    printf("Usage: %s [-bct] [-s] [-f file]\n"
+           "    or %s -m begin|end|fail|mark name [cause]\n"
+           "    or %s -x [-f file] [pid]...\n"
+           "  -b, --blame           List phases by how long they took (default)\n"
+           "  -c, --critical-path   Show the chain of services that held up the end of boot\n"
+           "  -t, --timeline        Draw a timeline of every phase\n"
+           "  -s, --svg             Write the timeline as an SVG image to stdout\n"
+           "  -f, --file            Read the records from the given file (defaults to " PROFILE_PATH ")\n"
+           "  -m, --mark            Record an event for the profiler\n"
+           "  -x, --exits           Show how the processes reaped by init exited (from " EXITS_PATH ")\n"
+           "  -?, --help            Show this usage information\n",
+           __progname, __progname, __progname);
+    exit(ret);
+}
+
+// Order records by time
+static int by_time(const void *a, const void *b)
+{
+    uint64_t x = ((const struct profile_record *)a)->ns, y = ((const struct profile_record *)b)->ns;
+    return (x > y) - (x < y);
+}
+
+// Order phases by how long they took, longest first
+static int by_duration(const void *a, const void *b)
+{
+    const struct phase *x = a, *y = b;
+    uint64_t dx = x->end - x->begin, dy = y->end - y->begin;
+    return (dx < dy) - (dx > dy);
+}
+
+// Convert nanoseconds to seconds
+static double secs(uint64_t ns)
+{
+    return (double)ns / 1000000000;
+}
+
+// Read the ring buffer and sort the surviving records by time
+static int load_records(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if unlikely (fd == -1) {
+        printf(RED "* Could not open %s: %s" RESET "\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct ring_header header;
+    if unlikely (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != PROFILE_MAGIC
+                 || header.slots == 0) {
+        printf(RED "* %s is not a LeanInit profile" RESET "\n", path);
+        close(fd);
+        return -1;
+    }
+
+    records = calloc(header.slots, sizeof(struct profile_record));
+    if unlikely (records == NULL) {
+        printf(RED "* Memory allocation failed" RESET "\n");
+        close(fd);
+        return -1;
+    }
+    ssize_t size = read(fd, records, header.slots * sizeof(struct profile_record));
+    close(fd);
+
+    // Only full slots that have been written to are used
+    size_t slots = size > 0 ? (size_t)size / sizeof(struct profile_record) : 0;
+    if (header.count < slots)
+        slots = (size_t)header.count;
+    for (size_t i = 0; i < slots; i++) {
+        if (records[i].ns == 0)
+            continue;
+        records[i].name[sizeof(records[i].name) - 1] = 0;
+        records[i].cause[sizeof(records[i].cause) - 1] = 0;
+        records[nrecords++] = records[i];
+    }
+    qsort(records, nrecords, sizeof(struct profile_record), by_time);
+    return 0;
+}
+
+// Pair every BEGIN record with the END or FAIL record that follows it
+static int build_phases(void)
+{
+    phases = calloc(nrecords + 1, sizeof(struct phase));
+    if unlikely (phases == NULL) {
+        printf(RED "* Memory allocation failed" RESET "\n");
+        return -1;
+    }
+
+    for (size_t r = 0; r < nrecords; r++) {
+        struct profile_record *record = &records[r];
+        if (record->kind == PROF_BEGIN || record->kind == PROF_MARK) {
+            phases[nphases++] = (struct phase) { .name = record->name,
+                                                 .cause = record->cause,
+                                                 .begin = record->ns,
+                                                 .end = record->ns,
+                                                 .kind = record->kind };
+            continue;
+        }
+        for (size_t p = nphases; p-- > 0;) {
+            if (phases[p].kind != PROF_BEGIN || strcmp(phases[p].name, record->name) != 0)
+                continue;
+            phases[p].end = record->ns;
+            phases[p].kind = record->kind;
+            break;
+        }
+    }
+
+    // Phases that never finished are shown as lasting until the last record
+    uint64_t last = nrecords != 0 ? records[nrecords - 1].ns : 0;
+    for (size_t p = 0; p < nphases; p++)
+        if (phases[p].kind == PROF_BEGIN)
+            phases[p].end = last;
+    return 0;
+}
+
+// Return the note printed after a phase
+static const char *note(const struct phase *phase)
+{
+    if (phase->kind == PROF_FAIL)
+        return RED " (failed)" RESET;
+    else if (phase->kind == PROF_BEGIN)
+        return YELLOW " (unfinished)" RESET;
+    return "";
+}
+
+// Print every phase by how long it took
+static void blame(void)
+{
+    struct phase *sorted = malloc((nphases + 1) * sizeof(struct phase));
+    if unlikely (sorted == NULL)
+        return;
+    memcpy(sorted, phases, nphases * sizeof(struct phase));
+    qsort(sorted, nphases, sizeof(struct phase), by_duration);
+    for (size_t p = 0; p < nphases; p++)
+        if (sorted[p].kind != PROF_MARK)
+            printf(WHITE "%10.3fs" RESET "  %s%s\n", secs(sorted[p].end - sorted[p].begin), sorted[p].name,
+                   note(&sorted[p]));
+    free(sorted);
+}
+
+// Find the latest phase with the given name that ended no later than the given time
+static struct phase *find_before(const char *prefix, const char *name, uint64_t before)
+{
+    struct phase *found = NULL;
+    size_t len = strlen(prefix);
+    for (size_t p = 0; p < nphases; p++) {
+        if (strncmp(phases[p].name, prefix, len) != 0 || strcmp(phases[p].name + len, name) != 0
+            || phases[p].end > before)
+            continue;
+        if (found == NULL || phases[p].end > found->end)
+            found = &phases[p];
+    }
+    return found;
+}
+
+// Print the chain of phases that the last service to start had to wait for
+static void critical_path(void)
+{
+    // The chain ends at the service that was ready last (or rc(8) when no services were started)
+    struct phase *last = NULL;
+    for (size_t p = 0; p < nphases; p++)
+        if (strncmp(phases[p].name, "svc:", 4) == 0 && (last == NULL || phases[p].end > last->end))
+            last = &phases[p];
+    if (last == NULL)
+        last = find_before("", "rc", UINT64_MAX);
+    if unlikely (last == NULL) {
+        printf(RED "* No services or rc(8) runs have been recorded" RESET "\n");
+        return;
+    }
+
+    // Follow each service back to the prerequisite that released it, then to the boot phases before it
+    struct phase **chain = malloc((nphases + 3) * sizeof(struct phase *));
+    if unlikely (chain == NULL)
+        return;
+    size_t length = 0;
+    for (struct phase *link = last; link != NULL && length < nphases;
+         link = link->cause[0] ? find_before("svc:", link->cause, link->begin) : NULL)
+        chain[length++] = link;
+    struct phase *rc = find_before("", "rc", chain[length - 1]->begin);
+    if (rc != NULL && rc != chain[length - 1])
+        chain[length++] = rc;
+    struct phase *init = find_before("", "init", chain[length - 1]->begin);
+    if (init != NULL)
+        chain[length++] = init;
+
+    printf(CYAN "* " WHITE "Critical path to %s (finished %.3fs after boot):" RESET "\n", last->name, secs(last->end));
+    while (length-- > 0) {
+        struct phase *link = chain[length];
+        if (link->kind == PROF_MARK)
+            printf("  %-32s @%.3fs\n", link->name, secs(link->begin));
+        else
+            printf("  %-32s @%.3fs " WHITE "+%.3fs" RESET "%s\n", link->name, secs(link->begin),
+                   secs(link->end - link->begin), note(link));
+    }
+    free(chain);
+}
+
+// Draw every phase as a bar of a text timeline
+static void timeline(void)
+{
+    uint64_t first = records[0].ns, span = records[nrecords - 1].ns - first;
+    if (span == 0)
+        span = 1;
+
+    printf(CYAN "* " WHITE "Timeline from %.3fs to %.3fs after boot:" RESET "\n", secs(first),
+           secs(records[nrecords - 1].ns));
+    for (size_t p = 0; p < nphases; p++) {
+        uint64_t from = (phases[p].begin - first) * TIMELINE_WIDTH / span;
+        uint64_t to = (phases[p].end - first) * TIMELINE_WIDTH / span;
+        char bar[TIMELINE_WIDTH + 1];
+        for (uint64_t c = 0; c < TIMELINE_WIDTH; c++)
+            bar[c] = c >= from && c <= to ? (phases[p].kind == PROF_MARK ? '|' : '#') : ' ';
+        bar[TIMELINE_WIDTH] = 0;
+        printf("  %-24.24s %8.3fs [%s]%s\n", phases[p].name, secs(phases[p].begin), bar, note(&phases[p]));
+    }
+}
+
+// Write the timeline as an SVG image
+static void svg(void)
+{
+    const double scale = 1000, label = 260, row = 20;
+    uint64_t first = records[0].ns, span = records[nrecords - 1].ns - first;
+    if (span == 0)
+        span = 1;
+    double height = (double)(nphases + 2) * row;
+
+    printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%.0f\" height=\"%.0f\" font-family=\"monospace\" "
+           "font-size=\"12\">\n"
+           "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n",
+           label + scale + 80, height);
+
+    // One grid line per second
+    for (uint64_t s = (first / 1000000000) + 1; s * 1000000000 <= first + span; s++) {
+        double x = label + (double)(s * 1000000000 - first) * scale / (double)span;
+        printf("<line x1=\"%.1f\" y1=\"0\" x2=\"%.1f\" y2=\"%.0f\" stroke=\"#ddd\"/>"
+               "<text x=\"%.1f\" y=\"%.0f\" fill=\"#888\">%llus</text>\n",
+               x, x, height, x + 2, height - 4, (unsigned long long)s);
+    }
+
+    for (size_t p = 0; p < nphases; p++) {
+        double x = label + (double)(phases[p].begin - first) * scale / (double)span;
+        double w = (double)(phases[p].end - phases[p].begin) * scale / (double)span;
+        double y = (double)(p + 1) * row;
+        const char *color = phases[p].kind == PROF_FAIL           ? "#d33"
+                            : phases[p].kind == PROF_BEGIN          ? "#da3"
+                            : strncmp(phases[p].name, "svc:", 4) == 0 ? "#3a5"
+                                                                      : "#37c";
+        if (phases[p].kind == PROF_MARK)
+            printf("<line x1=\"%.1f\" y1=\"%.0f\" x2=\"%.1f\" y2=\"%.0f\" stroke=\"#a3c\" stroke-width=\"2\"/>", x,
+                   y - row + 4, x, y);
+        else
+            printf("<rect x=\"%.1f\" y=\"%.0f\" width=\"%.1f\" height=\"%.0f\" fill=\"%s\"/>", x, y - row + 4,
+                   w < 1 ? 1 : w, row - 4, color);
+        printf("<text x=\"4\" y=\"%.0f\">", y - 5);
+        for (const char *c = phases[p].name; *c; c++) {
+            if (*c == '<')
+                printf("&lt;");
+            else if (*c == '&')
+                printf("&amp;");
+            else
+                putchar(*c);
+        }
+        printf(" %.3fs</text>\n", secs(phases[p].end - phases[p].begin));
+    }
+    printf("</svg>\n");
+}
+
+// Print the exit status and resource usage of the reaped processes, oldest first, or only the given PIDs
+static int exits(const char *path, int argc, char *argv[])
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if unlikely (fd == -1) {
+        printf(RED "* Could not open %s: %s" RESET "\n", path, strerror(errno));
+        return 1;
+    }
+
+    struct ring_header header;
+    struct exit_record *exited = NULL;
+    if unlikely (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != EXITS_MAGIC
+                 || header.slots == 0 || (exited = calloc(header.slots, sizeof(struct exit_record))) == NULL) {
+        printf(RED "* %s is not a LeanInit exit table" RESET "\n", path);
+        close(fd);
+        return 1;
+    }
+    ssize_t size = read(fd, exited, header.slots * sizeof(struct exit_record));
+    close(fd);
+
+    // Start at the oldest record, which is the next one to be overwritten once the ring has wrapped around
+    size_t slots = size > 0 ? (size_t)size / sizeof(struct exit_record) : 0;
+    if (header.count < slots)
+        slots = (size_t)header.count;
+    size_t first = header.count > slots ? (size_t)(header.count % slots) : 0;
+    int found = 0;
+    for (size_t n = 0; n < slots; n++) {
+        struct exit_record *record = &exited[(first + n) % slots];
+        bool wanted = optind == argc;
+        for (int i = optind; i < argc && !wanted; i++)
+            wanted = atoi(argv[i]) == record->pid;
+        if (!wanted)
+            continue;
+
+        found++;
+        if (record->signal != 0)
+            printf(CYAN "* " WHITE "PID %d was killed by signal %d (%s)", record->pid, record->signal,
+                   strsignal(record->signal));
+        else
+            printf(CYAN "* " WHITE "PID %d exited with status %d", record->pid, record->status);
+        printf(RESET " at %.3fs, user %.3fs, system %.3fs, max RSS %lld KiB\n", secs(record->ns),
+               (double)record->utime_us / 1000000, (double)record->stime_us / 1000000, (long long)record->maxrss);
+    }
+
+    free(exited);
+    return found == 0;
+}
+
+// Send a record to init(8) for the RC system
+static int mark(int argc, char *argv[])
+{
+    if unlikely (argc - optind < 2) {
+        usage(1);
+        __builtin_unreachable();
+    }
+
+    uint8_t kind;
+    if (strcmp(argv[optind], "begin") == 0)
+        kind = PROF_BEGIN;
+    else if (strcmp(argv[optind], "end") == 0)
+        kind = PROF_END;
+    else if (strcmp(argv[optind], "fail") == 0)
+        kind = PROF_FAIL;
+    else if (strcmp(argv[optind], "mark") == 0)
+        kind = PROF_MARK;
+    else {
+        usage(1);
+        __builtin_unreachable();
+    }
+
+    profile(kind, argv[optind + 1], argc - optind > 2 ? argv[optind + 2] : NULL);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // Long options
+    struct option long_options[] = { { "blame", no_argument, NULL, 'b' },
+                                     { "critical-path", no_argument, NULL, 'c' },
+                                     { "timeline", no_argument, NULL, 't' },
+                                     { "svg", no_argument, NULL, 's' },
+                                     { "file", required_argument, NULL, 'f' },
+                                     { "mark", no_argument, NULL, 'm' },
+                                     { "exits", no_argument, NULL, 'x' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+    // Parse options
+    int mode = BLAME, args;
+    const char *path = NULL;
+    while ((args = getopt_long(argc, argv, "bctsf:mx?", long_options, NULL)) != -1)
+        switch (args) {
+            case 'b':
+                mode = BLAME;
+                break;
+            case 'c':
+                mode = CRITICAL;
+                break;
+            case 't':
+                mode = TIMELINE;
+                break;
+            case 's':
+                mode = SVG;
+                break;
+            case 'f':
+                path = optarg;
+                break;
+            case 'm':
+                return mark(argc, argv);
+            case 'x':
+                mode = EXITS;
+                break;
+            default:
+                usage(1);
+                __builtin_unreachable();
+        }
+
+    if (mode == EXITS)
+        return exits(path != NULL ? path : EXITS_PATH, argc, argv);
+
+    // Rebuild the phases from the records
+    if (path == NULL)
+        path = PROFILE_PATH;
+    if unlikely (load_records(path) != 0 || build_phases() != 0)
+        return 1;
+    if unlikely (nrecords == 0) {
+        printf(RED "* %s does not contain any records" RESET "\n", path);
+        return 1;
+    }
+
+    switch (mode) {
+        case BLAME:
+            blame();
+            break;
+        case CRITICAL:
+            critical_path();
+            break;
+        case TIMELINE:
+            timeline();
+            break;
+        case SVG:
+            svg();
+            break;
+    }
+    return 0;
+}
@@ -25,6 +25,98 @@
  */
 
 #include <leaninit.h>
+#if defined(__linux__)
+#include <linux/kexec.h>
+
+// Open the first file named by formats (filled in with the running kernel's release) that exists
+static int open_release(const char *release, const char *const *formats)
+{
+    char path[PATH_MAX];
+    for (; *formats != NULL; formats++) {
+        snprintf(path, sizeof(path), *formats, release);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1)
+            return fd;
+    }
+    return -1;
+}
+
+/* Load the kernel init(8) jumps into after rc.shutdown with kexec_file_load(2). The running kernel's image,
+   initrd and command line are used for anything that wasn't given. */
+static bool load_kexec(const char *kernel, const char *initrd, const char *append)
+{
+#if defined(SYS_kexec_file_load)
+    struct utsname uts;
+    uname(&uts);
+    static const char *const kernels[] = { "/boot/vmlinuz-%s", "/boot/vmlinux-%s", "/boot/kernel-%s", NULL };
+    static const char *const initrds[] = { "/boot/initramfs-%s.img", "/boot/initrd.img-%s", "/boot/initrd-%s",
+                                           "/boot/initramfs-%s", NULL };
+
+    int kernel_fd = kernel != NULL ? open(kernel, O_RDONLY | O_CLOEXEC) : open_release(uts.release, kernels);
+    if unlikely (kernel_fd == -1) {
+        printf(RED "* Cannot open the kernel %s" RESET "\n", kernel != NULL ? kernel : "for the running release");
+        return false;
+    }
+    int initrd_fd = initrd != NULL ? open(initrd, O_RDONLY | O_CLOEXEC) : open_release(uts.release, initrds);
+    if unlikely (initrd != NULL && initrd_fd == -1) {
+        printf(RED "* Cannot open the initrd %s" RESET "\n", initrd);
+        close(kernel_fd);
+        return false;
+    }
+
+    // Reuse the running kernel's command line (which /proc/cmdline ends with a newline)
+    char cmdline[4096] = { 0 };
+    if (append != NULL)
+        strncpy(cmdline, append, sizeof(cmdline) - 1);
+    else {
+        int fd = open("/proc/cmdline", O_RDONLY | O_CLOEXEC);
+        if likely (fd != -1) {
+            ssize_t length = read(fd, cmdline, sizeof(cmdline) - 1);
+            close(fd);
+            if (length > 0 && cmdline[length - 1] == '\n')
+                cmdline[length - 1] = 0;
+        }
+    }
+
+    long loaded = syscall(SYS_kexec_file_load, kernel_fd, initrd_fd, strlen(cmdline) + 1, cmdline,
+                          initrd_fd == -1 ? KEXEC_FILE_NO_INITRAMFS : 0);
+    if unlikely (loaded != 0)
+        perror(RED "* kexec_file_load() failed with" RESET);
+    close(kernel_fd);
+    if (initrd_fd != -1)
+        close(initrd_fd);
+    return loaded == 0;
+#else
+    (void)kernel, (void)initrd, (void)append;
+    printf(RED "* kexec_file_load() is not supported on this architecture" RESET "\n");
+    return false;
+#endif
+}
+#endif
+
+// Show usage information
+static cold noreturn void usage(const char *opts)
+{
+    printf("Usage: %s [-%s]\n"
+#if !defined(__NetBSD__)
+           "  -F, --firmware-setup  Reboot into firmware setup\n"
+#endif
+           "  -f, -q, --force       Do not send a signal to init, call sync(2) and reboot(2) directly\n"
+           "  -h, --halt            Force halt, even when called as poweroff or reboot\n"
+#if defined(__linux__)
+           "  -k, --kexec           Reboot straight into a kernel loaded with kexec_file_load(2) (reboot only)\n"
+           "      --kernel          The kernel to load with --kexec (default: the running one)\n"
+           "      --initrd          The initrd to load with --kexec (default: the running kernel's)\n"
+           "      --append          The command line for --kexec (default: /proc/cmdline)\n"
+#endif
+           "  -l, --no-wall         Turn off wall messages\n"
+           "  -p, --poweroff        Force poweroff, even when called as halt or reboot\n"
+           "  -r, --reboot          Force reboot, even when called as halt or poweroff\n"
+           "  -t, --timeout         Seconds services get to stop before they are killed\n"
+           "  -?, --help            Show this usage information\n",
+           __progname, opts);
+    exit(1);
+}
 
 int main(int argc, char *argv[])
 {
@@ -53,6 +145,13 @@ int main(int argc, char *argv[])
         { "no-wall", no_argument, NULL, 'l' },
         { "poweroff", no_argument, NULL, 'p' },
         { "reboot", no_argument, NULL, 'r' },
+        { "timeout", required_argument, NULL, 't' },
+#if defined(__linux__)
+        { "kexec", no_argument, NULL, 'k' },
+        { "kernel", required_argument, NULL, 'K' },
+        { "initrd", required_argument, NULL, 'I' },
+        { "append", required_argument, NULL, 'A' },
+#endif
         { "help", no_argument, NULL, '?' },
         { NULL, 0, NULL, 0 }
     };
@@ -60,11 +159,17 @@ int main(int argc, char *argv[])
     // Variables used for options
     bool wall = true;
     bool osin = false;
+    uint32_t deadline = 0;
 #if defined(__NetBSD__)
-    const char *opts = "fhlpqr?";
+    const char *opts = "fhlpqrt:?";
     bool force = true; // Runlevels on NetBSD are buggy
+#elif defined(__linux__)
+    const char *opts = "Ffhklpqrt:?";
+    bool force = false;
+    bool kexec = false;
+    const char *kernel = NULL, *initrd = NULL, *append = NULL;
 #else
-    const char *opts = "Ffhlpqr?";
+    const char *opts = "Ffhlpqrt:?";
     bool force = false;
 #endif
 
@@ -75,18 +180,7 @@ int main(int argc, char *argv[])
 
             // Display usage info
             case '?':
-                printf("Usage: %s [-%s]\n"
-#if !defined(__NetBSD__)
-                       "  -F, --firmware-setup  Reboot into firmware setup\n"
-#endif
-                       "  -f, -q, --force       Do not send a signal to init, call sync(2) and reboot(2) directly\n"
-                       "  -h, --halt            Force halt, even when called as poweroff or reboot\n"
-                       "  -l, --no-wall         Turn off wall messages\n"
-                       "  -p, --poweroff        Force poweroff, even when called as halt or reboot\n"
-                       "  -r, --reboot          Force reboot, even when called as halt or poweroff\n"
-                       "  -?, --help            Show this usage information\n",
-                       __progname, opts);
-                return 1;
+                usage(opts);
 
             // Skip sending a signal to init(8)
             case 'f':
@@ -106,6 +200,22 @@ int main(int argc, char *argv[])
                 signal = SIGUSR1;
                 break;
 
+#if defined(__linux__)
+            // Reboot into a new kernel without going through the firmware
+            case 'k':
+                kexec = true;
+                break;
+            case 'K':
+                kernel = optarg;
+                break;
+            case 'I':
+                initrd = optarg;
+                break;
+            case 'A':
+                append = optarg;
+                break;
+#endif
+
             // Turn off wall messages
             case 'l':
                 wall = false;
@@ -120,6 +230,11 @@ int main(int argc, char *argv[])
             case 'r':
                 signal = SIGINT;
                 break;
+
+            // Deadline for stopping services
+            case 't':
+                deadline = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
         }
 
     // Halt can only be run by root
@@ -128,6 +243,22 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+#if defined(__linux__)
+    /* Load the new kernel now, so a kernel that can't be loaded is noticed before anything is stopped.
+       The system is rebooted the usual way when loading it fails. */
+    if (kexec || kernel != NULL || initrd != NULL || append != NULL) {
+        if unlikely (signal != SIGINT) {
+            printf(RED "* --kexec, --kernel, --initrd and --append can only be used to reboot" RESET "\n");
+            usage(opts);
+        } else if likely (load_kexec(kernel, initrd, append))
+            signal = SIGKEXEC;
+        else {
+            printf(RED "* Falling back to a normal reboot" RESET "\n");
+            signal = SIGINT;
+        }
+    }
+#endif
+
     // Syslog
     if likely (wall) {
         openlog(__progname, LOG_CONS, LOG_AUTH);
@@ -178,9 +309,25 @@ int main(int argc, char *argv[])
             case SIGINT: // Reboot
                 return reboot(SYS_REBOOT);
         }
+#if defined(__linux__)
+        if (signal == SIGKEXEC) // kexec reboot, which only returns when no kernel is loaded
+            reboot(SYS_KEXEC);
+        return reboot(SYS_REBOOT);
+#else
         __builtin_unreachable(); // reboot(2) never returns
+#endif
     }
 
-    // Send the correct signal to init
-    return kill(1, signal);
+    // Ask init through its control socket and follow the shutdown, or send it the correct signal
+    struct control_request request = { .magic = CONTROL_MAGIC,
+                                       .type = signal == SIGUSR1   ? CTL_HALT
+                                               : signal == SIGUSR2 ? CTL_POWEROFF
+                                               : signal == SIGINT  ? CTL_REBOOT
+                                                                   : CTL_KEXEC,
+                                       .deadline = deadline };
+    struct control_reply reply;
+    int control = control_send(&request, &reply);
+    if unlikely (control == -1)
+        return kill(1, signal);
+    return control_follow(control, &reply);
 }
@@ -30,13 +30,174 @@
 #define SINGLE_USER (1 << 0)
 #define VERBOSE     (1 << 1)
 #define BANNER      (1 << 2)
+#define SHUTDOWN    (1 << 3) // The runlevel is being stopped, so leaninit-logd(8) isn't restarted when it exits
+#define READAHEAD   (1 << 4) // Record the files read during boot again with leaninit-readahead(8)
 static unsigned char flags = VERBOSE;
-static int current_signal = 0;
+
+/* Runlevel requests that have been received but not handled yet. Requests are coalesced so
+   the result never depends on timing: the first halt, poweroff or reboot request wins over
+   everything else, the last runlevel switch wins over earlier ones and a reload is dropped
+   when a runlevel switch (which reloads everything anyway) is waiting. */
+static struct {
+    int final;             // SIGUSR1, SIGUSR2, SIGINT or SIGKEXEC
+    int runlevel;          // SIGTERM or SIGILL
+    bool reload;           // SIGHUP
+    unsigned int deadline; // Seconds services get to stop, the shortest one requested through the control socket wins
+} requests;
+
+// The signals PID 1 handles, which are read from signal_fd in the event loop
+static sigset_t handled_signals;
+static int signal_fd = -1;
+#if defined(__linux__)
+static int event_fd = -1; // epoll(7) instance
+#else
+static int signal_pipe[2]; // Self-pipe written to by sighandle()
+#endif
+
+// Sources of events for the event loop
+#define EV_SIGNAL  0
+#define EV_PROFILE 1
+#define EV_CONTROL 2
+#define EV_CLIENT  3 // A pending control client, whose event is EV_CLIENT plus its file descriptor
+
+/* The control socket. Clients whose requests change the runlevel are kept in waiters and sent the
+   progress of the shutdown, then the connection is closed once the new runlevel has been started. */
+#define CONTROL_TIMEOUT 1 // Seconds a client gets to send its request
+static int control_fd = -1;
+static int *waiters = NULL;
+static size_t nwaiters = 0;
+
+/* Clients that haven't sent their request yet. Their sockets are non-blocking and only read once the event loop
+   sees them become readable, so a client that never writes can't hold up PID 1. The peer's uid is taken right
+   after accept(2), and clients are dropped after CONTROL_TIMEOUT, or to make room for a client of root. */
+#define CONTROL_CLIENTS 64
+static struct client {
+    int fd;
+    uid_t uid;
+    long long deadline;
+} clients[CONTROL_CLIENTS];
+static size_t nclients = 0;
+static const int control_signals[] = { [CTL_HALT] = SIGUSR1,   [CTL_POWEROFF] = SIGUSR2, [CTL_REBOOT] = SIGINT,
+                                       [CTL_SINGLE] = SIGTERM, [CTL_MULTI] = SIGILL,     [CTL_RELOAD] = SIGHUP };
+
+/* Ring buffers kept in memory and written to a file in /var/run/leaninit as soon as it exists,
+   so nothing recorded before rc(8) has reset it is lost */
+struct ring {
+    const char *path;
+    uint32_t magic;
+    uint32_t slots;
+    size_t size; // Size of a record
+    void *records;
+    uint64_t count;
+    int file;
+};
+
+// The boot profiler, which receives its records through profile_pipe
+static int profile_pipe[2] = { -1, -1 };
+static struct profile_record profile_records[PROFILE_SLOTS];
+static struct ring profile_ring = { PROFILE_PATH, PROFILE_MAGIC, PROFILE_SLOTS, sizeof(struct profile_record),
+                                    profile_records, 0, -1 };
+
+// The exit status and resource usage of every process PID 1 has reaped
+static struct exit_record exit_records[EXITS_SLOTS];
+static struct ring exit_ring = { EXITS_PATH, EXITS_MAGIC, EXITS_SLOTS, sizeof(struct exit_record), exit_records, 0,
+                                 -1 };
+
+// leaninit-logd(8), which PID 1 restarts with the same pipe so that nothing written to it is lost
+#define LOGD_MIN_UPTIME 1000 // leaninit-logd is not restarted when it exits sooner than this
+static int log_pipe[2] = { -1, -1 };
+static pid_t logd = 0;
+static long long logd_started = 0;
+
+// Write end of the pipe read by leaninit-readahead(8), which is closed to tell it that boot has finished
+static int readahead_pipe = -1;
+
+// The process running the current runlevel, or 0 when there is none
+#define RUNLEVEL_FALLBACK 2 // Exit status of the runlevel process when multi-user has to fall back to single user
+static pid_t runlevel = 0;
+static pid_t single_shell = 0; // The shell started by the runlevel process in single user mode
+
+#if defined(__linux__)
+/* Pseudo file systems mounted before rc(8) runs, in order. The primary ones are always mounted,
+   while the secondary ones replace the mountpfs service and are only mounted when it is enabled. */
+#define PFS_PRIMARY   0
+#define PFS_SECONDARY 1
+static const struct pseudo_fs {
+    const char *source;
+    const char *target;
+    const char *type;
+    unsigned long flags;
+    const char *data;
+    unsigned char stage;
+} pseudo_fs[] = {
+    { "proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME, NULL, PFS_PRIMARY },
+    { "dev", "/dev", "devtmpfs", MS_NOSUID | MS_NOATIME, NULL, PFS_PRIMARY },
+    { "sysfs", "/sys", "sysfs", MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME, NULL, PFS_PRIMARY },
+    { "tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV | MS_NOATIME, "mode=1777", PFS_PRIMARY },
+    { "tmpfs", "/run", "tmpfs", MS_NOSUID | MS_NODEV | MS_NOATIME, NULL, PFS_PRIMARY },
+    { "devpts", "/dev/pts", "devpts", MS_NOSUID | MS_NOEXEC | MS_NOATIME, "gid=5,mode=0620", PFS_SECONDARY },
+    { "none", "/dev/mqueue", "mqueue", MS_NOATIME, NULL, PFS_SECONDARY },
+    { "none", "/sys/kernel/debug", "debugfs", MS_NOATIME, NULL, PFS_SECONDARY }, // Essential for overclocking AMD GPUs
+    { "securityfs", "/sys/kernel/security", "securityfs", MS_NOATIME, NULL, PFS_SECONDARY },
+    { "pstore", "/sys/fs/pstore", "pstore", MS_NOATIME, NULL, PFS_SECONDARY },
+    { "tmpfs", "/run/shm", "tmpfs", MS_NOSUID | MS_NODEV | MS_NOATIME, "mode=1777", PFS_SECONDARY },
+    { "/run/shm", "/dev/shm", NULL, MS_BIND, NULL, PFS_SECONDARY },
+    { "cgroup", "/sys/fs/cgroup", "tmpfs", MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME, NULL, PFS_SECONDARY },
+    // elogind assumes the openrc cgroup is present (other cgroups, such as a 'leaninit' cgroup, don't work here)
+    { "openrc", "/sys/fs/cgroup/openrc", "cgroup", MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME, "none,name=openrc",
+      PFS_SECONDARY },
+    /* Services are started in cgroups of their own in the unified (v2) hierarchy, which also provides every
+       controller through one cgroup (mounting a v1 hierarchy with the controllers would take them away from it) */
+    { "cgroup2", "/sys/fs/cgroup/unified", "cgroup2", MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME, "nsdelegate",
+      PFS_SECONDARY },
+};
+#endif
+
+// Deadlines for the processes left once all services have stopped (in milliseconds)
+#define KILL_TERM_TIMEOUT 1000 // Time between SIGTERM and SIGKILL
+#define KILL_TIMEOUT      1000 // Time for the processes to exit after SIGKILL
+#define KILL_INTERVAL     10   // How often to check whether any processes are left
+
+// Respawn throttling for getty(8) (times are in milliseconds)
+#define GETTY_MIN_UPTIME 5000  // A getty that exits sooner than this has failed
+#define GETTY_BACKOFF    125   // Delay before respawning a getty after its first failure, doubled after each one
+#define GETTY_MAX_DELAY  60000 // Upper limit for the delay
+#define GETTY_CRASH_LOOP 5     // Consecutive failures before the getty is reported as crash-looping
+
+// The getty table, read from ttys(5)
+struct getty {
+    char *cmd;
+    char **argv; // cmd split into words, or NULL when it uses shell syntax and has to be run by sh(1)
+    char *tty;
+    pid_t pid;
+    int pidfd;
+    unsigned int failures;
+    long long started;    // When the getty was last spawned
+    long long respawn_at; // When to respawn the getty, or 0 while it is running
+};
+static struct getty *gettys = NULL;
+static size_t ngettys = 0;
+
+// Gettys whose lines were removed from ttys(5) or changed, which are being hung up
+#define RETIRED_GETTY (SIZE_MAX - 1) // Event ID of their pidfds and kevents
+struct retired_getty {
+    char *tty;
+    pid_t pid;
+    int pidfd;
+    long long kill_at; // When to send SIGKILL, or 0 once it has been sent
+};
+static struct retired_getty *retired = NULL;
+static size_t nretired = 0;
+#if defined(__linux__)
+static bool getty_pidfds = true; // False once a getty could not get a pidfd, see watch_sigchld()
+static int getty_sigchld = -1;    // signalfd(2) for SIGCHLD, only watched once getty_pidfds is false
+#endif
+static volatile sig_atomic_t reload_gettys = 0; // Set when the runlevel process is sent SIGHUP
 
 // Show usage for init
 static cold noreturn void usage(int ret)
 {
-    printf("Usage: %s [runlevel]...\n"
+    printf("Usage: %s [runlevel] [deadline]\n"
            "    or %s --[opt]   ...\n"
            "  0           Poweroff\n"
            "  1, S, s     Switch to single user mode\n"
@@ -44,6 +205,8 @@ static cold noreturn void usage(int ret)
            "  6           Reboot\n"
            "  7           Halt\n"
            "  Q, q        Reload the current runlevel\n"
+           "  deadline    Seconds services get to stop before they are killed\n"
+           "  --status    Show the current runlevel, or the state of the given service\n"
            "  --version   Show LeanInit's version number\n"
            "  --help      Show this usage information\n",
            __progname, __progname);
@@ -70,14 +233,70 @@ static int open_tty(const char *tty_path)
     return tty;
 }
 
-// Execute the given script
-static int sh(char *script)
+// Unblock the signals handled by PID 1 in a newly forked child
+static void reset_sigmask(void)
+{
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+}
+
+// Write a slot of a ring buffer to its file, (re)creating the file with the whole ring when it does not exist
+static void save_ring(struct ring *ring, size_t slot)
+{
+    // Only PID 1 owns the files, the runlevel process has a copy of the rings that is never saved
+    if unlikely (getpid() != 1)
+        return;
+
+    struct stat st;
+    if (ring->file != -1 && (fstat(ring->file, &st) != 0 || st.st_nlink == 0)) {
+        close(ring->file); // rc(8) has removed /var/run/leaninit
+        ring->file = -1;
+    }
+
+    struct ring_header header = { .magic = ring->magic, .slots = ring->slots, .count = ring->count };
+    if (ring->file == -1) {
+        ring->file = open(ring->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (ring->file == -1)
+            return;
+        pwrite(ring->file, &header, sizeof(header), 0);
+        pwrite(ring->file, ring->records, ring->slots * ring->size, sizeof(header));
+        return;
+    }
+    pwrite(ring->file, (char *)ring->records + slot * ring->size, ring->size, (off_t)(sizeof(header) + slot * ring->size));
+    pwrite(ring->file, &header, sizeof(header), 0);
+}
+
+// Add a record to a ring buffer, overwriting the oldest one when it is full
+static void push_ring(struct ring *ring, const void *record)
+{
+    size_t slot = ring->count++ % ring->slots;
+    memcpy((char *)ring->records + slot * ring->size, record, ring->size);
+    save_ring(ring, slot);
+}
+
+// Record the exit status, CPU time and peak memory usage of a reaped process
+static void record_exit(pid_t pid, int status, const struct rusage *usage)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct exit_record record = {
+        .ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec,
+        .utime_us = (uint64_t)usage->ru_utime.tv_sec * 1000000 + (uint64_t)usage->ru_utime.tv_usec,
+        .stime_us = (uint64_t)usage->ru_stime.tv_sec * 1000000 + (uint64_t)usage->ru_stime.tv_usec,
+        .maxrss = usage->ru_maxrss,
+        .pid = pid,
+        .status = WIFEXITED(status) ? WEXITSTATUS(status) : 0,
+        .signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0,
+    };
+    push_ring(&exit_ring, &record);
+}
+
+// Execute the given command and wait for it to finish
+static int run(char *cmd_argv[])
 {
     int err;
     pid_t child;
-    char *script_argv[] = { script, "silent", NULL };
-    if ((flags & VERBOSE) == VERBOSE)
-        script_argv[1] = "verbose";
 
 #if defined(POSIX_SPAWN_SETSID)
     // Run the command using posix_spawn(3) (if supported)
@@ -85,40 +304,588 @@ static int sh(char *script)
     err = posix_spawnattr_init(&attr);
     if unlikely (err != 0)
         return -1;
-    err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+    sigset_t empty;
+    sigemptyset(&empty);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK);
     if unlikely (err != 0)
         return -1;
-    err = posix_spawnp(&child, script_argv[0], NULL, &attr, script_argv, environ);
+    err = posix_spawnp(&child, cmd_argv[0], NULL, &attr, cmd_argv, environ);
     if unlikely (err != 0)
         return -1;
 #else
     // If POSIX_SPAWN_SETSID is unsupported, use fork(2) instead
     child = fork();
     if (child == 0) {
+        reset_sigmask();
         setsid();
-        return execve(script, script_argv, environ);
+        return execve(cmd_argv[0], cmd_argv, environ);
     } else if unlikely (child == -1)
         return -1;
 #endif
 
-    // Wait for the script to finish
-    int status;
-    waitpid(child, &status, 0);
+    /* Wait for the script to finish. Every other child is left to reap_children() once the event loop runs again
+       (the SIGCHLD stays queued until then), so the runlevel process and leaninit-logd(8) are handled the same way
+       whether or not they exited while PID 1 was waiting here. */
+    int status = 0;
+    struct rusage usage;
+    while (wait4(child, &status, 0, &usage) == -1)
+        if (errno != EINTR)
+            return -1;
+    record_exit(child, status, &usage);
     return WEXITSTATUS(status);
 }
 
-// Spawn a getty on the given TTY, then return its PID
-static pid_t spawn_getty(const char *cmd, const char *tty)
+// Execute the given script
+static int sh(char *script)
+{
+    char *script_argv[] = { script, "silent", NULL };
+    if ((flags & VERBOSE) == VERBOSE)
+        script_argv[1] = "verbose";
+    return run(script_argv);
+}
+
+// Spawn a getty on its TTY, executing it directly unless it has to be run by sh(1), then return its PID
+static pid_t spawn_getty(const struct getty *getty)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        reset_sigmask();
+        close(profile_pipe[1]);
+        open_tty(getty->tty);
+        if likely (getty->argv != NULL)
+            execv(getty->argv[0], getty->argv);
+        else
+            execl("/bin/sh", "/bin/sh", "-c", getty->cmd, NULL);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+// Return the current monotonic time in milliseconds
+static long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/* Start leaninit-logd(8) with the read end of the log pipe as its stdin. PID 1 keeps both ends open,
+   so lines written while it is being restarted wait in the pipe. */
+static void start_logd(void)
+{
+    if (access(LOGD_PATH, X_OK) != 0)
+        return;
+    else if (log_pipe[0] == -1) {
+        if unlikely (pipe(log_pipe) != 0)
+            return;
+        fcntl(log_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(log_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    logd = fork();
+    if (logd == 0) {
+        reset_sigmask();
+        setsid();
+        dup2(log_pipe[0], STDIN_FILENO);
+        execl(LOGD_PATH, LOGD_PATH, "-d", NULL);
+        _exit(127);
+    } else if unlikely (logd == -1)
+        logd = 0;
+    logd_started = now_ms();
+}
+
+/* Start leaninit-readahead(8), which prefetches the files read during the last boot while rc(8)
+   checks and mounts the file systems, or records them when the readahead argument is given */
+static void start_readahead(void)
 {
-    pid_t getty = fork();
-    if (getty == 0) {
-        open_tty(tty);
-        return execl("/bin/sh", "/bin/sh", "-c", cmd, NULL);
+    int readahead[2];
+    if (access(READAHEAD_PATH, X_OK) != 0 || pipe(readahead) != 0)
+        return;
+    pid_t child = fork();
+    if (child == 0) {
+        reset_sigmask();
+        setsid();
+        dup2(readahead[0], STDIN_FILENO);
+        close(readahead[1]);
+        if ((flags & READAHEAD) == READAHEAD)
+            execl(READAHEAD_PATH, READAHEAD_PATH, "-r", NULL);
+        else
+            execl(READAHEAD_PATH, READAHEAD_PATH, NULL);
+        _exit(127);
+    }
+    close(readahead[0]);
+    if unlikely (child == -1) {
+        close(readahead[1]);
+        return;
+    }
+    fcntl(readahead[1], F_SETFD, FD_CLOEXEC);
+    readahead_pipe = readahead[1];
+}
+
+// Close this process's copy of the leaninit-readahead(8) pipe, which ends boot once every copy is closed
+static void stop_readahead(void)
+{
+    if (readahead_pipe != -1) {
+        close(readahead_pipe);
+        readahead_pipe = -1;
+    }
+}
+
+// Pass the write end of the log pipe on to the next script through $LEANINIT_LOG_FD, or stop passing it
+static void pass_log(bool pass)
+{
+    if (log_pipe[1] == -1)
+        return;
+    fcntl(log_pipe[1], F_SETFD, pass ? 0 : FD_CLOEXEC);
+    if (pass) {
+        char fd[12];
+        snprintf(fd, sizeof(fd), "%d", log_pipe[1]);
+        setenv("LEANINIT_LOG_FD", fd, 1);
+    } else
+        unsetenv("LEANINIT_LOG_FD");
+}
+
+// Read a whole file (files in /proc included) into a buffer that has to be freed, or return NULL on failure
+static char *read_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if unlikely (fd == -1)
+        return NULL;
+
+    char *contents = NULL;
+    size_t size = 0, used = 0;
+    ssize_t len;
+    do {
+        if (size - used < 2) {
+            char *grown = realloc(contents, size + 4096);
+            if unlikely (grown == NULL) {
+                len = -1;
+                break;
+            }
+            contents = grown;
+            size += 4096;
+        }
+        len = read(fd, contents + used, size - used - 1);
+        if (len > 0)
+            used += (size_t)len;
+    } while (len > 0 || (len == -1 && errno == EINTR));
+    close(fd);
+
+    if unlikely (len == -1) {
+        free(contents);
+        return NULL;
+    }
+    contents[used] = 0;
+    return contents;
+}
+
+// Read ttys(5) into the getty table, returning the number of entries or -1 on failure
+static ssize_t parse_ttys(const char *ttys_file_path)
+{
+    char *contents = read_file(ttys_file_path);
+    if unlikely (contents == NULL)
+        return -1;
+
+    char *rest = contents, *line;
+    while ((line = strsep(&rest, "\n")) != NULL) {
+
+        // Error checking
+        if (strlen(line) < 2 || strchr(line, '#') != NULL)
+            continue;
+        char *tty = line;
+        char *cmd = strsep(&tty, ":");
+        if (tty == NULL || strlen(cmd) < 2 || strlen(tty) < 2)
+            continue;
+
+        // Grow the table
+        struct getty *grown = realloc(gettys, (ngettys + 1) * sizeof(struct getty));
+        if unlikely (grown == NULL)
+            break;
+        gettys = grown;
+        gettys[ngettys] = (struct getty) { .cmd = strdup(cmd), .tty = strdup(tty), .pidfd = -1 };
+        if unlikely (gettys[ngettys].cmd == NULL || gettys[ngettys].tty == NULL)
+            break;
+
+        // Split the command once, so the getty is executed without a shell every time it is respawned
+        size_t words = strlen(cmd) / 2 + 2;
+        char **argv = malloc(words * sizeof(char *) + strlen(cmd) + 1);
+        if likely (argv != NULL) {
+            char *copy = (char *)(argv + words);
+            memcpy(copy, cmd, strlen(cmd) + 1);
+            if (split_command(copy, argv, (int)words) > 0)
+                gettys[ngettys].argv = argv;
+            else
+                free(argv);
+        }
+        ngettys++;
+    }
+
+    free(contents);
+    return (ssize_t)ngettys;
+}
+
+#if defined(__linux__)
+/* Watch every getty through SIGCHLD from now on, for when one of them could not get a pidfd because the kernel is
+   older than Linux 5.3 or the process is out of descriptors. Gettys that already have a pidfd keep it. */
+static void watch_sigchld(int loop)
+{
+    if (!getty_pidfds)
+        return;
+    getty_pidfds = false;
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = SIZE_MAX };
+    epoll_ctl(loop, EPOLL_CTL_ADD, getty_sigchld, &event);
+}
+#endif
+
+// Spawn the getty at the given index and watch for it to exit
+static void start_getty(int loop, size_t index)
+{
+    struct getty *getty = &gettys[index];
+    getty->pid = spawn_getty(getty);
+    getty->started = now_ms();
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "getty:%s", getty->tty);
+    profile(PROF_MARK, name, NULL);
+    getty->respawn_at = 0;
+    if unlikely (getty->pid == -1) {
+        getty->pid = 0;
+        getty->respawn_at = getty->started + GETTY_MAX_DELAY;
+        return;
     }
 
-    return getty;
+#if defined(__linux__)
+    // Each getty gets a pidfd, so its exit maps straight to its entry in the table
+    if unlikely (!getty_pidfds)
+        return;
+    getty->pidfd = (int)syscall(SYS_pidfd_open, getty->pid, 0);
+    if unlikely (getty->pidfd == -1) {
+        watch_sigchld(loop);
+        return;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = index };
+    epoll_ctl(loop, EPOLL_CTL_ADD, getty->pidfd, &event);
+#else
+    struct kevent change;
+    EV_SET(&change, getty->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, (void *)index);
+    kevent(loop, &change, 1, NULL, 0, NULL);
+#endif
 }
 
+// Reap an exited getty, then decide when it should be respawned
+static void getty_exited(size_t index)
+{
+    if unlikely (index >= ngettys)
+        return;
+    struct getty *getty = &gettys[index];
+    int status = 0;
+    if (getty->pid == 0 || waitpid(getty->pid, &status, WNOHANG) <= 0)
+        return;
+    if (getty->pidfd != -1) {
+        close(getty->pidfd);
+        getty->pidfd = -1;
+    }
+    getty->pid = 0;
+
+    // A getty that ran for long enough (a normal logout) is respawned right away
+    long long now = now_ms();
+    if (now - getty->started >= GETTY_MIN_UPTIME) {
+        getty->failures = 0;
+        getty->respawn_at = now;
+        return;
+    }
+
+    // Otherwise back off exponentially, and warn on the TTY once when it is crash-looping
+    getty->failures++;
+    long long delay = GETTY_BACKOFF << (getty->failures < 16 ? getty->failures - 1 : 15);
+    if (delay > GETTY_MAX_DELAY)
+        delay = GETTY_MAX_DELAY;
+    getty->respawn_at = now + delay;
+    if unlikely (getty->failures == GETTY_CRASH_LOOP) {
+        int tty = open(getty->tty, O_WRONLY | O_NOCTTY);
+        if (tty != -1) {
+            dprintf(tty,
+                    RED "* The getty on %s is crash-looping (last status %d), retrying in up to %d seconds" RESET "\n",
+                    getty->tty, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+                    GETTY_MAX_DELAY / 1000);
+            close(tty);
+        }
+    }
+}
+
+/* Hang up the session of a getty whose line was removed from ttys(5) or changed and free its entry. It is watched
+   until it exits under RETIRED_GETTY, and reap_retired() kills it if it is still running after KILL_TERM_TIMEOUT. */
+static void retire_getty(int loop, struct getty *getty)
+{
+    free(getty->cmd);
+    free(getty->argv);
+    struct retired_getty *grown = getty->pid != 0 ? realloc(retired, (nretired + 1) * sizeof(*retired)) : NULL;
+    if (grown == NULL) {
+        // Without room to watch it, a running getty is killed right away
+        if unlikely (getty->pid != 0) {
+            kill(-getty->pid, SIGKILL);
+            waitpid(getty->pid, NULL, 0);
+        }
+        if (getty->pidfd != -1)
+            close(getty->pidfd);
+        free(getty->tty);
+        return;
+    }
+    retired = grown;
+    retired[nretired++] = (struct retired_getty) {
+        .tty = getty->tty, .pid = getty->pid, .pidfd = getty->pidfd, .kill_at = now_ms() + KILL_TERM_TIMEOUT
+    };
+
+#if defined(__linux__)
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = RETIRED_GETTY };
+    if (getty->pidfd != -1)
+        epoll_ctl(loop, EPOLL_CTL_MOD, getty->pidfd, &event);
+#else
+    struct kevent change;
+    EV_SET(&change, getty->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, (void *)RETIRED_GETTY);
+    kevent(loop, &change, 1, NULL, 0, NULL);
+#endif
+    kill(-getty->pid, SIGHUP);
+    kill(-getty->pid, SIGCONT);
+}
+
+/* Finish retiring the gettys that have exited and SIGKILL the ones that are past their deadline, then start the new
+   gettys whose TTYs have been freed. Returns when the next retired getty has to be killed, or -1. */
+static long long reap_retired(int loop)
+{
+    long long now = now_ms(), next = -1;
+    for (size_t r = 0; r < nretired;) {
+        struct retired_getty *getty = &retired[r];
+        if (waitpid(getty->pid, NULL, WNOHANG) != 0) {
+            if (getty->pidfd != -1)
+                close(getty->pidfd);
+            free(getty->tty);
+            retired[r] = retired[--nretired];
+            continue;
+        }
+        if (getty->kill_at != 0 && getty->kill_at <= now) {
+            kill(-getty->pid, SIGKILL);
+            getty->kill_at = 0;
+        } else if (getty->kill_at != 0 && (next == -1 || getty->kill_at < next))
+            next = getty->kill_at;
+        r++;
+    }
+
+    // A TTY only gets its new getty once the old one is gone
+    for (size_t i = 0; i < ngettys; i++) {
+        if (gettys[i].started != 0)
+            continue;
+        bool busy = false;
+        for (size_t r = 0; r < nretired && !busy; r++)
+            busy = strcmp(retired[r].tty, gettys[i].tty) == 0;
+        if (!busy)
+            start_getty(loop, i);
+    }
+    return next;
+}
+
+/* Read ttys(5) again and apply the differences: gettys whose lines are unchanged keep running (with their respawn
+   state), the ones whose lines were removed or changed are hung up, and the new lines get a getty */
+static void reload_ttys(int loop, const char *ttys_file_path)
+{
+    struct getty *old = gettys;
+    size_t nold = ngettys;
+    gettys = NULL;
+    ngettys = 0;
+    if unlikely (parse_ttys(ttys_file_path) == -1) {
+        printf(RED "* Could not read %s, keeping the current gettys" RESET "\n", ttys_file_path);
+        gettys = old;
+        ngettys = nold;
+        return;
+    }
+
+    // Carry the unchanged gettys over, watching them under their new index
+    for (size_t i = 0; i < ngettys; i++) {
+        struct getty *getty = &gettys[i];
+        for (size_t o = 0; o < nold; o++) {
+            if (old[o].cmd == NULL || strcmp(old[o].tty, getty->tty) != 0 || strcmp(old[o].cmd, getty->cmd) != 0)
+                continue;
+            getty->pid = old[o].pid;
+            getty->pidfd = old[o].pidfd;
+            getty->failures = old[o].failures;
+            getty->started = old[o].started;
+            getty->respawn_at = old[o].respawn_at;
+#if defined(__linux__)
+            struct epoll_event event = { .events = EPOLLIN, .data.u64 = i };
+            if (getty->pidfd != -1)
+                epoll_ctl(loop, EPOLL_CTL_MOD, getty->pidfd, &event);
+#else
+            struct kevent change;
+            EV_SET(&change, getty->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, (void *)i);
+            if (getty->pid != 0)
+                kevent(loop, &change, 1, NULL, 0, NULL);
+#endif
+            free(old[o].cmd);
+            free(old[o].tty);
+            free(old[o].argv);
+            old[o].cmd = NULL;
+            break;
+        }
+    }
+
+    // Hang up the gettys that are left, then reap_retired() gives the new lines their gettys
+    for (size_t o = 0; o < nold; o++)
+        if (old[o].cmd != NULL)
+            retire_getty(loop, &old[o]);
+    free(old);
+}
+
+// Spawn a getty for every entry in ttys(5), then respawn them as they exit and apply changes to ttys(5) on SIGHUP
+static void supervise_gettys(const char *ttys_file_path)
+{
+    if unlikely (parse_ttys(ttys_file_path) == -1) {
+        printf(RED "* Could not read %s" RESET "\n", ttys_file_path);
+        return;
+    }
+
+#if defined(__linux__)
+    /* Use pidfds when the kernel supports them (Linux 5.3+), otherwise fall back to SIGCHLD and match the exited
+       PID against the table. SIGCHLD is blocked and its signalfd is opened up front either way, so that falling back
+       later can't run out of descriptors or miss a getty that has already exited (its SIGCHLD stays pending). */
+    int loop = epoll_create1(EPOLL_CLOEXEC);
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    getty_sigchld = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    int probe = (int)syscall(SYS_pidfd_open, getpid(), 0);
+    if likely (probe != -1)
+        close(probe);
+    else
+        watch_sigchld(loop);
+
+    // SIGHUP is only let through while waiting, so that a reload can't slip in between two waits
+    sigset_t hup, wait_mask;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigprocmask(SIG_BLOCK, &hup, &wait_mask);
+#else
+    int loop = kqueue();
+    struct kevent change;
+    EV_SET(&change, SIGHUP, EVFILT_SIGNAL, EV_ADD, 0, 0, (void *)SIZE_MAX);
+    kevent(loop, &change, 1, NULL, 0, NULL);
+#endif
+
+    while (true) {
+        // Start the new gettys, respawn the ones whose delay has passed and find out how long to wait for the next one
+        long long next = reap_retired(loop), now = now_ms();
+        for (size_t i = 0; i < ngettys; i++) {
+            if (gettys[i].pid != 0 || gettys[i].respawn_at == 0)
+                continue;
+            if (gettys[i].respawn_at <= now)
+                start_getty(loop, i);
+            else if (next == -1 || gettys[i].respawn_at < next)
+                next = gettys[i].respawn_at;
+        }
+        int timeout = next == -1 ? -1 : next > now ? (int)(next - now) : 0;
+
+#if defined(__linux__)
+        struct epoll_event events[16];
+        int count = epoll_pwait(loop, events, 16, timeout, &wait_mask);
+        for (int e = 0; e < count; e++) {
+            if (events[e].data.u64 == RETIRED_GETTY)
+                continue;
+            else if likely (events[e].data.u64 != SIZE_MAX) {
+                getty_exited((size_t)events[e].data.u64);
+                continue;
+            }
+            struct signalfd_siginfo info;
+            while (read(getty_sigchld, &info, sizeof(info)) == sizeof(info))
+                ;
+            for (size_t i = 0; i < ngettys; i++)
+                if (gettys[i].pid != 0)
+                    getty_exited(i);
+        }
+#else
+        struct kevent events[16];
+        struct timespec wait = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+        int count = kevent(loop, NULL, 0, events, 16, timeout == -1 ? NULL : &wait);
+        for (int e = 0; e < count; e++)
+            if (events[e].filter == EVFILT_PROC && (size_t)events[e].udata != RETIRED_GETTY)
+                getty_exited((size_t)events[e].udata);
+#endif
+        if (reload_gettys) {
+            reload_gettys = 0;
+            reload_ttys(loop, ttys_file_path);
+        }
+    }
+}
+
+#if defined(__linux__)
+// Return every mount point in /proc/self/mountinfo as one string, with each surrounded by newlines
+static char *read_mountinfo(void)
+{
+    char *mountinfo = read_file("/proc/self/mountinfo");
+    if unlikely (mountinfo == NULL)
+        return NULL;
+
+    char *points = NULL, *rest = mountinfo, *line;
+    size_t used = 0;
+    while ((line = strsep(&rest, "\n")) != NULL) {
+        // The mount point is the fifth field
+        char *field = line;
+        for (int i = 0; i < 4 && field != NULL; i++)
+            field = strchr(field, ' ') != NULL ? strchr(field, ' ') + 1 : NULL;
+        if unlikely (field == NULL)
+            continue;
+        size_t len = strcspn(field, " ");
+
+        char *grown = realloc(points, used + len + 3);
+        if unlikely (grown == NULL)
+            break;
+        points = grown;
+        if (used == 0)
+            points[used++] = '\n';
+        memcpy(points + used, field, len);
+        used += len;
+        points[used++] = '\n';
+        points[used] = 0;
+    }
+
+    free(mountinfo);
+    return points;
+}
+
+// Mount everything in pseudo_fs[] that isn't mounted yet, then tell rc(8) which stages it can skip
+static void mount_pseudo_fs(void)
+{
+    profile(PROF_BEGIN, "pseudofs", NULL);
+
+    // /proc has to be mounted before /proc/self/mountinfo can be read
+    if (access("/proc/self/mountinfo", R_OK) != 0)
+        mount(pseudo_fs[0].source, pseudo_fs[0].target, pseudo_fs[0].type, pseudo_fs[0].flags, pseudo_fs[0].data);
+    char *mounted = read_mountinfo();
+    bool secondary = access(ENABLED_DIR "/mountpfs", F_OK) == 0, failed = false;
+
+    char point[PATH_MAX + 3];
+    for (size_t i = 0; i < sizeof(pseudo_fs) / sizeof(struct pseudo_fs); i++) {
+        const struct pseudo_fs *fs = &pseudo_fs[i];
+        if (fs->stage == PFS_SECONDARY && !secondary)
+            continue;
+        snprintf(point, sizeof(point), "\n%s\n", fs->target);
+        if (mounted != NULL && strstr(mounted, point) != NULL)
+            continue;
+
+        mkdir(fs->target, 0755);
+        if unlikely (mount(fs->source, fs->target, fs->type, fs->flags, fs->data) != 0 && fs->stage == PFS_PRIMARY) {
+            printf(RED "* Could not mount %s: %s" RESET "\n", fs->target, strerror(errno));
+            failed = true;
+        }
+    }
+    free(mounted);
+
+    if likely (!failed)
+        setenv("LEANINIT_PSEUDOFS", secondary ? "all" : "primary", 1);
+    profile(failed ? PROF_FAIL : PROF_END, "pseudofs", NULL);
+}
+#endif
+
 // Return the accessible file path or NULL if neither are
 static char *get_file_path(char *restrict primary, char *restrict fallback, int amode)
 {
@@ -135,15 +902,22 @@ static cold void single(void)
 {
     struct timespec delay = { 0 };
 
-    // Get the user's shell
-    char *shell = malloc(PATH_MAX);
-    if unlikely (shell == NULL) {
-        printf(RED "* Memory allocation failed" RESET "\n");
-        perror(RED "* malloc()");
-        goto reboot;
+    // Start the services enabled for single user mode that aren't running yet, see leaninit-sched(8)
+    if (access(SCHED_PATH, X_OK) == 0) {
+        char *sched_argv[] = { SCHED_PATH, "-r", "single", "silent", NULL };
+        if ((flags & VERBOSE) == VERBOSE)
+            sched_argv[3] = "verbose";
+        int exit_status = run(sched_argv);
+        if unlikely (exit_status != 0)
+            printf(RED "* " SCHED_PATH " has failed (status %d)" RESET "\n", exit_status);
     }
+
+    // Get the user's shell
+    char shell[PATH_MAX];
     printf(CYAN "* " WHITE "Shell to use for single user (defaults to /bin/sh):" RESET " ");
-    if (fgets(shell, PATH_MAX, stdin) != NULL) {
+    ssize_t len = read(STDIN_FILENO, shell, sizeof(shell) - 1);
+    if (len > 0) {
+        shell[len] = 0;
         shell[strcspn(shell, "\n")] = 0; // We don't want the newline
         if (access(shell, X_OK) != 0) {
             printf(PURPLE "* " YELLOW "Shell '%s' is invalid, defaulting to /bin/sh..." RESET "\n", shell);
@@ -156,32 +930,31 @@ static cold void single(void)
     }
 
     // The actual shell
-    pid_t sh = fork();
+    profile(PROF_MARK, "single", NULL);
+    pid_t sh = single_shell = fork();
     if (sh == 0) {
+        reset_sigmask();
+        close(profile_pipe[1]);
         open_tty(DEFAULT_TTY);
         execve(shell, (char *[]) { shell, "-l", NULL }, environ);
         printf(RED "* Failed to launch %s" RESET "\n", shell);
         perror(RED "* execve()");
     }
 
-    // Free memory of the previous input
-    free(shell);
-
     /*
      * When the shell has finished running, automatically reboot. The small delay
-     * is to make sure the SIGINT signal sent by this thread doesn't conflict with
+     * is to make sure the SIGINT signal sent by this process doesn't conflict with
      * a possible `exec leaninit 5`.
      */
     waitpid(sh, NULL, 0);
-reboot:
     delay.tv_nsec = 50000000;
     while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
         ;
     kill(1, SIGINT);
 }
 
-// Execute rc(8) and getty(8) (multi-user)
-static void multi(void)
+// Execute rc(8) and getty(8) (multi-user), returning RUNLEVEL_FALLBACK if single user has to be used instead
+static int multi(void)
 {
     // Locate rc
     char *rc = get_file_path("/etc/leaninit/rc", "/etc/rc", X_OK);
@@ -189,135 +962,871 @@ static void multi(void)
         printf(PURPLE "* " YELLOW
                       "Neither /etc/rc or /etc/leaninit/rc could be found, falling back to single user mode..." RESET
                       "\n");
-        flags ^= SINGLE_USER;
-        return single();
+        return RUNLEVEL_FALLBACK;
     }
 
+    // Tell rc to leave starting services to leaninit-sched(8) when it is available
+    bool sched = access(SCHED_PATH, X_OK) == 0;
+    if likely (sched)
+        setenv("LEANINIT_SCHED", "1", 1);
+    else
+        unsetenv("LEANINIT_SCHED");
+
     // Run rc
     if ((flags & VERBOSE) == VERBOSE)
         printf(CYAN "* " WHITE "Executing %s..." RESET "\n", rc);
+    profile(PROF_BEGIN, "rc", NULL);
+    pass_log(true);
     int exit_status = sh(rc);
+    pass_log(false);
+    profile(exit_status == 0 ? PROF_END : PROF_FAIL, "rc", NULL);
     if unlikely (exit_status != 0) {
         printf(RED "* %s has failed (status %d), falling back to single user mode..." RESET "\n", rc, exit_status);
-        flags ^= SINGLE_USER;
-        return single();
+        return RUNLEVEL_FALLBACK;
+    }
+
+    /* Start all enabled services in dependency order. leaninit-sched(8) returns once the settings service
+       has set the hostname for getty, then keeps starting the remaining services in the background. */
+    if likely (sched) {
+        char *sched_argv[] = { SCHED_PATH, "-w", "settings", "silent", NULL };
+        if ((flags & VERBOSE) == VERBOSE)
+            sched_argv[3] = "verbose";
+        exit_status = run(sched_argv);
+        if unlikely (exit_status != 0)
+            printf(RED "* " SCHED_PATH " has failed (status %d)" RESET "\n", exit_status);
     }
 
     // Locate ttys(5)
     const char *ttys_file_path = get_file_path("/etc/leaninit/ttys", "/etc/ttys", R_OK);
     if unlikely (!ttys_file_path) {
         printf(RED "* Could not execute either /etc/leaninit/ttys or /etc/ttys" RESET "\n");
-        return;
+        return 0;
     }
 
-    // Start a child process (for managing getty with plain wait(2))
-    pid_t child = fork();
-    if unlikely (child == -1) {
-        printf(RED "* The child process for managing getty could not be created" RESET "\n");
+    /* Supervise getty from the runlevel process, which is where boot ends for leaninit-readahead(8). Staying in
+       the runlevel process lets PID 1 end the sessions on every TTY when it switches runlevels. */
+    stop_readahead();
+    supervise_gettys(ttys_file_path);
+    return 0;
+}
+
+// Run either single() for single user or multi() for multi user, returning the exit status of the runlevel process
+static int chlvl(void)
+{
+    if unlikely ((flags & SINGLE_USER) == SINGLE_USER) { // Most people boot into multi-user
+        stop_readahead();
+        single();
+        return 0;
+    }
+    return multi();
+}
+
+/* Hang up the sessions started by the runlevel process (the gettys and the single user shell), then exit. PID 1
+   sends it SIGTERM when it switches runlevels without stopping everything else. */
+static void end_sessions(int signal)
+{
+    (void)signal;
+    for (size_t i = 0; i < ngettys; i++)
+        if (gettys[i].pid > 0) {
+            kill(-gettys[i].pid, SIGHUP);
+            kill(-gettys[i].pid, SIGCONT);
+        }
+    for (size_t r = 0; r < nretired; r++) // These have already been hung up
+        kill(-retired[r].pid, SIGKILL);
+    if (single_shell > 0) {
+        kill(-single_shell, SIGHUP);
+        kill(-single_shell, SIGCONT);
+    }
+    _exit(0);
+}
+
+// Ask the getty supervisor to read ttys(5) again, which PID 1 does with SIGHUP when it reloads
+static void note_reload(int signal)
+{
+    (void)signal;
+    reload_gettys = 1;
+}
+
+/* Start the current runlevel in a separate process. It gets the default signal handling back (apart from SIGTERM
+   and SIGHUP), so signals sent to every process during shutdown are never mistaken for requests to PID 1.
+   LEANINIT_SWITCH is set for rc(8) when the previous runlevel was switched from instead of shut down. */
+static void start_runlevel(bool switched)
+{
+    runlevel = fork();
+    if (runlevel == 0) {
+#if !defined(__linux__)
+        for (int signal = 1; signal < NSIG; signal++)
+            if (sigismember(&handled_signals, signal))
+                sigaction(signal, &(struct sigaction) { .sa_handler = SIG_DFL }, NULL);
+        close(signal_pipe[1]);
+#endif
+        if (control_fd != -1)
+            close(control_fd);
+        for (size_t i = 0; i < nclients; i++)
+            close(clients[i].fd);
+        sigaction(SIGTERM, &(struct sigaction) { .sa_handler = end_sessions }, NULL);
+        sigaction(SIGHUP, &(struct sigaction) { .sa_handler = note_reload }, NULL);
+        if (switched)
+            setenv("LEANINIT_SWITCH", "1", 1);
+        else
+            unsetenv("LEANINIT_SWITCH");
+        reset_sigmask();
+        exit(chlvl());
+    } else if unlikely (runlevel == -1) {
+        printf(RED "* The child process for the runlevel could not be created" RESET "\n");
         perror(RED "* fork()");
-        return;
-    } else if (child != 0)
-        return;
+        runlevel = 0;
+    }
+}
 
-    // Open the ttys file (max file size 8000 bytes with 60 entries)
-    char *tofree, *data, *cmd;
-    tofree = data = malloc(8001);
-    if unlikely (data == NULL) {
-        printf(RED "* Memory allocation failed" RESET "\n");
-        perror(RED "* malloc()");
-        return;
+// Reap every child that has exited, falling back to single user if the runlevel process asks for it
+static void reap_children(void)
+{
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        record_exit(pid, status, &usage);
+        if unlikely (pid == logd) {
+            /* Restart leaninit-logd unless it can't even start, in which case the pipe is made non-blocking
+               so that nobody waits for it to be read */
+            logd = 0;
+            if ((flags & SHUTDOWN) == SHUTDOWN)
+                continue;
+            else if likely (now_ms() - logd_started >= LOGD_MIN_UPTIME)
+                start_logd();
+            else {
+                printf(RED "* " LOGD_PATH " has exited right after starting, logs will not be written" RESET "\n");
+                fcntl(log_pipe[1], F_SETFL, O_NONBLOCK);
+            }
+            continue;
+        } else if (pid != runlevel)
+            continue;
+        runlevel = 0;
+        if unlikely (WIFEXITED(status) && WEXITSTATUS(status) == RUNLEVEL_FALLBACK) {
+            flags |= SINGLE_USER;
+            start_runlevel(false);
+        }
     }
-    unsigned char entry = 0;
-    struct getty_t {
-        const char *cmd;
-        const char *tty;
-        pid_t pid;
-    } getty[60];
-    FILE *ttys_file = fopen(ttys_file_path, "r");
-    while (fgets(data, 8001, ttys_file) && entry != 60) {
+}
 
-        // Error checking
-        if (strlen(data) < 2 || strchr(data, '#') != NULL)
+// Return the control request matching a queued signal
+static uint8_t control_type(int signal)
+{
+    for (uint8_t type = CTL_HALT; type <= CTL_RELOAD; type++)
+        if (control_signals[type] == signal)
+            return type;
+#if defined(__linux__)
+    if (signal == SIGKEXEC)
+        return CTL_KEXEC;
+#endif
+    return 0;
+}
+
+// Send a reply to a client, returning false if it has gone away
+static bool send_reply(int client, struct control_reply *reply)
+{
+    reply->magic = CONTROL_MAGIC;
+    reply->runlevel = (flags & SINGLE_USER) == SINGLE_USER ? CTL_SINGLE : CTL_MULTI;
+    reply->pending = control_type(requests.final != 0 ? requests.final : requests.runlevel != 0 ? requests.runlevel
+                                                                      : requests.reload       ? SIGHUP
+                                                                                              : 0);
+    return send(client, reply, sizeof(*reply), MSG_NOSIGNAL) == sizeof(*reply);
+}
+
+// Tell every waiting client that a phase of the shutdown has started, or close their connections once it is done
+static void progress(uint8_t phase, bool done)
+{
+    struct control_reply reply = { .result = done ? CTL_DONE : CTL_PROGRESS, .phase = phase };
+    size_t kept = 0;
+    for (size_t i = 0; i < nwaiters; i++) {
+        if (send_reply(waiters[i], &reply) && !done)
+            waiters[kept++] = waiters[i];
+        else
+            close(waiters[i]);
+    }
+    nwaiters = kept;
+}
+
+// Return true if any process other than PID 1, a zombie or a kernel thread is still running
+static bool processes_left(void)
+{
+#if defined(__linux__)
+    DIR *proc = opendir("/proc");
+    if unlikely (proc == NULL)
+        return kill(-1, 0) == 0;
+
+    bool found = false;
+    struct dirent *ent;
+    while (!found && (ent = readdir(proc)) != NULL) {
+        if (ent->d_name[0] < '1' || ent->d_name[0] > '9' || strcmp(ent->d_name, "1") == 0)
+            continue;
+
+        char path[PATH_MAX], stat[512];
+        snprintf(path, sizeof(path), "/proc/%s/stat", ent->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
             continue;
-        cmd = strsep(&data, ":");
-        if (strlen(cmd) < 2 || strlen(data) < 2)
+        ssize_t len = read(fd, stat, sizeof(stat) - 1);
+        close(fd);
+        if (len <= 0)
             continue;
+        stat[len] = 0;
 
-        // Spawn a getty
-        entry++;
-        getty[entry].pid = spawn_getty(cmd, data);
-        getty[entry].cmd = cmd;
-        getty[entry].tty = data;
+        // The state and, five fields later, the flags come after the command name, which may contain anything
+        char *fields = strrchr(stat, ')');
+        if (fields == NULL || fields[1] != ' ')
+            continue;
+        char state = fields[2], *field = fields + 2;
+        for (int i = 0; i < 6 && field != NULL; i++)
+            field = strchr(field, ' ') != NULL ? strchr(field, ' ') + 1 : NULL;
+        if (field == NULL)
+            continue;
+        unsigned long proc_flags = strtoul(field, NULL, 10);
+        found = state != 'Z' && state != 'X' && (proc_flags & 0x00200000) == 0; // PF_KTHREAD
     }
 
-    // Close the ttys file and free the buffer from memory
-    fclose(ttys_file);
-    free(tofree);
+    closedir(proc);
+    return found;
+#else
+    // kill(2) skips system processes on FreeBSD and NetBSD, so ESRCH means nothing is left
+    return kill(-1, 0) == 0 || errno != ESRCH;
+#endif
+}
 
-    // Start the loop
-    while (true) {
-        int status;
-        pid_t closed_pid = wait(&status);
-        if unlikely (closed_pid == -1)
-            return;
+// Wait until no processes are left or the timeout has passed, returning true if none are left
+static bool wait_for_processes(long long timeout)
+{
+    long long deadline = now_ms() + timeout;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = KILL_INTERVAL * 1000000L };
+    while (processes_left()) {
+        if (now_ms() >= deadline)
+            return false;
+        nanosleep(&interval, NULL);
+        reap_children();
+    }
+    return true;
+}
 
-        // Match the closed PID to the getty in the index
-        for (unsigned char e = 1; e <= entry; e++) {
-            if (getty[e].pid != closed_pid)
-                continue;
+/* Send SIGTERM to every process, then SIGKILL to whatever is still running once KILL_TERM_TIMEOUT
+   has passed. Both phases end as soon as no processes are left. */
+static void kill_processes(void)
+{
+    profile(PROF_BEGIN, "kill", NULL);
+    progress(PHASE_KILL, false);
+    if ((flags & VERBOSE) == VERBOSE)
+        printf(CYAN "* " WHITE "Sending SIGCONT and SIGTERM to all processes..." RESET "\n");
+    kill(-1, SIGCONT);
+    kill(-1, SIGTERM);
+    if (!wait_for_processes(KILL_TERM_TIMEOUT)) {
+        printf(CYAN "* " WHITE "Sending SIGKILL to all processes..." RESET "\n");
+        kill(-1, SIGKILL);
+        wait_for_processes(KILL_TIMEOUT);
+    }
+    profile(PROF_END, "kill", NULL);
+}
 
-            // Do not spam the TTY if the getty failed
-            if unlikely (WEXITSTATUS(status) != 0) {
-                open_tty(getty[e].tty);
-                printf(RED "* The getty on %s has exited with a return status of %d" RESET "\n", getty[e].tty,
-                       WEXITSTATUS(status));
-                getty[e].pid = 0;
-                break;
-            }
+/* Stop the running services with leaninit-sched(8), giving them no more than the given number of seconds when it
+   isn't zero. When a runlevel is given, only the services it doesn't need are stopped. */
+static void sched_stop(unsigned int deadline, char *target)
+{
+    char timeout[12];
+    snprintf(timeout, sizeof(timeout), "%u", deadline);
+    char *sched_argv[8] = { SCHED_PATH, "-s" };
+    int args = 2;
+    if (target != NULL) {
+        sched_argv[args++] = "-r";
+        sched_argv[args++] = target;
+    }
+    if (deadline != 0) {
+        sched_argv[args++] = "-t";
+        sched_argv[args++] = timeout;
+    }
+    sched_argv[args] = (flags & VERBOSE) == VERBOSE ? "verbose" : "silent";
+    int exit_status = run(sched_argv);
+    if unlikely (exit_status != 0)
+        printf(RED "* " SCHED_PATH " has failed (status %d)" RESET "\n", exit_status);
+}
 
-            // Respawn the getty
-            getty[e].pid = spawn_getty(getty[e].cmd, getty[e].tty);
-            break;
-        }
+// Stop all services, then kill everything left. Returns false if leaninit-sched(8) is not installed.
+static bool stop_services(unsigned int deadline)
+{
+    if unlikely (access(SCHED_PATH, X_OK) != 0)
+        return false;
+    sched_stop(deadline, NULL);
+    kill_processes();
+    return true;
+}
+
+// Have the runlevel process hang up its sessions and exit, killing it if it is still running after KILL_TERM_TIMEOUT
+static void stop_runlevel(void)
+{
+    if (runlevel == 0)
+        return;
+    kill(runlevel, SIGTERM);
+    long long deadline = now_ms() + KILL_TERM_TIMEOUT;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = KILL_INTERVAL * 1000000L };
+    while (runlevel != 0 && now_ms() < deadline) {
+        nanosleep(&interval, NULL);
+        reap_children();
+    }
+    if unlikely (runlevel != 0) {
+        kill(runlevel, SIGKILL);
+        runlevel = 0;
     }
 }
 
-// Run either single() for single user or multi() for multi user
-static void *chlvl(unused void *notused)
+/* Flush every file system before anything is stopped. leaninit-umount(8) flushes them in parallel and gives up on
+   any that are stuck (like an NFS mount whose server is gone), which sync(2) would wait on forever. */
+static void flush(void)
 {
-    if unlikely ((flags & SINGLE_USER) == SINGLE_USER) // Most people boot into multi-user
-        single();
-    else
-        multi();
+    char *umount_argv[] = { UMOUNT_PATH, "-s", "silent", NULL };
+    if unlikely (access(UMOUNT_PATH, X_OK) != 0 || run(umount_argv) == -1)
+        sync();
+}
+
+// Reload the running services whose configuration changed with leaninit-sched(8), when it is installed
+static void reload_services(void)
+{
+    if unlikely (access(SCHED_PATH, X_OK) != 0)
+        return;
+    char *sched_argv[] = { SCHED_PATH, "-R", "silent", NULL };
+    if ((flags & VERBOSE) == VERBOSE)
+        sched_argv[2] = "verbose";
+    int exit_status = run(sched_argv);
+    if unlikely (exit_status != 0)
+        printf(RED "* " SCHED_PATH " has failed (status %d)" RESET "\n", exit_status);
+}
 
-    return NULL;
+/* Switch between single user and multi-user without a shutdown: hang up the sessions of the current runlevel and
+   stop only the services the new one doesn't need, leaving everything else running (reloaded if its configuration
+   changed) and the file systems mounted. Returns false if leaninit-sched(8) is not installed, since the transition
+   can't be planned without it. */
+static bool switch_runlevel(unsigned int deadline)
+{
+    if unlikely (access(SCHED_PATH, X_OK) != 0)
+        return false;
+
+    profile(PROF_BEGIN, "switch", NULL);
+    progress(PHASE_SWITCH, false);
+    flush();
+    stop_runlevel();
+    flags ^= SINGLE_USER;
+    sched_stop(deadline, (flags & SINGLE_USER) == SINGLE_USER ? "single" : "multi");
+    reload_services();
+    profile(PROF_END, "switch", NULL);
+    progress(PHASE_START, false);
+    return true;
+}
+
+/* Reload the configuration without disturbing anything else: leaninit-sched(8) reloads the services whose
+   rc.conf(5) variables or rc.conf.d file changed, and the runlevel process applies the changes to ttys(5) */
+static void reload(void)
+{
+    profile(PROF_BEGIN, "reload", NULL);
+    reload_services();
+    if (runlevel != 0)
+        kill(runlevel, SIGHUP);
+    profile(PROF_END, "reload", NULL);
 }
 
 // This fallback is used if rc.shutdown(8) fails
 static cold void shutdown_fallback(int exit_status)
 {
     if (exit_status != 0)
-        printf(RED "* rc.shutdown(8) failed (status %d), sending SIGCONT and SIGTERM to all processes..." RESET "\n",
-               exit_status);
+        printf(RED "* rc.shutdown(8) failed (status %d), stopping all processes..." RESET "\n", exit_status);
     else
-        printf(PURPLE "* " YELLOW "rc.shutdown(8) failed, sending SIGCONT and SIGTERM to all processes..." RESET "\n");
-    kill(-1, SIGCONT);
-    kill(-1, SIGTERM);
-    sleep(1);
-    printf(CYAN "* " WHITE "Sending SIGKILL to all processes..." RESET "\n");
-    kill(-1, SIGKILL);
+        printf(PURPLE "* " YELLOW "rc.shutdown(8) failed, stopping all processes..." RESET "\n");
+    kill_processes();
+}
+
+#if !defined(__linux__)
+// Pass the signal sent to PID 1 to the event loop through the self-pipe
+static void sighandle(int signal)
+{
+    int saved_errno = errno;
+    unsigned char byte = (unsigned char)signal;
+    write(signal_pipe[1], &byte, 1);
+    errno = saved_errno;
+}
+#endif
+
+// Create the pipe for the boot profiler and pass its write end on to every child through the environment
+static void setup_profiler(void)
+{
+    if unlikely (pipe(profile_pipe) != 0)
+        return;
+    fcntl(profile_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(profile_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(profile_pipe[1], F_SETFL, O_NONBLOCK); // Records are dropped rather than blocking anyone when it is full
+
+    char fd[12];
+    snprintf(fd, sizeof(fd), "%d", profile_pipe[1]);
+    setenv("LEANINIT_PROFILE_FD", fd, 1);
+}
+
+// Move every record waiting in the profiler's pipe into its ring buffer
+static void read_profile(void)
+{
+    struct profile_record record;
+    while (read(profile_pipe[0], &record, sizeof(record)) == sizeof(record))
+        push_ring(&profile_ring, &record);
+}
+
+// Route all signals handled by PID 1 into the event loop (signalfd(2) on Linux, a self-pipe elsewhere)
+static void setup_signals(void)
+{
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGUSR1); // Halt
+    sigaddset(&handled_signals, SIGUSR2); // Poweroff
+    sigaddset(&handled_signals, SIGTERM); // Single-user
+    sigaddset(&handled_signals, SIGILL);  // Multi-user
+    sigaddset(&handled_signals, SIGHUP);  // Reload everything
+    sigaddset(&handled_signals, SIGINT);  // Reboot
+    sigaddset(&handled_signals, SIGCHLD); // Reap children
+
+#if defined(__linux__)
+    sigaddset(&handled_signals, SIGKEXEC); // Reboot into the kernel loaded by reboot --kexec
+
+    // The signals must be blocked so that they are only delivered to signal_fd
+    sigprocmask(SIG_BLOCK, &handled_signals, NULL);
+    signal_fd = signalfd(-1, &handled_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = EV_SIGNAL };
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, signal_fd, &event);
+    if likely (profile_pipe[0] != -1) {
+        event.data.u32 = EV_PROFILE;
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, profile_pipe[0], &event);
+    }
+#else
+    pipe(signal_pipe);
+    for (int i = 0; i < 2; i++) {
+        fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+    signal_fd = signal_pipe[0];
+
+    struct sigaction actor;
+    actor.sa_handler = sighandle;
+    actor.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&actor.sa_mask);
+    for (int signal = 1; signal < NSIG; signal++)
+        if (sigismember(&handled_signals, signal))
+            sigaction(signal, &actor, NULL);
+#endif
 }
 
-// This perpetual loop kills all zombie processes without blowing out CPU usage when there are none
-static noreturn void *zloop(unused void *notused)
+// Queue a signal sent to PID 1, returning CTL_MERGED when it was coalesced with a request that is still waiting
+static int queue_request(int signal)
 {
-    while (true)
-        if unlikely (wait(NULL) == -1)
-            sleep(1);
+#if defined(__linux__)
+    // A kexec reboot is queued like any other reboot (SIGKEXEC can't be used as a case label)
+    if (signal == SIGKEXEC) {
+        if (requests.final != 0)
+            return CTL_MERGED;
+        requests.final = signal;
+        return CTL_QUEUED;
+    }
+#endif
+    switch (signal) {
+        case SIGUSR1:
+        case SIGUSR2:
+        case SIGINT:
+            if (requests.final != 0)
+                return CTL_MERGED;
+            requests.final = signal;
+            break;
+        case SIGTERM:
+        case SIGILL:
+            if (requests.final != 0 || requests.runlevel == signal) {
+                requests.runlevel = requests.final != 0 ? requests.runlevel : signal;
+                return CTL_MERGED;
+            }
+            requests.runlevel = signal;
+            break;
+        case SIGHUP:
+            if (requests.final != 0 || requests.runlevel != 0 || requests.reload)
+                return CTL_MERGED;
+            requests.reload = true;
+            break;
+    }
+    return CTL_QUEUED;
 }
 
-// Set current_signal to the signal sent to PID 1
-static void sighandle(int signal) { current_signal = signal; }
+// Read every signal waiting in signal_fd into the request queue, reaping children on SIGCHLD
+static void read_signals(void)
+{
+    bool sigchld = false;
+#if defined(__linux__)
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD)
+            sigchld = true;
+        else
+            queue_request((int)info.ssi_signo);
+    }
+#else
+    unsigned char byte;
+    while (read(signal_fd, &byte, 1) == 1) {
+        if (byte == SIGCHLD)
+            sigchld = true;
+        else
+            queue_request(byte);
+    }
+#endif
+    if (sigchld)
+        reap_children();
+}
+
+// Take the most important request from the queue along with its deadline, or return 0 if there are none
+static int next_request(unsigned int *deadline)
+{
+    int signal = 0;
+    *deadline = requests.deadline;
+    if (requests.final != 0) {
+        signal = requests.final; // Nothing else matters once the system is going down
+        requests.final = requests.runlevel = 0;
+        requests.reload = false;
+        requests.deadline = 0;
+    } else if (requests.runlevel != 0) {
+        signal = requests.runlevel;
+        requests.runlevel = 0;
+        requests.reload = false;
+        requests.deadline = 0;
+    } else if (requests.reload) {
+        signal = SIGHUP;
+        requests.reload = false;
+    }
+    return signal;
+}
+
+// Listen on the control socket, replacing whatever is left at CONTROL_PATH from a previous boot
+static void open_control(void)
+{
+    mkdir("/var/run/leaninit", 0755);
+    unlink(CONTROL_PATH);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if unlikely (fd == -1)
+        return;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    // Anyone can query the state of the system, but only root can change it (see handle_client())
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = CONTROL_PATH };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(CONTROL_PATH, 0666) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return;
+    }
+    control_fd = fd;
+#if defined(__linux__)
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = EV_CONTROL };
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, control_fd, &event);
+#endif
+}
+
+// Return the uid of the process on the other end of a connection, or -1 if it can't be found
+static uid_t peer_uid(int client)
+{
+#if defined(__linux__)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if unlikely (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return (uid_t)-1;
+    return cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if unlikely (getpeereid(client, &uid, &gid) != 0)
+        return (uid_t)-1;
+    return uid;
+#endif
+}
+
+// Answer a query about a service from its files in /var/run/leaninit
+static void query_service(const char *name, struct control_reply *reply)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), ENABLED_DIR "/%s", name);
+    reply->enabled = access(path, F_OK) == 0;
+
+    // Read the service's entry in the state table, falling back to its .status and .pid files
+    struct state_table *table = state_open(false, NULL);
+    if (table != NULL) {
+        struct state_entry entry;
+        if (state_read(table, name, &entry) && entry.state != SVC_STOPPED) {
+            snprintf(reply->text, sizeof(reply->text), "%s", state_names[entry.state]);
+            reply->pid = entry.npids ? entry.pids[0] : 0;
+        }
+        munmap(table, sizeof(*table));
+        return;
+    }
+
+    snprintf(path, sizeof(path), "/var/run/leaninit/%s.status", name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        ssize_t len = read(fd, reply->text, sizeof(reply->text) - 1);
+        reply->text[len > 0 ? len : 0] = 0;
+        reply->text[strcspn(reply->text, "\n")] = 0;
+        close(fd);
+    }
+
+    snprintf(path, sizeof(path), "/var/run/leaninit/%s.pid", name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        char pid[16];
+        ssize_t len = read(fd, pid, sizeof(pid) - 1);
+        pid[len > 0 ? len : 0] = 0;
+        reply->pid = (pid_t)strtol(pid, NULL, 10);
+        close(fd);
+    }
+}
+
+/* Read the request of a client and answer it, keeping the connection open if the runlevel will change. Returns false
+   without doing anything if the request hasn't arrived yet. */
+static bool handle_client(int client, uid_t uid)
+{
+    struct control_request request;
+    struct control_reply reply = { .result = CTL_INVALID };
+    ssize_t len = read(client, &request, sizeof(request));
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return false;
+
+    // Queue the signals sent before this request first, so requests are always handled in the order they were sent
+    read_signals();
+    if unlikely (len != sizeof(request) || request.magic != CONTROL_MAGIC) {
+        send_reply(client, &reply);
+        close(client);
+        return true;
+    }
+    request.name[NAME_MAX] = 0;
+
+    switch (request.type) {
+        case CTL_STATUS:
+            reply.result = CTL_ANSWER;
+            reply.pid = runlevel;
+            break;
+        case CTL_SERVICE:
+            if unlikely (request.name[0] == 0 || request.name[0] == '.' || strchr(request.name, '/') != NULL)
+                break;
+            reply.result = CTL_ANSWER;
+            query_service(request.name, &reply);
+            break;
+        case CTL_HALT:
+        case CTL_POWEROFF:
+        case CTL_REBOOT:
+        case CTL_SINGLE:
+        case CTL_MULTI:
+        case CTL_RELOAD:
+#if defined(__linux__)
+        case CTL_KEXEC:
+#endif
+            if unlikely (uid != 0) {
+                reply.result = CTL_DENIED;
+                break;
+            }
+#if defined(__linux__)
+            int signal = request.type == CTL_KEXEC ? SIGKEXEC : control_signals[request.type];
+#else
+            int signal = control_signals[request.type];
+#endif
+            if ((signal == SIGTERM && (flags & SINGLE_USER) == SINGLE_USER && requests.runlevel == 0)
+                || (signal == SIGILL && (flags & SINGLE_USER) != SINGLE_USER && requests.runlevel == 0)) {
+                reply.result = CTL_CURRENT;
+                break;
+            }
+            reply.result = (uint8_t)queue_request(signal);
+            if (request.deadline != 0 && (requests.deadline == 0 || request.deadline < requests.deadline))
+                requests.deadline = request.deadline;
+
+            // Keep the connection for progress replies
+            int *grown = realloc(waiters, (nwaiters + 1) * sizeof(int));
+            if likely (grown != NULL && send_reply(client, &reply)) {
+                waiters = grown;
+                waiters[nwaiters++] = client;
+                return true;
+            }
+            waiters = grown != NULL ? grown : waiters;
+            close(client);
+            return true;
+    }
+
+    send_reply(client, &reply);
+    close(client);
+    return true;
+}
+
+// Stop waiting for the request of a client, closing its connection unless it has been handed to handle_client()
+static void drop_client(size_t index, bool close_fd)
+{
+#if defined(__linux__)
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, clients[index].fd, NULL);
+#endif
+    if (close_fd)
+        close(clients[index].fd);
+    clients[index] = clients[--nclients];
+}
+
+// Accept every pending connection on the control socket, answering right away the clients whose request is waiting
+static void accept_clients(void)
+{
+    int client;
+    while ((client = accept(control_fd, NULL, NULL)) != -1) {
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+        fcntl(client, F_SETFL, O_NONBLOCK); // Accepted sockets don't inherit O_NONBLOCK on Linux
+        uid_t uid = peer_uid(client);
+        if (handle_client(client, uid))
+            continue;
+
+        /* Make room for a client of root by dropping the oldest client (one that isn't root if there is any),
+           and turn away anyone else */
+        if unlikely (nclients == CONTROL_CLIENTS) {
+            size_t oldest = SIZE_MAX;
+            for (size_t i = 0; uid == 0 && i < nclients; i++)
+                if (oldest == SIZE_MAX || (clients[i].uid != 0) > (clients[oldest].uid != 0)
+                    || ((clients[i].uid != 0) == (clients[oldest].uid != 0)
+                        && clients[i].deadline < clients[oldest].deadline))
+                    oldest = i;
+            if (oldest == SIZE_MAX) {
+                close(client);
+                continue;
+            }
+            drop_client(oldest, true);
+        }
+        clients[nclients++] = (struct client) { client, uid, now_ms() + CONTROL_TIMEOUT * 1000LL };
+#if defined(__linux__)
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = EV_CLIENT + (uint32_t)client };
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, client, &event);
+#endif
+    }
+}
+
+// Answer the pending client with the given socket once its request has arrived
+static void read_client(int fd)
+{
+    for (size_t i = 0; i < nclients; i++)
+        if (clients[i].fd == fd) {
+            struct client client = clients[i];
+            drop_client(i, false);
+            if (!handle_client(client.fd, client.uid)) {
+                clients[nclients++] = client;
+#if defined(__linux__)
+                struct epoll_event event = { .events = EPOLLIN, .data.u32 = EV_CLIENT + (uint32_t)client.fd };
+                epoll_ctl(event_fd, EPOLL_CTL_ADD, client.fd, &event);
+#endif
+            }
+            return;
+        }
+}
+
+// Drop the clients that haven't sent their request in time, returning the milliseconds until the next one expires
+static int expire_clients(void)
+{
+    long long now = now_ms(), next = -1;
+    for (size_t i = 0; i < nclients;) {
+        if (clients[i].deadline <= now) {
+            drop_client(i, true);
+            continue;
+        }
+        if (next == -1 || clients[i].deadline - now < next)
+            next = clients[i].deadline - now;
+        i++;
+    }
+    return (int)next;
+}
+
+// Block until at least one event has been handled by the event loop
+static void wait_for_events(void)
+{
+    int timeout = expire_clients();
+#if defined(__linux__)
+    struct epoll_event events[8];
+    int count = epoll_wait(event_fd, events, 8, timeout);
+    for (int e = 0; e < count; e++) {
+        if (events[e].data.u32 == EV_SIGNAL)
+            read_signals();
+        else if (events[e].data.u32 == EV_PROFILE)
+            read_profile();
+        else if (events[e].data.u32 == EV_CONTROL)
+            accept_clients();
+        else
+            read_client((int)(events[e].data.u32 - EV_CLIENT));
+    }
+#else
+    struct pollfd fds[EV_CLIENT + CONTROL_CLIENTS] = { { .fd = signal_fd, .events = POLLIN, .revents = 0 },
+                                                       { .fd = profile_pipe[0], .events = POLLIN, .revents = 0 },
+                                                       { .fd = control_fd, .events = POLLIN, .revents = 0 } };
+    size_t nfds = EV_CLIENT;
+    for (size_t i = 0; i < nclients; i++)
+        fds[nfds++] = (struct pollfd) { .fd = clients[i].fd, .events = POLLIN, .revents = 0 };
+    if (poll(fds, (nfds_t)nfds, timeout) > 0) {
+        if (fds[EV_SIGNAL].revents & POLLIN)
+            read_signals();
+        if (fds[EV_PROFILE].revents & POLLIN)
+            read_profile();
+        for (size_t i = EV_CLIENT; i < nfds; i++)
+            if (fds[i].revents != 0)
+                read_client(fds[i].fd);
+        if (fds[EV_CONTROL].revents & POLLIN)
+            accept_clients();
+    }
+#endif
+}
+
+// Send a request to LeanInit through the control socket and print its progress, falling back to a signal
+static int request(uint8_t type, const char *deadline)
+{
+    struct control_request req = { .magic = CONTROL_MAGIC, .type = type };
+    if (deadline != NULL)
+        req.deadline = (uint32_t)strtoul(deadline, NULL, 10);
+    struct control_reply reply;
+    int fd = control_send(&req, &reply);
+    if unlikely (fd == -1)
+        return kill(1, control_signals[type]);
+    return control_follow(fd, &reply);
+}
+
+// Print the current runlevel, or the state of the given service
+static int status(const char *service)
+{
+    static const char *const names[] = { [CTL_HALT] = "halt",          [CTL_POWEROFF] = "poweroff",
+                                         [CTL_REBOOT] = "reboot",      [CTL_SINGLE] = "single user mode",
+                                         [CTL_MULTI] = "multi-user mode", [CTL_RELOAD] = "reload",
+                                         [CTL_KEXEC] = "kexec reboot" };
+    struct control_request req = { .magic = CONTROL_MAGIC, .type = service != NULL ? CTL_SERVICE : CTL_STATUS };
+    if (service != NULL) {
+        if unlikely (strlen(service) > NAME_MAX) {
+            printf(RED "* The service name %s is too long" RESET "\n", service);
+            return 1;
+        }
+        memcpy(req.name, service, strlen(service) + 1);
+    }
+
+    struct control_reply reply;
+    int fd = control_send(&req, &reply);
+    if unlikely (fd == -1) {
+        printf(RED "* LeanInit is not listening on " CONTROL_PATH RESET "\n");
+        return 1;
+    }
+    close(fd);
+    if unlikely (!control_print(&reply))
+        return 1;
+
+    if (service != NULL) {
+        printf(CYAN "* " WHITE "%s: %s" RESET " (%s", service, reply.text[0] ? reply.text : "Not running",
+               reply.enabled ? "enabled" : "disabled");
+        if (reply.pid != 0)
+            printf(", PID %d", reply.pid);
+        printf(")\n");
+        return 0;
+    }
+    printf(CYAN "* " WHITE "LeanInit is running in %s" RESET, names[reply.runlevel]);
+    if (reply.pid != 0)
+        printf(" (runlevel process %d)", reply.pid);
+    printf("\n");
+    if (reply.pending != 0)
+        printf(CYAN "* " WHITE "Waiting to handle: %s" RESET "\n", names[reply.pending]);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -326,6 +1835,9 @@ int main(int argc, char *argv[])
 
         // Open the console and login as root
         int tty = open_tty(DEFAULT_TTY);
+        setup_profiler();
+        profile(PROF_MARK, "init", NULL);
+        start_logd();
         setenv("HOME", "/root", 1);
         setenv("LOGNAME", "root", 1);
         setenv("USER", "root", 1);
@@ -350,13 +1862,28 @@ int main(int argc, char *argv[])
             else if (mode[0] == 'b' && mode[1] == 'a' && mode[2] == 'n' && mode[3] == 'n' && mode[4] == 'e'
                      && mode[5] == 'r' && !mode[6])
                 flags |= BANNER;
+
+            // Record the files read during boot (accepts 'readahead')
+            else if unlikely (mode[0] == 'r' && mode[1] == 'e' && mode[2] == 'a' && mode[3] == 'd' && mode[4] == 'a'
+                              && mode[5] == 'h' && mode[6] == 'e' && mode[7] == 'a' && mode[8] == 'd' && !mode[9])
+                flags |= READAHEAD;
         }
 
+#if defined(__linux__)
+        // Mount the pseudo file systems before anything else needs them
+        mount_pseudo_fs();
+#endif
+
+        // Prefetch the files read during the last boot while rc(8) runs
+        start_readahead();
+
         // Run rc.banner if the banner argument was passed to LeanInit
         if ((flags & BANNER) == BANNER) {
             char *rc_banner = get_file_path("/etc/leaninit/rc.banner", "/etc/rc.banner", X_OK);
             if likely (rc_banner != NULL) {
+                profile(PROF_BEGIN, "rc.banner", NULL);
                 int banner_exit_status = sh(rc_banner);
+                profile(banner_exit_status == 0 ? PROF_END : PROF_FAIL, "rc.banner", NULL);
                 if unlikely (banner_exit_status != 0)
                     printf(RED "* rc.banner(8) failed (status %d)!" RESET "\n", banner_exit_status);
             } else
@@ -371,50 +1898,92 @@ int main(int argc, char *argv[])
                    uts.sysname, uts.release, uts.machine);
         }
 
-        // Start both threads now
-        pthread_t loop, runlvl;
-        pthread_create(&runlvl, NULL, chlvl, NULL); // Create the runlevel in a separate thread
-        pthread_create(&loop, NULL, zloop, NULL);   // Start the zombie killer
-
-        // Handle all relevant signals
-        struct sigaction actor;
-        actor.sa_handler = sighandle; // Set the handler to sighandle()
-        actor.sa_flags = 0;
-        sigaction(SIGUSR1, &actor, NULL); // Halt
-        sigaction(SIGUSR2, &actor, NULL); // Poweroff
-        sigaction(SIGTERM, &actor, NULL); // Single-user
-        sigaction(SIGILL, &actor, NULL);  // Multi-user
-        sigaction(SIGHUP, &actor, NULL);  // Reload everything
-        sigaction(SIGINT, &actor, NULL);  // Reboot
-
-        // Signal handling loop
+        // Handle all relevant signals and the control socket in the event loop (before the runlevel is started)
+        setup_signals();
+        open_control();
+        start_runlevel(false);
+        stop_readahead();
+
+        // Event loop
         int stored_signal, shutdown_exit_status;
+        unsigned int deadline;
         while (true) {
 
-            // Wait for a signal, then store it to prevent race conditions
-            pause();
-            stored_signal = current_signal;
+            /* Wait for events until a request has been queued, then take the most important one. The control
+               socket is opened again if /var/run/leaninit could not be written to when LeanInit started. */
+            while ((stored_signal = next_request(&deadline)) == 0) {
+                if unlikely (control_fd == -1)
+                    open_control();
+                wait_for_events();
+            }
 
             // Cancel when the requested runlevel is already running
             if unlikely ((stored_signal == SIGILL && (flags & SINGLE_USER) != SINGLE_USER)
-                         || (stored_signal == SIGTERM && (flags & SINGLE_USER) == SINGLE_USER))
+                         || (stored_signal == SIGTERM && (flags & SINGLE_USER) == SINGLE_USER)) {
+                progress(0, true);
                 continue;
+            }
 
-            /* Finish any I/O operations before executing rc.shutdown by calling sync(2),
-               then join with the runlevel thread */
-            sync();
-            pthread_kill(runlvl, SIGKILL);
-            pthread_join(runlvl, NULL);
+            if (stored_signal == SIGHUP) {
+                reload();
+                progress(0, true);
+                continue;
+            }
+
+            // Switching between single user and multi-user only stops and starts the services that differ
+            if ((stored_signal == SIGTERM || stored_signal == SIGILL) && switch_runlevel(deadline)) {
+                close(tty);
+                tty = open_tty(DEFAULT_TTY);
+                start_runlevel(true);
+                progress(0, true);
+                continue;
+            }
+
+            /* Finish any I/O operations before executing rc.shutdown by flushing the file systems,
+               then stop the runlevel process if it is still running */
+            profile(PROF_BEGIN, "shutdown", NULL);
+            flags |= SHUTDOWN;
+            flush();
+            if (runlevel != 0) {
+                kill(runlevel, SIGKILL);
+                runlevel = 0;
+            }
+
+            /* Stop all services in reverse dependency order and kill the remaining processes,
+               leaving rc.shutdown to unmount the file systems */
+            progress(PHASE_STOP, false);
+            if likely (stop_services(deadline))
+                setenv("LEANINIT_SHUTDOWN", "1", 1);
+            else
+                unsetenv("LEANINIT_SHUTDOWN");
 
             // Run rc.shutdown (which should handle sync)
             char *rc_shutdown = get_file_path("/etc/leaninit/rc.shutdown", "/etc/rc.shutdown", X_OK);
+            progress(PHASE_SHUTDOWN, false);
             if likely (rc_shutdown != NULL) {
+                profile(PROF_BEGIN, "rc.shutdown", NULL);
+                pass_log(true);
                 shutdown_exit_status = sh(rc_shutdown);
+                pass_log(false);
+                profile(shutdown_exit_status == 0 ? PROF_END : PROF_FAIL, "rc.shutdown", NULL);
                 if unlikely (shutdown_exit_status != 0)
                     shutdown_fallback(shutdown_exit_status);
             } else
                 shutdown_fallback(0);
 
+            // Save the shutdown profile while /var/run is still mounted
+            profile(PROF_END, "shutdown", NULL);
+            read_profile();
+            progress(stored_signal != SIGTERM && stored_signal != SIGILL ? PHASE_FINAL : PHASE_START, false);
+
+#if defined(__linux__)
+            // Jump into the kernel loaded by reboot --kexec, which only returns when it has been unloaded since
+            if (stored_signal == SIGKEXEC) {
+                reboot(SYS_KEXEC);
+                return reboot(SYS_REBOOT);
+            }
+#endif
+
             // Handle the given signal properly
             switch (stored_signal) {
 
@@ -441,8 +2010,12 @@ int main(int argc, char *argv[])
             close(tty);
             tty = open_tty(DEFAULT_TTY);
 
-            // Reload the runlevel
-            pthread_create(&runlvl, NULL, chlvl, NULL);
+            // Reload the runlevel, starting leaninit-logd(8) again after it was stopped with everything else
+            flags &= ~(SHUTDOWN);
+            if (logd == 0)
+                start_logd();
+            start_runlevel(false);
+            progress(0, true);
         }
     }
 
@@ -463,7 +2036,8 @@ int main(int argc, char *argv[])
             // --help
             usage(0);
             __builtin_unreachable();
-        }
+        } else if (strcmp(argv[1], "--status") == 0)
+            return status(argv[2]);
     }
 
     // Only root can send signals to LeanInit
@@ -472,38 +2046,38 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    // Switch runlevels by sending LeanInit the correct signal
+    // Switch runlevels through the control socket (or by sending LeanInit the correct signal)
     switch (*argv[1]) {
 
         // Poweroff
         case '0':
-            return kill(1, SIGUSR2);
+            return request(CTL_POWEROFF, argv[2]);
 
         // Single-user
         case '1':
         case 'S':
         case 's':
-            return kill(1, SIGTERM);
+            return request(CTL_SINGLE, argv[2]);
 
         // Multi-user
         case '2':
         case '3':
         case '4':
         case '5':
-            return kill(1, SIGILL);
+            return request(CTL_MULTI, argv[2]);
 
         // Reload everything
         case 'Q':
         case 'q':
-            return kill(1, SIGHUP);
+            return request(CTL_RELOAD, argv[2]);
 
         // Reboot
         case '6':
-            return kill(1, SIGINT);
+            return request(CTL_REBOOT, argv[2]);
 
         // Halt
         case '7':
-            return kill(1, SIGUSR1);
+            return request(CTL_HALT, argv[2]);
 
         // Fallback
         default:
@@ -0,0 +1,570 @@
+/*
+ * Copyright © 2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * leaninit-logd -- Collect the logs of the RC system and its services
+ *
+ * init(8) starts leaninit-logd before anything else with the read end of a pipe
+ * as its stdin and passes the write end on to rc(8) through $LEANINIT_LOG_FD.
+ * Services write to the FIFO at LOG_PATH instead, and send their stderr through
+ * a FIFO of their own. Lines are kept in a ring buffer for each service until
+ * LOG_DIR can be written to, then written out in batches with a timestamp and
+ * the name of the service, renaming a log to NAME.log.old once it grows too big.
+ */
+
+#include <leaninit.h>
+
+#define LOG_RING    16384 // Bytes of unwritten lines kept for each service
+#define LOG_LINE    1024  // Longer lines are split
+#define LOG_STREAMS 256   // Services that can be logged at once, lines from any others go to the first stream
+#define LOG_DELAY   200   // Milliseconds lines are collected for before they are written
+#define LOG_RETRY   1000  // Milliseconds between attempts to write to LOG_DIR or create LOG_PATH and LOG_QUERY
+#define LOG_ROTATE  1024  // Default size in kilobytes at which a log is renamed to NAME.log.old
+#define LOG_DEFAULT "leaninit" // Stream for lines without a name
+
+// A pipe or FIFO that lines are read from
+struct input {
+    int fd;
+    int writer; // FIFOs are also opened for writing so that they never reach end-of-file
+    dev_t dev;
+    ino_t ino;
+    size_t len;
+    char line[LOG_LINE];
+};
+
+// The log of one service
+struct stream {
+    char name[NAME_MAX + 1];
+    char *ring;
+    size_t head;
+    size_t len;     // Bytes waiting to be written
+    size_t dropped; // Lines dropped since the last write because the ring buffer was full
+    int file;
+    off_t size;
+    struct input err; // The service's stderr
+};
+
+static struct stream streams[LOG_STREAMS];
+static size_t nstreams = 0;
+static struct input boot = { .fd = -1, .writer = -1 }; // The pipe from init(8)
+static struct input fifo = { .fd = -1, .writer = -1 }; // LOG_PATH
+static int query_fd = -1;
+static int signal_pipe[2] = { -1, -1 };
+static off_t rotate_size = LOG_ROTATE * 1024;
+static long long next_flush = 0; // When the lines waiting in the ring buffers are written, or zero
+
+// Show usage information
+static cold noreturn void usage(void)
+{
+    printf("Usage: %s -d [-s kilobytes]\n"
+           "    or %s -q service\n"
+           "  -d, --daemon   Collect logs (init starts leaninit-logd this way)\n"
+           "  -q, --query    Write the service's log to stdout once everything waiting for it has been written\n"
+           "  -s, --size     Rename a log to NAME.log.old once it grows past this size (defaults to %d)\n"
+           "  -?, --help     Show this usage information\n",
+           __progname, __progname, LOG_ROTATE);
+    exit(1);
+}
+
+// Return the current monotonic time in milliseconds
+static long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Return true if the given name can be used as the name of a log file
+static bool valid_name(const char *name, size_t len)
+{
+    return len != 0 && len <= NAME_MAX - 8 && name[0] != '.' && name[0] != '!' && memchr(name, '/', len) == NULL
+           && memchr(name, 0, len) == NULL;
+}
+
+// Return the stream with the given name, creating it if it doesn't exist yet
+static struct stream *find_stream(const char *name, size_t len)
+{
+    for (size_t i = 0; i < nstreams; i++)
+        if (strncmp(streams[i].name, name, len) == 0 && streams[i].name[len] == 0)
+            return &streams[i];
+    if unlikely (nstreams == LOG_STREAMS)
+        return &streams[0];
+
+    struct stream *sv = &streams[nstreams++];
+    memcpy(sv->name, name, len);
+    sv->name[len] = 0;
+    sv->file = -1;
+    sv->err.fd = -1;
+    sv->err.writer = -1;
+    return sv;
+}
+
+// Append bytes to the ring buffer of a stream, dropping its oldest lines to make room
+static void ring_append(struct stream *sv, const char *data, size_t len)
+{
+    while (sv->len + len > LOG_RING) {
+        size_t i = 0;
+        while (i < sv->len && sv->ring[(sv->head + i) % LOG_RING] != '\n')
+            i++;
+        i = i < sv->len ? i + 1 : sv->len;
+        sv->head = (sv->head + i) % LOG_RING;
+        sv->len -= i;
+        sv->dropped++;
+    }
+    size_t tail = (sv->head + sv->len) % LOG_RING;
+    size_t first = LOG_RING - tail < len ? LOG_RING - tail : len;
+    memcpy(sv->ring + tail, data, first);
+    memcpy(sv->ring, data + first, len - first);
+    sv->len += len;
+}
+
+// Timestamp a line and add it to a stream, scheduling a write for it
+static void log_line(struct stream *sv, const char *line, size_t len)
+{
+    if unlikely (sv->ring == NULL && (sv->ring = malloc(LOG_RING)) == NULL)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char entry[LOG_LINE + NAME_MAX + 32];
+    int prefix = snprintf(entry, sizeof(entry), "[%5lld.%06ld] %s: ", (long long)now.tv_sec, now.tv_nsec / 1000,
+                          sv->name);
+    memcpy(entry + prefix, line, len);
+    entry[(size_t)prefix + len] = '\n';
+    ring_append(sv, entry, (size_t)prefix + len + 1);
+
+    // Write the lines out right away when the ring buffer is filling up
+    long long now_time = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    if (sv->len > LOG_RING / 4 * 3)
+        next_flush = now_time;
+    else if (next_flush == 0)
+        next_flush = now_time + LOG_DELAY;
+}
+
+// Open a FIFO for reading (again if the file at its path has been replaced), returning false on failure
+static bool open_fifo(struct input *in, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISFIFO(st.st_mode))
+        return false;
+    else if (in->fd != -1 && st.st_dev == in->dev && st.st_ino == in->ino)
+        return true;
+
+    if (in->fd != -1) {
+        close(in->fd);
+        close(in->writer);
+        in->len = 0;
+    }
+    in->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if unlikely (in->fd == -1)
+        return false;
+    in->writer = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    in->dev = st.st_dev;
+    in->ino = st.st_ino;
+    return true;
+}
+
+// Start reading the stderr of a service from /var/run/leaninit/NAME.stderr
+static void open_stream(const char *name, size_t len)
+{
+    if unlikely (!valid_name(name, len))
+        return;
+    // find_stream() hands out the first stream once the table is full, whose stderr must be left alone
+    struct stream *sv = find_stream(name, len);
+    if unlikely (strncmp(sv->name, name, len) != 0 || sv->name[len] != 0)
+        return;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/var/run/leaninit/%s.stderr", sv->name);
+    open_fifo(&sv->err, path);
+}
+
+/* Start reading every NAME.stderr FIFO that is already in /var/run/leaninit. rc.svc(8) only announces a FIFO when
+   the service is started, so a restarted leaninit-logd would otherwise leave running services blocked on stderr. */
+static void open_streams(void)
+{
+    DIR *dir = opendir("/var/run/leaninit");
+    if (dir == NULL)
+        return;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len > 7 && strcmp(ent->d_name + len - 7, ".stderr") == 0)
+            open_stream(ent->d_name, len - 7);
+    }
+    closedir(dir);
+}
+
+// Handle a line from the pipe or LOG_PATH, which is either 'name<TAB>message' or '!stream<TAB>name'
+static void take_record(const char *line, size_t len)
+{
+    const char *tab = memchr(line, '\t', len);
+    if (tab == NULL) {
+        log_line(&streams[0], line, len);
+        return;
+    }
+
+    size_t name_len = (size_t)(tab - line), rest = len - name_len - 1;
+    if (name_len == 7 && memcmp(line, "!stream", 7) == 0)
+        open_stream(tab + 1, rest);
+    else if likely (valid_name(line, name_len))
+        log_line(find_stream(line, name_len), tab + 1, rest);
+    else
+        log_line(&streams[0], line, len);
+}
+
+// Read every complete line waiting in an input, which belongs to the given stream or carries names when it's NULL
+static void read_input(struct input *in, struct stream *owner)
+{
+    ssize_t bytes;
+    while ((bytes = read(in->fd, in->line + in->len, sizeof(in->line) - in->len)) > 0) {
+        in->len += (size_t)bytes;
+        char *start = in->line, *end = in->line + in->len, *newline;
+        while ((newline = memchr(start, '\n', (size_t)(end - start))) != NULL) {
+            if (owner != NULL)
+                log_line(owner, start, (size_t)(newline - start));
+            else
+                take_record(start, (size_t)(newline - start));
+            start = newline + 1;
+        }
+
+        // Split lines that don't fit
+        in->len = (size_t)(end - start);
+        if unlikely (in->len == sizeof(in->line)) {
+            if (owner != NULL)
+                log_line(owner, in->line, in->len);
+            else
+                take_record(in->line, in->len);
+            in->len = 0;
+        } else
+            memmove(in->line, start, in->len);
+    }
+}
+
+// Write the lines waiting for a stream to its log in one writev(2), returning false if LOG_DIR can't be written to
+static bool flush_stream(struct stream *sv)
+{
+    if (sv->len == 0 && sv->dropped == 0)
+        return true;
+
+    // Reopen the log when it has been removed and rotate it when it is too big
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), LOG_DIR "/%s.log", sv->name);
+    struct stat st;
+    if (sv->file != -1 && (fstat(sv->file, &st) != 0 || st.st_nlink == 0)) {
+        close(sv->file);
+        sv->file = -1;
+    }
+    if (sv->file != -1 && sv->size > 0 && sv->size + (off_t)sv->len > rotate_size) {
+        char old[PATH_MAX + 4];
+        snprintf(old, sizeof(old), "%s.old", path);
+        rename(path, old);
+        close(sv->file);
+        sv->file = -1;
+    }
+    if (sv->file == -1) {
+        mkdir(LOG_DIR, 0755);
+        sv->file = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOCTTY, 0644);
+        if (sv->file == -1)
+            return false;
+        sv->size = fstat(sv->file, &st) == 0 ? st.st_size : 0;
+    }
+
+    // Note how many lines were lost, then write out both halves of the ring buffer
+    struct iovec iov[3];
+    int count = 0;
+    char note[96];
+    size_t note_len = 0;
+    if unlikely (sv->dropped != 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        note_len = (size_t)snprintf(note, sizeof(note), "[%5lld.%06ld] %s: %zu lines were dropped\n",
+                                    (long long)now.tv_sec, now.tv_nsec / 1000, __progname, sv->dropped);
+        iov[count++] = (struct iovec) { .iov_base = note, .iov_len = note_len };
+    }
+    size_t first = LOG_RING - sv->head < sv->len ? LOG_RING - sv->head : sv->len;
+    iov[count++] = (struct iovec) { .iov_base = sv->ring + sv->head, .iov_len = first };
+    iov[count++] = (struct iovec) { .iov_base = sv->ring, .iov_len = sv->len - first };
+    ssize_t written = writev(sv->file, iov, count);
+    if unlikely (written == -1)
+        return false;
+
+    sv->size += written;
+    if ((size_t)written >= note_len) {
+        size_t consumed = (size_t)written - note_len;
+        sv->head = (sv->head + consumed) % LOG_RING;
+        sv->len -= consumed;
+        sv->dropped = 0;
+    }
+    return sv->len == 0;
+}
+
+// Write out every stream, returning false if any of them could not be written
+static bool flush_all(void)
+{
+    bool flushed = true;
+    for (size_t i = 0; i < nstreams; i++)
+        flushed &= flush_stream(&streams[i]);
+    return flushed;
+}
+
+// Create LOG_PATH and LOG_QUERY once /var/run/leaninit can be written to
+static void open_paths(void)
+{
+    mkdir("/var/run/leaninit", 0755);
+    if (fifo.fd == -1) {
+        if (access(LOG_PATH, F_OK) != 0)
+            mkfifo(LOG_PATH, 0600);
+        open_fifo(&fifo, LOG_PATH);
+    }
+
+    if (query_fd == -1) {
+        unlink(LOG_QUERY);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if unlikely (fd == -1)
+            return;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = LOG_QUERY };
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(LOG_QUERY, 0600) != 0 || listen(fd, 8) != 0) {
+            close(fd);
+            return;
+        }
+        query_fd = fd;
+    }
+}
+
+// Write out the log of the service named by each client, then tell the client whether that worked
+static void answer_queries(void)
+{
+    int client;
+    while ((client = accept(query_fd, NULL, NULL)) != -1) {
+        struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char name[NAME_MAX + 1];
+        ssize_t len = read(client, name, sizeof(name));
+        char result = '0';
+        if (len > 0 && valid_name(name, (size_t)len))
+            result = flush_stream(find_stream(name, (size_t)len)) ? '1' : '0';
+        write(client, &result, 1);
+        close(client);
+    }
+}
+
+// Pass signals to the event loop through the self-pipe
+static void sighandle(int signal)
+{
+    int saved_errno = errno;
+    unsigned char byte = (unsigned char)signal;
+    write(signal_pipe[1], &byte, 1);
+    errno = saved_errno;
+}
+
+// Collect logs until SIGTERM or SIGINT is received
+static int daemon_main(void)
+{
+    if unlikely (pipe(signal_pipe) != 0)
+        return 1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+    struct sigaction action = { .sa_handler = sighandle };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // stdin is the pipe from init(8) when it started leaninit-logd
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        boot.fd = STDIN_FILENO;
+        fcntl(boot.fd, F_SETFL, O_NONBLOCK);
+    }
+    find_stream(LOG_DEFAULT, sizeof(LOG_DEFAULT) - 1);
+    open_paths();
+    open_streams();
+    long long next_retry = now_ms() + LOG_RETRY;
+
+    struct pollfd fds[LOG_STREAMS + 4];
+    struct stream *owners[LOG_STREAMS + 4];
+    while (true) {
+        nfds_t nfds = 0;
+        fds[nfds] = (struct pollfd) { .fd = signal_pipe[0], .events = POLLIN };
+        owners[nfds++] = NULL;
+        fds[nfds] = (struct pollfd) { .fd = boot.fd, .events = POLLIN };
+        owners[nfds++] = NULL;
+        fds[nfds] = (struct pollfd) { .fd = fifo.fd, .events = POLLIN };
+        owners[nfds++] = NULL;
+        fds[nfds] = (struct pollfd) { .fd = query_fd, .events = POLLIN };
+        owners[nfds++] = NULL;
+        for (size_t i = 0; i < nstreams; i++)
+            if (streams[i].err.fd != -1) {
+                fds[nfds] = (struct pollfd) { .fd = streams[i].err.fd, .events = POLLIN };
+                owners[nfds++] = &streams[i];
+            }
+
+        // Sleep until there are lines to write or LOG_PATH and LOG_QUERY should be created again
+        long long now = now_ms(), wake = next_flush;
+        if ((fifo.fd == -1 || query_fd == -1) && (wake == 0 || next_retry < wake))
+            wake = next_retry;
+        int timeout = wake == 0 ? -1 : wake > now ? (int)(wake - now) : 0;
+        if (poll(fds, nfds, timeout) == -1 && errno != EINTR)
+            return 1;
+
+        // Handle signals
+        unsigned char signal;
+        while (read(signal_pipe[0], &signal, 1) == 1) {
+            if (signal == SIGHUP) {
+                // Close every log so that they can be moved away
+                flush_all();
+                for (size_t i = 0; i < nstreams; i++)
+                    if (streams[i].file != -1) {
+                        close(streams[i].file);
+                        streams[i].file = -1;
+                    }
+                continue;
+            }
+
+            // Read what is left in the pipes and write everything out before exiting
+            read_input(&boot, NULL);
+            read_input(&fifo, NULL);
+            for (size_t i = 0; i < nstreams; i++)
+                if (streams[i].err.fd != -1)
+                    read_input(&streams[i].err, &streams[i]);
+            flush_all();
+            unlink(LOG_PATH);
+            unlink(LOG_QUERY);
+            return 0;
+        }
+
+        // Read the lines waiting in each input
+        for (nfds_t i = 1; i < nfds; i++) {
+            if (fds[i].revents == 0 || i == 3)
+                continue;
+            else if (owners[i] != NULL)
+                read_input(&owners[i]->err, owners[i]);
+            else
+                read_input(i == 1 ? &boot : &fifo, NULL);
+        }
+        if (fds[3].revents != 0)
+            answer_queries();
+
+        // Write out the lines once they have been collected for LOG_DELAY, trying again later if LOG_DIR is read-only
+        now = now_ms();
+        if (next_flush != 0 && now >= next_flush)
+            next_flush = flush_all() ? 0 : now + LOG_RETRY;
+        if ((fifo.fd == -1 || query_fd == -1) && now >= next_retry) {
+            open_paths();
+            next_retry = now + LOG_RETRY;
+        }
+    }
+}
+
+// Copy a file to stdout, returning false if it could not be opened
+static bool print_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    char buffer[8192];
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0)
+        write(STDOUT_FILENO, buffer, (size_t)bytes);
+    close(fd);
+    return true;
+}
+
+// Ask the daemon to write out the given service's log, then print it along with the log it rotated
+static int query(const char *name)
+{
+    size_t len = strlen(name);
+    if unlikely (!valid_name(name, len)) {
+        printf(RED "* %s is not a valid service name" RESET "\n", name);
+        return 1;
+    }
+
+    // The logs are still printed when the daemon isn't running
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if likely (fd != -1) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = LOG_QUERY };
+        struct timeval timeout = { .tv_sec = 2, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char result = '1';
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && write(fd, name, len) == (ssize_t)len
+            && read(fd, &result, 1) == 1 && result != '1')
+            printf(PURPLE "* " YELLOW "The log of %s could not be written to " LOG_DIR RESET "\n", name);
+        close(fd);
+    }
+    fflush(stdout);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), LOG_DIR "/%s.log.old", name);
+    bool found = print_file(path);
+    path[strlen(path) - 4] = 0;
+    if (!print_file(path) && !found) {
+        printf(RED "* %s has not logged anything" RESET "\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // Long options
+    struct option long_options[] = { { "daemon", no_argument, NULL, 'd' },
+                                     { "query", required_argument, NULL, 'q' },
+                                     { "size", required_argument, NULL, 's' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+    // Parse options
+    bool daemon = false;
+    const char *service = NULL;
+    int args;
+    while ((args = getopt_long(argc, argv, "dq:s:?", long_options, NULL)) != -1)
+        switch (args) {
+            case 'd':
+                daemon = true;
+                break;
+            case 'q':
+                service = optarg;
+                break;
+            case 's':
+                rotate_size = (off_t)strtoll(optarg, NULL, 10) * 1024;
+                if unlikely (rotate_size <= 0)
+                    usage();
+                break;
+            default:
+                usage();
+                __builtin_unreachable();
+        }
+
+    if (service != NULL)
+        return query(service);
+    else if (daemon)
+        return daemon_main();
+    usage();
+}
@@ -0,0 +1,531 @@
+/*
+ * Copyright © 2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * leaninit-readahead -- Record the files read during boot and prefetch them on the next boot
+ *
+ * LeanInit starts leaninit-readahead before rc(8) with the read end of a pipe as its stdin,
+ * and the write end is closed right before the gettys are spawned, which marks the end of boot.
+ * While recording, every file opened on a disk-backed file system is collected with fanotify(7),
+ * then the ranges of each file that are in the page cache at the end of boot are saved to
+ * READAHEAD_PACK, sorted by where the files are on disk. Later boots read the pack and prefetch
+ * those ranges in the same order while rc(8) checks and mounts the file systems.
+ */
+
+#include <leaninit.h>
+#include <stddef.h>
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/fanotify.h>
+#endif
+
+// Limits of the pack
+#define PACK_MAGIC     0x4c524131      // "LRA1"
+#define PACK_FILES     8192            // Files recorded at most
+#define PACK_RANGES    64              // Ranges recorded at most for each file
+#define PACK_MAX_AGE   (30 * 86400)    // Seconds before the pack is recorded again
+#define PACK_STALE     8               // The pack is recorded again once more than 1 in PACK_STALE files have changed
+#define BOOT_TIMEOUT   120             // Seconds to wait for the end of boot when the pipe is never closed
+#define RETRY_INTERVAL 250             // Milliseconds between attempts to open files on file systems not mounted yet
+
+/* The pack starts with a header, followed by a pack_file for each file. Each pack_file is followed by
+   its ranges, then its path padded with null bytes to a multiple of 8 bytes. */
+struct pack_header {
+    uint32_t magic;
+    uint32_t files;
+    int64_t created; // When the pack was recorded, or 0 when it is stale
+};
+struct pack_file {
+    uint64_t ino; // Files that were replaced since the pack was recorded make it stale
+    uint16_t nranges;
+    uint16_t path_len;
+    uint32_t pad;
+};
+struct pack_range {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// A file in the pack while it is being built or read
+struct entry {
+    char *path;
+    uint64_t ino;
+    dev_t dev;
+    uint64_t block; // Physical offset of the file on disk (or its inode number if that is unknown)
+    uint16_t nranges;
+    struct pack_range ranges[PACK_RANGES];
+    bool done; // The file has been prefetched
+};
+
+static volatile sig_atomic_t stop = 0;
+
+// Show usage information
+static cold noreturn void usage(void)
+{
+    printf("Usage: %s [-rl?]\n"
+           "  -r, --record  Record the files read until the end of boot, even if the pack is up to date\n"
+           "  -l, --list    List the files in the pack and the ranges that are prefetched\n"
+           "  -?, --help    Show this usage information\n"
+           "Without any flags, the files in " READAHEAD_PACK " are prefetched (or recorded again when it is stale)\n",
+           __progname);
+    exit(1);
+}
+
+// Stop recording or waiting on SIGTERM and SIGINT
+static void sighandle(int signal)
+{
+    (void)signal;
+    stop = 1;
+}
+
+// Return the current monotonic time in milliseconds
+static long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Return true once the end of boot has been reached, waiting for it for up to the given time
+static bool boot_finished(long long deadline, int timeout)
+{
+    long long remaining = deadline - now_ms();
+    if (stop || remaining <= 0)
+        return true;
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    if (poll(&pfd, 1, timeout < 0 || timeout > remaining ? (int)remaining : timeout) != 1)
+        return stop;
+    char byte;
+    return read(STDIN_FILENO, &byte, 1) <= 0;
+}
+
+// Read the pack into an array of entries, returning NULL if it doesn't exist or is corrupt
+static struct entry *read_pack(struct pack_header *header)
+{
+    int fd = open(READAHEAD_PACK, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*header) && (data = malloc((size_t)st.st_size)) != NULL
+        && read(fd, data, (size_t)st.st_size) != st.st_size) {
+        free(data);
+        data = NULL;
+    }
+    close(fd);
+    if (data == NULL)
+        return NULL;
+
+    memcpy(header, data, sizeof(*header));
+    struct entry *entries = NULL;
+    if unlikely (header->magic != PACK_MAGIC || header->files > PACK_FILES
+                 || (entries = calloc(header->files ? header->files : 1, sizeof(struct entry))) == NULL)
+        goto corrupt;
+
+    size_t offset = sizeof(*header), size = (size_t)st.st_size;
+    for (uint32_t i = 0; i < header->files; i++) {
+        struct pack_file file;
+        if unlikely (offset + sizeof(file) > size)
+            goto corrupt;
+        memcpy(&file, data + offset, sizeof(file));
+        offset += sizeof(file);
+        size_t path_size = ((size_t)file.path_len + 8) & ~(size_t)7;
+        if unlikely (file.nranges > PACK_RANGES || offset + file.nranges * sizeof(struct pack_range) + path_size > size)
+            goto corrupt;
+        entries[i].ino = file.ino;
+        entries[i].nranges = file.nranges;
+        memcpy(entries[i].ranges, data + offset, file.nranges * sizeof(struct pack_range));
+        offset += file.nranges * sizeof(struct pack_range);
+        entries[i].path = strndup(data + offset, file.path_len);
+        offset += path_size;
+        if unlikely (entries[i].path == NULL)
+            goto corrupt;
+    }
+    free(data);
+    return entries;
+
+corrupt:
+    if (entries != NULL)
+        for (uint32_t i = 0; i < header->files; i++)
+            free(entries[i].path);
+    free(entries);
+    free(data);
+    return NULL;
+}
+
+// Prefetch the ranges of an entry, returning false if the file could not be opened
+static bool prefetch(struct entry *entry, uint32_t *stale)
+{
+    int fd = -1;
+#if defined(O_NOATIME)
+    fd = open(entry->path, O_RDONLY | O_CLOEXEC | O_NOATIME); // Fails with EPERM on files root doesn't own
+#endif
+    if (fd == -1)
+        fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_ino != entry->ino)
+        (*stale)++;
+    for (uint16_t r = 0; r < entry->nranges; r++)
+#if defined(__linux__)
+        readahead(fd, (off_t)entry->ranges[r].offset, (size_t)entry->ranges[r].length);
+#else
+        posix_fadvise(fd, (off_t)entry->ranges[r].offset, (off_t)entry->ranges[r].length, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+    entry->done = true;
+    return true;
+}
+
+/* Prefetch every file in the pack in the order it was recorded. Files on file systems that rc(8)
+   hasn't mounted yet are tried again until the end of boot, and the pack is marked as stale
+   (so that it is recorded again on the next boot) if too many files are missing or were replaced. */
+static int prefetch_pack(struct entry *entries, uint32_t files)
+{
+    uint32_t missing = 0, stale = 0;
+    for (uint32_t i = 0; i < files; i++)
+        if (!prefetch(&entries[i], &stale))
+            missing++;
+
+    long long deadline = now_ms() + BOOT_TIMEOUT * 1000LL;
+    while (missing != 0 && !boot_finished(deadline, RETRY_INTERVAL))
+        for (uint32_t i = 0; i < files; i++)
+            if (!entries[i].done && prefetch(&entries[i], &stale))
+                missing--;
+
+    if ((missing + stale) * PACK_STALE <= files)
+        return 0;
+
+    // Wait for the end of boot, when the root file system should be writable
+    while (!boot_finished(deadline, -1))
+        ;
+    int fd = open(READAHEAD_PACK, O_WRONLY | O_CLOEXEC);
+    int64_t created = 0;
+    if unlikely (fd == -1 || pwrite(fd, &created, sizeof(created), offsetof(struct pack_header, created)) != sizeof(created)) {
+        printf(RED "* Could not mark " READAHEAD_PACK " as stale: %s" RESET "\n", strerror(errno));
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+#if defined(__linux__)
+// Return true if a file system of the given type isn't backed by a disk
+static bool pseudo_fs_type(const char *type)
+{
+    static const char *const types[] = { "autofs", "binfmt_misc", "bpf", "cgroup", "cgroup2", "configfs", "debugfs",
+                                         "devpts", "devtmpfs", "efivarfs", "fusectl", "hugetlbfs", "mqueue", "proc",
+                                         "pstore", "ramfs", "securityfs", "sysfs", "tmpfs", "tracefs", NULL };
+    for (size_t i = 0; types[i] != NULL; i++)
+        if (strcmp(type, types[i]) == 0)
+            return true;
+    return false;
+}
+
+// Watch every disk-backed file system in /proc/self/mountinfo (marking a mount again has no effect)
+static void mark_mounts(int fan, int mountinfo_fd)
+{
+    char *line = NULL;
+    size_t size = 0;
+    lseek(mountinfo_fd, 0, SEEK_SET);
+    FILE *mountinfo = fdopen(dup(mountinfo_fd), "r");
+    if unlikely (mountinfo == NULL)
+        return;
+
+    while (getline(&line, &size, mountinfo) != -1) {
+        // The mount point is the fifth field, and the type follows the " - " separator
+        char *point = line, *type = strstr(line, " - ");
+        for (int i = 0; i < 4 && point != NULL; i++)
+            point = strchr(point, ' ') != NULL ? strchr(point, ' ') + 1 : NULL;
+        if unlikely (point == NULL || type == NULL)
+            continue;
+        point[strcspn(point, " ")] = 0;
+        type += 3;
+        type[strcspn(type, " ")] = 0;
+        if (pseudo_fs_type(type) || strchr(point, '\\') != NULL) // Mount points with escaped characters are skipped
+            continue;
+        fanotify_mark(fan, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, point);
+    }
+    free(line);
+    fclose(mountinfo);
+}
+
+// Add a path to the set of recorded files, returning false once it is full
+static bool add_path(char **set, size_t slots, size_t *count, const char *path)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c; c++)
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    for (size_t i = hash % slots;; i = (i + 1) % slots) {
+        if (set[i] == NULL) {
+            if unlikely (*count >= PACK_FILES)
+                return false;
+            set[i] = strdup(path);
+            if likely (set[i] != NULL)
+                (*count)++;
+            return true;
+        } else if (strcmp(set[i], path) == 0)
+            return true;
+    }
+}
+
+// Fill in the ranges of a recorded file that are in the page cache, returning false if there are none
+static bool read_ranges(struct entry *entry)
+{
+    int fd = open(entry->path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd == -1)
+        fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    entry->ino = (uint64_t)st.st_ino;
+    entry->dev = st.st_dev;
+    entry->block = (uint64_t)st.st_ino;
+
+    // Sort by the physical offset of the first extent when the file system supports FIEMAP
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fiemap = { .map = { .fm_length = FIEMAP_MAX_OFFSET, .fm_extent_count = 1 } };
+    if (ioctl(fd, FS_IOC_FIEMAP, &fiemap) == 0 && fiemap.map.fm_mapped_extents == 1)
+        entry->block = fiemap.extent.fe_physical;
+
+    // Find the resident pages with mincore(2), merging neighbouring ones into ranges
+    size_t page = (size_t)sysconf(_SC_PAGESIZE), pages = ((size_t)st.st_size + page - 1) / page;
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char *resident = malloc(pages);
+    if (map == MAP_FAILED || resident == NULL || mincore(map, (size_t)st.st_size, resident) != 0) {
+        // Prefetch the whole file when its pages can't be checked
+        entry->ranges[0] = (struct pack_range) { 0, (uint64_t)st.st_size };
+        entry->nranges = 1;
+    } else
+        for (size_t p = 0; p < pages; p++) {
+            if ((resident[p] & 1) == 0)
+                continue;
+            struct pack_range *last = entry->nranges ? &entry->ranges[entry->nranges - 1] : NULL;
+            if (last != NULL && (last->offset + last->length == p * page || entry->nranges == PACK_RANGES))
+                last->length = (p + 1) * page - last->offset; // The last range absorbs the rest once they run out
+            else
+                entry->ranges[entry->nranges++] = (struct pack_range) { p * page, page };
+        }
+    if (map != MAP_FAILED)
+        munmap(map, (size_t)st.st_size);
+    free(resident);
+    close(fd);
+    return entry->nranges != 0;
+}
+
+// Order entries by where they are on disk
+static int by_block(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    else if (x->block != y->block)
+        return x->block < y->block ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+// Write the recorded entries to the pack, replacing it atomically
+static int write_pack(struct entry *entries, uint32_t files)
+{
+    mkdir("/var/lib/leaninit", 0755);
+    FILE *pack = fopen(READAHEAD_PACK ".new", "we");
+    if unlikely (pack == NULL) {
+        printf(RED "* Could not write " READAHEAD_PACK ": %s" RESET "\n", strerror(errno));
+        return 1;
+    }
+    struct pack_header header = { .magic = PACK_MAGIC, .files = files, .created = time(NULL) };
+    fwrite(&header, sizeof(header), 1, pack);
+    static const char padding[8] = { 0 };
+    for (uint32_t i = 0; i < files; i++) {
+        size_t path_len = strlen(entries[i].path);
+        struct pack_file file = { .ino = entries[i].ino, .nranges = entries[i].nranges, .path_len = (uint16_t)path_len };
+        fwrite(&file, sizeof(file), 1, pack);
+        fwrite(entries[i].ranges, sizeof(struct pack_range), entries[i].nranges, pack);
+        fwrite(entries[i].path, 1, path_len, pack);
+        fwrite(padding, 1, 8 - path_len % 8, pack);
+    }
+    if unlikely (fflush(pack) != 0 || fsync(fileno(pack)) != 0 || fclose(pack) != 0
+                 || rename(READAHEAD_PACK ".new", READAHEAD_PACK) != 0) {
+        printf(RED "* Could not write " READAHEAD_PACK ": %s" RESET "\n", strerror(errno));
+        unlink(READAHEAD_PACK ".new");
+        return 1;
+    }
+    return 0;
+}
+
+// Record every file opened until the end of boot, then save the ranges of them that were read
+static int record(void)
+{
+    int fan = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    int mountinfo = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if unlikely (fan == -1 || mountinfo == -1) {
+        printf(RED "* Could not watch the files read during boot: %s" RESET "\n", strerror(errno));
+        return 1;
+    }
+    mark_mounts(fan, mountinfo);
+
+    // Collect the paths of the files that are opened until the pipe is closed
+    size_t slots = PACK_FILES * 2, count = 0;
+    char **set = calloc(slots, sizeof(char *));
+    if unlikely (set == NULL)
+        return 1;
+    pid_t self = getpid();
+    long long deadline = now_ms() + BOOT_TIMEOUT * 1000LL;
+    struct pollfd pfds[3] = { { .fd = STDIN_FILENO, .events = POLLIN },
+                              { .fd = fan, .events = POLLIN },
+                              { .fd = mountinfo, .events = POLLPRI } };
+    bool full = false;
+    while (!stop && !full) {
+        long long remaining = deadline - now_ms();
+        if (remaining <= 0 || (poll(pfds, 3, (int)remaining) == -1 && errno != EINTR))
+            break;
+        else if (pfds[0].revents != 0) {
+            char byte;
+            if (read(STDIN_FILENO, &byte, 1) <= 0)
+                break;
+        }
+        if (pfds[2].revents != 0)
+            mark_mounts(fan, mountinfo); // A file system has been mounted
+
+        char buffer[4096] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+        ssize_t len;
+        while ((len = read(fan, buffer, sizeof(buffer))) > 0) {
+            for (struct fanotify_event_metadata *event = (struct fanotify_event_metadata *)buffer;
+                 FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+                if (event->fd < 0)
+                    continue;
+                struct stat st;
+                char link[32], path[PATH_MAX];
+                snprintf(link, sizeof(link), "/proc/self/fd/%d", event->fd);
+                ssize_t path_len;
+                if (event->pid != self && fstat(event->fd, &st) == 0 && S_ISREG(st.st_mode)
+                    && (path_len = readlink(link, path, sizeof(path) - 1)) > 0) {
+                    path[path_len] = 0;
+                    full = full || !add_path(set, slots, &count, path);
+                }
+                close(event->fd);
+            }
+        }
+    }
+    close(fan);
+    close(mountinfo);
+
+    // Find the ranges of every file that are in the page cache now that boot has finished
+    struct entry *entries = calloc(count ? count : 1, sizeof(struct entry));
+    if unlikely (entries == NULL)
+        return 1;
+    uint32_t files = 0;
+    for (size_t i = 0; i < slots; i++) {
+        if (set[i] == NULL)
+            continue;
+        entries[files].path = set[i];
+        if (read_ranges(&entries[files]))
+            files++;
+        else
+            free(set[i]);
+    }
+    free(set);
+    qsort(entries, files, sizeof(struct entry), by_block);
+    return write_pack(entries, files);
+}
+#endif
+
+// List the files in the pack
+static int list(struct entry *entries, const struct pack_header *header)
+{
+    char created[64] = "stale";
+    if (header->created != 0) {
+        time_t when = (time_t)header->created;
+        strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&when));
+    }
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < header->files; i++) {
+        uint64_t bytes = 0;
+        for (uint16_t r = 0; r < entries[i].nranges; r++)
+            bytes += entries[i].ranges[r].length;
+        total += bytes;
+        printf("%8llu KiB %3u %s\n", (unsigned long long)(bytes / 1024), entries[i].nranges, entries[i].path);
+    }
+    printf(CYAN "* " WHITE "%u files, %llu KiB (recorded %s)" RESET "\n", header->files,
+           (unsigned long long)(total / 1024), created);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // Long options
+    struct option long_options[] = { { "record", no_argument, NULL, 'r' },
+                                     { "list", no_argument, NULL, 'l' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+    // Parse options
+    bool force_record = false, list_pack = false;
+    int args;
+    while ((args = getopt_long(argc, argv, "rl?", long_options, NULL)) != -1)
+        switch (args) {
+            case 'r':
+                force_record = true;
+                break;
+            case 'l':
+                list_pack = true;
+                break;
+            default:
+                usage();
+                __builtin_unreachable();
+        }
+
+    struct sigaction action = { .sa_handler = sighandle };
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    struct pack_header header = { 0 };
+    struct entry *entries = force_record ? NULL : read_pack(&header);
+    if (list_pack) {
+        if (entries == NULL) {
+            printf(RED "* Could not read " READAHEAD_PACK RESET "\n");
+            return 1;
+        }
+        return list(entries, &header);
+    }
+
+    // Prefetch the pack unless it is stale or recording was asked for
+    if (entries != NULL && header.created != 0 && time(NULL) - header.created < PACK_MAX_AGE)
+        return prefetch_pack(entries, header.files);
+    else if (entries == NULL && !force_record)
+        return 0; // Recording is turned on with LeanInit's 'readahead' argument
+#if defined(__linux__)
+    return record();
+#else
+    printf(RED "* Recording the files read during boot requires fanotify(7), which is only available on Linux" RESET "\n");
+    return 1;
+#endif
+}
@@ -0,0 +1,1448 @@
+/*
+ * Copyright © 2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * leaninit-sched -- Start all enabled services in dependency order, or stop them in reverse
+ *
+ * The dependency graph is built from the same vocabulary services already use:
+ * `waitfor <type>` and `waitfor service <name>` lines become hard dependencies
+ * (soft ones when `optional` is passed), while the NEED and AFTER variables can
+ * be used to declare hard and soft dependencies without a waitfor call.
+ *
+ * When stopping, a service is stopped once everything that depends on it has
+ * stopped. Services that take longer than STOP_TIMEOUT are killed.
+ *
+ * The sockets services declare in LISTEN are all bound before anything is started.
+ * A service with sockets is marked as Listening and its dependents are released
+ * as soon as it is started, since connections are queued until its daemon accepts
+ * them. Services that also set LAZY=true are only started on their first connection.
+ *
+ * At most JOBS services (twice the number of online CPUs by default) are started at
+ * once. Whenever a slot is free, the service started next is the one in the most
+ * urgent CLASS (critical, normal or idle) with the longest chain of dependents behind
+ * it, and the class sets its niceness, I/O priority and scheduling policy while it starts.
+ *
+ * When switching runlevels, --runlevel plans the transition against the running set:
+ * stopping only leaves the services outside the runlevel's set (and outside the hard
+ * prerequisites of what is in it) to be stopped, and starting skips whatever is
+ * already running.
+ *
+ * With --reload, the running services whose configuration changed since they were
+ * started are reloaded (or restarted when they can't be): the ones whose rc.conf.d
+ * file changed, and the ones that expand a variable whose value changed. A changed
+ * variable that rc.svc expands, or that no service script expands, reloads every
+ * running service, since any daemon may read it from its environment. The compiled
+ * configuration in /var/lib/leaninit/rc.cache is what gets compared: it is copied to
+ * /var/run/leaninit/rc.cache when services are first started, and again after each
+ * reload.
+ */
+
+#include <leaninit.h>
+#include <sched.h>
+
+// Service states
+#define SV_WAITING 0
+#define SV_RUNNING 1
+#define SV_READY   2
+#define SV_FAILED  3
+
+// Service classes, in the order they are started in
+#define CLASS_CRITICAL 0
+#define CLASS_NORMAL   1
+#define CLASS_IDLE     2
+
+// I/O priorities for ioprio_set(2), which glibc has no wrapper for
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_CLASS_IDLE  3
+
+/* The configuration compiled by leaninit-service(8) (rc.conf(5), rc.conf.d and /etc/profile), which rc.svc(8) loads,
+   and the copy of it that the running services have loaded */
+#define RC_CACHE      "/var/lib/leaninit/rc.cache"
+#define SNAPSHOT_PATH "/var/run/leaninit/rc.cache"
+#define SERVICE_BIN   "/sbin/leaninit-service"
+#define RC_SVC_PATH   "/etc/leaninit/rc.svc"
+
+// Stop deadlines (in seconds), which are STOP_TIMEOUT plus a grace period for the stop script itself
+#define STOP_TIMEOUT 7
+#define STOP_GRACE   2
+
+// A dependency as it was written in the service script
+struct dep {
+    char name[NAME_MAX + 1];
+    bool hard;
+    bool service; // Only match service names, not types (`waitfor service`)
+};
+
+// An edge from a prerequisite to one of its dependents
+struct edge {
+    size_t to;
+    bool hard;
+    bool broken; // Set when the edge closed a cycle
+};
+
+struct service {
+    char name[NAME_MAX + 1];
+    char type[NAME_MAX + 1];
+    char conf[NAME_MAX + 1]; // The file in rc.conf.d it loads (CONF)
+    struct dep *deps;
+    size_t ndeps;
+    struct edge *edges;
+    size_t nedges;
+    size_t pending; // Prerequisites that have not finished starting yet
+    unsigned int wave;
+    unsigned char state;
+    unsigned char mark; // Used for cycle detection
+    bool doomed;        // A hard prerequisite failed to start
+    pid_t pid;
+    struct service *released_by; // The last prerequisite to finish, recorded for leaninit-analyze(8)
+    unsigned int stop_timeout;
+    long long deadline; // When a running stop script is killed
+    int pidfd;
+    char *listen; // The sockets in LISTEN
+    int listen_fds[LISTEN_MAX];
+    int nlisten;
+    bool lazy;     // Started on the first connection to one of its sockets
+    bool released; // Its dependents were released before it finished starting
+    bool running;  // It was already running when leaninit-sched was started
+    bool wanted;   // It is part of the runlevel, or a hard prerequisite of something that is
+    unsigned char class;
+    unsigned int height; // Services in the longest chain of dependents, including this one
+};
+
+static struct service *svcs = NULL;
+static size_t nsvcs = 0;
+static bool verbose = true;
+static long long stop_deadline = 0; // Set with --timeout, no service is given any longer than this to stop
+static size_t max_jobs = 0;         // Services started at once (0 for no limit)
+static const char *runlevel = NULL; // The set of services passed with --runlevel
+#if !defined(__linux__)
+static int stop_queue = -1; // kqueue(2) instance watching the stop scripts
+#endif
+
+// The service passed with --wait and the pipe used to tell the parent it has started
+static ssize_t wait_target = -1;
+static int ready_fd = -1;
+
+// Show usage information
+static cold noreturn void usage(int ret)
+{
+    printf("Usage: %s [-nsR?] [-j jobs] [-r runlevel] [-t seconds] [-w service] [silent|verbose]\n"
+           "  -j, --jobs      Start at most the given number of services at once (0 for no limit)\n"
+           "  -n, --dry-run   Print the computed start waves without starting anything\n"
+           "  -r, --runlevel  Only start the services of the given runlevel (single or multi) that aren't running,\n"
+           "                  or with --stop, only stop the running services it doesn't need\n"
+           "  -s, --stop      Stop all running services in reverse dependency order\n"
+           "  -t, --timeout   Kill the services that are still stopping after the given number of seconds\n"
+           "  -w, --wait      Return once the given service has started, then continue in the background\n"
+           "  -R, --reload    Reload the running services whose configuration changed since they were started\n"
+           "  -?, --help      Show this usage information\n",
+           __progname);
+    exit(ret);
+}
+
+// Remove surrounding quotes from a word in place
+static char *unquote(char *word)
+{
+    size_t len = strlen(word);
+    if (len >= 2 && (word[0] == '"' || word[0] == '\'') && word[len - 1] == word[0]) {
+        word[len - 1] = 0;
+        return word + 1;
+    }
+    return word;
+}
+
+// Add a dependency to a service, ignoring anything that can only be resolved by the shell
+static void add_dep(struct service *sv, const char *name, bool hard, bool service)
+{
+    if unlikely (!*name || strchr(name, '$') != NULL || strlen(name) > NAME_MAX)
+        return;
+
+    struct dep *deps = realloc(sv->deps, (sv->ndeps + 1) * sizeof(struct dep));
+    if unlikely (deps == NULL)
+        return;
+    sv->deps = deps;
+    memcpy(deps[sv->ndeps].name, name, strlen(name) + 1);
+    deps[sv->ndeps].hard = hard;
+    deps[sv->ndeps++].service = service;
+}
+
+// Add every word in a NEED or AFTER assignment as a dependency
+static void add_dep_list(struct service *sv, char *list, bool hard)
+{
+    char *word;
+    list = unquote(list);
+    while ((word = strsep(&list, " \t")) != NULL)
+        add_dep(sv, word, hard, false);
+}
+
+// Read the TYPE, CONF, NEED, AFTER, STOP_TIMEOUT, LISTEN, LAZY, CLASS and waitfor declarations of a service script
+static void parse_service(struct service *sv)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), SVC_DIR "/%s", sv->name);
+    FILE *script = fopen(path, "r");
+    if unlikely (script == NULL)
+        return;
+
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, script) != -1) {
+        char *text = line + strspn(line, " \t");
+        text[strcspn(text, "\n")] = 0;
+        if (*text == '#')
+            continue;
+
+        // Variable assignments
+        if (strncmp(text, "TYPE=", 5) == 0) {
+            char *type = unquote(text + 5);
+            if likely (strlen(type) <= NAME_MAX)
+                memcpy(sv->type, type, strlen(type) + 1);
+            continue;
+        } else if (strncmp(text, "CONF=", 5) == 0) {
+            char *conf = unquote(text + 5);
+            if likely (strlen(conf) <= NAME_MAX)
+                memcpy(sv->conf, conf, strlen(conf) + 1);
+            continue;
+        } else if (strncmp(text, "NEED=", 5) == 0) {
+            add_dep_list(sv, text + 5, true);
+            continue;
+        } else if (strncmp(text, "AFTER=", 6) == 0) {
+            add_dep_list(sv, text + 6, false);
+            continue;
+        } else if (strncmp(text, "STOP_TIMEOUT=", 13) == 0) {
+            sv->stop_timeout = (unsigned int)strtoul(unquote(text + 13), NULL, 10);
+            continue;
+        } else if (strncmp(text, "LISTEN=", 7) == 0) {
+            free(sv->listen);
+            sv->listen = strdup(unquote(text + 7));
+            continue;
+        } else if (strncmp(text, "LAZY=", 5) == 0) {
+            sv->lazy = strcmp(unquote(text + 5), "true") == 0;
+            continue;
+        } else if (strncmp(text, "CLASS=", 6) == 0) {
+            char *class = unquote(text + 6);
+            if (strcmp(class, "critical") == 0)
+                sv->class = CLASS_CRITICAL;
+            else if (strcmp(class, "idle") == 0)
+                sv->class = CLASS_IDLE;
+            continue;
+        }
+
+        // waitfor calls (`waitfor file` cannot be resolved ahead of time)
+        char *word, *rest = text;
+        while ((word = strsep(&rest, " \t")) != NULL) {
+            if (*word == '#')
+                break;
+            if (strcmp(word, "waitfor") != 0 || rest == NULL)
+                continue;
+            char *target = strsep(&rest, " \t");
+            if (strcmp(target, "file") == 0)
+                break;
+            bool service = strcmp(target, "service") == 0;
+            if (service && (target = strsep(&rest, " \t")) == NULL)
+                break;
+            add_dep(sv, unquote(target), rest == NULL || strncmp(rest, "optional", 8) != 0, service);
+            break;
+        }
+    }
+
+    free(line);
+    fclose(script);
+}
+
+/* Return true if a service is running (or failed to, when stopping), which is found in the state table or by its
+   .status file when it doesn't exist */
+static bool is_running(struct state_table *table, const char *name, bool stop)
+{
+    struct state_entry entry;
+    if (table != NULL)
+        return state_read(table, name, &entry) && entry.state != SVC_STOPPED && (stop || entry.state != SVC_FAILED);
+    char status[PATH_MAX];
+    snprintf(status, sizeof(status), "/var/run/leaninit/%s.status", name);
+    return access(status, F_OK) == 0;
+}
+
+// Return true if a directory has an entry with the given name
+static bool listed(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return access(path, F_OK) == 0;
+}
+
+// Add the services in a directory, skipping those already added and (when stopping) those that aren't running
+static int load_dir(const char *path, bool stop, struct state_table *table, const char *set)
+{
+    DIR *dir = opendir(path);
+    if unlikely (dir == NULL) {
+        // A runlevel without a set of its own has no services
+        if (errno == ENOENT && strcmp(path, SINGLE_DIR) == 0)
+            return 0;
+        printf(RED "* Could not open %s: %s" RESET "\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        bool running = is_running(table, ent->d_name, stop);
+        if (stop && !running)
+            continue;
+        bool added = false;
+        for (size_t i = 0; i < nsvcs && !added; i++)
+            added = strcmp(svcs[i].name, ent->d_name) == 0;
+        if (added)
+            continue;
+
+        struct service *grown = realloc(svcs, (nsvcs + 1) * sizeof(struct service));
+        if unlikely (grown == NULL) {
+            printf(RED "* Memory allocation failed" RESET "\n");
+            closedir(dir);
+            return -1;
+        }
+        svcs = grown;
+        memset(&svcs[nsvcs], 0, sizeof(struct service));
+        memcpy(svcs[nsvcs].name, ent->d_name, strlen(ent->d_name) + 1);
+        svcs[nsvcs].stop_timeout = STOP_TIMEOUT;
+        svcs[nsvcs].pidfd = -1;
+        svcs[nsvcs].class = CLASS_NORMAL;
+        svcs[nsvcs].running = running;
+        svcs[nsvcs].wanted = set != NULL ? listed(set, ent->d_name) : !stop;
+        parse_service(&svcs[nsvcs++]);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/* Read the enabled services from /var/lib/leaninit/svc, or the running ones when stopping. The single user set is
+   read along with the enabled services, since the hard prerequisites of its services are started with them. */
+static int load_services(bool stop)
+{
+    const char *set = runlevel == NULL ? NULL : strcmp(runlevel, "single") == 0 ? SINGLE_DIR : ENABLED_DIR;
+    struct state_table *table = state_open(false, NULL);
+    int ret = load_dir(stop ? SVC_DIR : ENABLED_DIR, stop, table, set);
+    if (ret == 0 && !stop && set != NULL && strcmp(set, SINGLE_DIR) == 0)
+        ret = load_dir(SINGLE_DIR, false, table, set);
+    if (table != NULL)
+        munmap(table, sizeof(*table));
+    return ret;
+}
+
+// Find the enabled service that provides the given type, or failing that has the given name
+static ssize_t resolve(const char *name, bool service)
+{
+    for (size_t i = 0; i < nsvcs && !service; i++)
+        if (strcmp(svcs[i].type, name) == 0)
+            return (ssize_t)i;
+    for (size_t i = 0; i < nsvcs; i++)
+        if (strcmp(svcs[i].name, name) == 0)
+            return (ssize_t)i;
+    return -1;
+}
+
+// Turn every resolvable dependency into an edge. Dependencies on disabled services are left to waitfor.
+static int build_graph(void)
+{
+    for (size_t i = 0; i < nsvcs; i++) {
+        for (size_t d = 0; d < svcs[i].ndeps; d++) {
+            ssize_t from = resolve(svcs[i].deps[d].name, svcs[i].deps[d].service);
+            if (from == -1 || (size_t)from == i)
+                continue;
+
+            struct service *prereq = &svcs[from];
+            struct edge *edges = realloc(prereq->edges, (prereq->nedges + 1) * sizeof(struct edge));
+            if unlikely (edges == NULL) {
+                printf(RED "* Memory allocation failed" RESET "\n");
+                return -1;
+            }
+            prereq->edges = edges;
+            edges[prereq->nedges++] = (struct edge) { .to = i, .hard = svcs[i].deps[d].hard, .broken = false };
+            svcs[i].pending++;
+        }
+    }
+
+    return 0;
+}
+
+// Depth-first search that breaks every edge pointing back into the current path
+static void break_cycles(size_t i)
+{
+    svcs[i].mark = 1;
+    for (size_t e = 0; e < svcs[i].nedges; e++) {
+        struct edge *edge = &svcs[i].edges[e];
+        if (svcs[edge->to].mark == 1) {
+            printf(RED "* Dependency cycle detected, ignoring that %s depends on %s" RESET "\n", svcs[edge->to].name,
+                   svcs[i].name);
+            edge->broken = true;
+            svcs[edge->to].pending--;
+        } else if (svcs[edge->to].mark == 0)
+            break_cycles(edge->to);
+    }
+    svcs[i].mark = 2;
+}
+
+// Assign every service to the earliest wave in which all of its prerequisites have started (Kahn's algorithm)
+static unsigned int compute_waves(void)
+{
+    size_t *queue = malloc(nsvcs * sizeof(size_t));
+    size_t *left = malloc(nsvcs * sizeof(size_t));
+    if unlikely (queue == NULL || left == NULL) {
+        free(queue);
+        free(left);
+        return 0;
+    }
+
+    size_t head = 0, tail = 0;
+    for (size_t i = 0; i < nsvcs; i++)
+        if ((left[i] = svcs[i].pending) == 0 && svcs[i].state == SV_WAITING)
+            queue[tail++] = i;
+
+    unsigned int waves = 0;
+    while (head != tail) {
+        struct service *sv = &svcs[queue[head++]];
+        if (sv->wave + 1 > waves)
+            waves = sv->wave + 1;
+        for (size_t e = 0; e < sv->nedges; e++) {
+            struct edge *edge = &sv->edges[e];
+            if (edge->broken || svcs[edge->to].state != SV_WAITING)
+                continue;
+            if (svcs[edge->to].wave < sv->wave + 1)
+                svcs[edge->to].wave = sv->wave + 1;
+            if (--left[edge->to] == 0)
+                queue[tail++] = edge->to;
+        }
+    }
+
+    free(queue);
+    free(left);
+    return waves;
+}
+
+// Count the services in the longest chain of dependents behind a service, which is its critical path
+static unsigned int compute_height(size_t i)
+{
+    if (svcs[i].height != 0)
+        return svcs[i].height;
+    unsigned int height = 0;
+    for (size_t e = 0; e < svcs[i].nedges; e++)
+        if (!svcs[i].edges[e].broken && compute_height(svcs[i].edges[e].to) > height)
+            height = svcs[svcs[i].edges[e].to].height;
+    return svcs[i].height = height + 1;
+}
+
+// Make a service and everything it depends on critical, which is done for the service passed with --wait
+static void make_critical(size_t i)
+{
+    svcs[i].class = CLASS_CRITICAL;
+    for (size_t p = 0; p < nsvcs; p++)
+        for (size_t e = 0; e < svcs[p].nedges; e++)
+            if (svcs[p].edges[e].to == i && !svcs[p].edges[e].broken && svcs[p].class != CLASS_CRITICAL)
+                make_critical(p);
+}
+
+// Read a whole file, returning NULL if it can't be read
+static char *read_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    // Files in /sys report a size of 0 or a page no matter what they hold, so read until the end of the file
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 && st.st_size >= 4096 ? (size_t)st.st_size + 1 : 4096, len = 0;
+    char *text = malloc(size);
+    ssize_t got;
+    while (text != NULL && (got = read(fd, text + len, size - len - 1)) > 0)
+        if ((len += (size_t)got) == size - 1) {
+            char *grown = realloc(text, size *= 2);
+            if unlikely (grown == NULL) {
+                free(text);
+                text = NULL;
+            } else
+                text = grown;
+        }
+    if likely (text != NULL)
+        text[len] = 0;
+    close(fd);
+    return text;
+}
+
+// Parse the next PID above 1 from a list like a .pid file or cgroup.procs, returning 0 at the end of it
+static pid_t next_pid(char **list)
+{
+    char *end;
+    long pid;
+    while ((pid = strtol(*list, &end, 10)), end != *list) {
+        *list = end;
+        if (pid > 1)
+            return (pid_t)pid;
+    }
+    return 0;
+}
+
+#if defined(__linux__)
+// Find the cgroup rc.svc started a service in, which is under the unified (v2) hierarchy, returning false without one
+static bool service_cgroup(const struct service *sv, char *path, size_t size)
+{
+    static const char *const roots[] = { "/sys/fs/cgroup/unified", "/sys/fs/cgroup" };
+    for (size_t i = 0; i < sizeof(roots) / sizeof(*roots); i++) {
+        snprintf(path, size, "%s/cgroup.controllers", roots[i]);
+        if (access(path, F_OK) == 0) {
+            snprintf(path, size, "%s/leaninit/%s", roots[i], sv->name);
+            return access(path, F_OK) == 0;
+        }
+    }
+    return false;
+}
+
+// Write a value to one of the files in a cgroup, returning false if it couldn't be written
+static bool cgroup_write(const char *cgroup, const char *file, const char *value)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool written = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return written;
+}
+#endif
+
+/* Set the niceness, I/O priority and scheduling policy of a process (0 for leaninit-sched itself, which services
+   inherit them from) for a class. Critical services run ahead of everything else, while idle ones only get the
+   CPU and disk when nothing else wants them. */
+static void set_class(pid_t pid, unsigned char class)
+{
+    static const int nice_values[] = { -10, 0, 19 };
+    setpriority(PRIO_PROCESS, (id_t)pid, nice_values[class]);
+#if defined(__linux__)
+    static const int ioprio[] = { IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT };
+    struct sched_param param = { .sched_priority = 0 };
+    sched_setscheduler(pid, class == CLASS_IDLE ? SCHED_IDLE : SCHED_OTHER, &param);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, ioprio[class]);
+#endif
+}
+
+/* Put every process of a service back in the normal class once it has started. With a cgroup that means each thread
+   in its cgroup.threads, since the niceness and scheduling policy are set per thread on Linux, and otherwise the PIDs
+   in its .pid file. */
+static void reset_class(struct service *sv)
+{
+    if (sv->class == CLASS_NORMAL)
+        return;
+    char path[PATH_MAX + sizeof("/cgroup.threads")];
+#if defined(__linux__)
+    if (service_cgroup(sv, path, PATH_MAX))
+        strcat(path, "/cgroup.threads");
+    else
+#endif
+        snprintf(path, sizeof(path), "/var/run/leaninit/%s.pid", sv->name);
+    char *pids = read_file(path), *list = pids;
+    if (pids == NULL)
+        return;
+    for (pid_t pid; (pid = next_pid(&list)) != 0;)
+        set_class(pid, CLASS_NORMAL);
+    free(pids);
+}
+
+// Print the computed waves
+static void dry_run(unsigned int waves)
+{
+    for (unsigned int w = 0; w < waves; w++) {
+        printf(CYAN "* " WHITE "Wave %u:" RESET, w + 1);
+        for (size_t i = 0; i < nsvcs; i++)
+            if (svcs[i].wave == w && svcs[i].state == SV_WAITING)
+                printf(" %s", svcs[i].name);
+        printf("\n");
+    }
+}
+
+// Bind the sockets of every service that declares them, leaving the services whose sockets can't be bound to fail
+static void bind_sockets(void)
+{
+    for (size_t i = 0; i < nsvcs; i++) {
+        struct service *sv = &svcs[i];
+        if (sv->state != SV_WAITING)
+            continue;
+        char *specs = sv->listen != NULL ? strdup(sv->listen) : NULL, *rest = specs, *spec;
+        while (rest != NULL && (spec = strsep(&rest, " \t")) != NULL) {
+            if (*spec == '\0' || sv->nlisten == LISTEN_MAX)
+                continue;
+            int fd = listen_socket(spec);
+            if unlikely (fd == -1) {
+                printf(RED "* Failed to bind %s for %s: %s" RESET "\n", spec, sv->name, strerror(errno));
+                while (sv->nlisten > 0)
+                    close(sv->listen_fds[--sv->nlisten]);
+                break;
+            }
+            sv->listen_fds[sv->nlisten++] = fd;
+        }
+        free(specs);
+    }
+}
+
+// Write a file in /var/run/leaninit for a service
+static void write_run_file(const char *name, const char *suffix, const char *text)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/var/run/leaninit/%s.%s", name, suffix);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if unlikely (fd == -1)
+        return;
+    write(fd, text, strlen(text));
+    close(fd);
+}
+
+/* Mark a service as Listening before it is started, the way rc.svc records every other state, so that the
+   waitfor calls of its dependents return straight away */
+static void mark_listening(struct service *sv)
+{
+    write_run_file(sv->name, "status", "Listening\n");
+    if (*sv->type) {
+        char text[NAME_MAX + 2];
+        snprintf(text, sizeof(text), "%s\n", sv->name);
+        write_run_file(sv->type, "type", text);
+    }
+
+    pid_t pid;
+    char *state_argv[] = { STATE_BIN, "-s", sv->name, "Listening", *sv->type ? "-t" : NULL, sv->type, NULL };
+    if (posix_spawn(&pid, STATE_BIN, NULL, NULL, state_argv, environ) == 0)
+        waitpid(pid, NULL, 0);
+}
+
+/* Start a service whose sockets are bound, passing them (and only them) to its start script in
+   $LEANINIT_LISTEN_FDS. A lazily started service waits in the child for the first connection first. */
+static pid_t start_listening(struct service *sv, char *start_argv[])
+{
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    // Other services' sockets and the pipe to the parent are closed on exec, but a lazy service may never get there
+    if (ready_fd != -1)
+        close(ready_fd);
+    char fds[LISTEN_MAX * 12] = "";
+    for (size_t i = 0; i < nsvcs; i++)
+        for (int f = 0; f < svcs[i].nlisten; f++) {
+            int fd = svcs[i].listen_fds[f];
+            if (&svcs[i] != sv)
+                close(fd);
+            else if (fcntl(fd, F_SETFD, 0) == 0)
+                snprintf(fds + strlen(fds), sizeof(fds) - strlen(fds), "%s%d", *fds ? " " : "", fd);
+        }
+    setenv("LEANINIT_LISTEN_FDS", fds, 1);
+
+    // A lazily started service is stopped by killing the process waiting for its first connection
+    if (sv->lazy) {
+        set_class(0, CLASS_NORMAL);
+        char pid_text[16];
+        snprintf(pid_text, sizeof(pid_text), "%d\n", getpid());
+        write_run_file(sv->name, "pid", pid_text);
+
+        struct pollfd polls[LISTEN_MAX];
+        for (int f = 0; f < sv->nlisten; f++)
+            polls[f] = (struct pollfd) { .fd = sv->listen_fds[f], .events = POLLIN, .revents = 0 };
+        while (poll(polls, (nfds_t)sv->nlisten, -1) <= 0)
+            ;
+    }
+    execv(start_argv[0], start_argv);
+    _exit(127);
+}
+
+// Start a service in the background with `start`, returning false if it could not be executed
+static bool start_service(struct service *sv)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "svc:%s", sv->name);
+    profile(PROF_BEGIN, path, sv->released_by != NULL ? sv->released_by->name : NULL);
+    sv->state = SV_RUNNING;
+
+    snprintf(path, sizeof(path), SVC_DIR "/%s", sv->name);
+    char *start_argv[] = { path, "start", NULL };
+    bool started;
+    set_class(0, sv->class);
+    if (sv->nlisten != 0) {
+        mark_listening(sv);
+        started = (sv->pid = start_listening(sv, start_argv)) != -1;
+        if unlikely (!started)
+            write_run_file(sv->name, "status", "Failure\n");
+    } else
+        started = posix_spawn(&sv->pid, path, NULL, NULL, start_argv, environ) == 0;
+    set_class(0, CLASS_NORMAL);
+    if unlikely (!started)
+        printf(RED "* Failed to execute %s" RESET "\n", path);
+    return started;
+}
+
+// Release the dependents of a service, doomed if it failed to start
+static void release(struct service *sv, bool ready)
+{
+    if (sv->released)
+        return;
+    sv->released = true;
+    if (ready_fd != -1 && sv == &svcs[wait_target]) {
+        close(ready_fd);
+        ready_fd = -1;
+    }
+    for (size_t e = 0; e < sv->nedges; e++) {
+        struct service *dependent = &svcs[sv->edges[e].to];
+        if (sv->edges[e].broken || dependent->state != SV_WAITING)
+            continue;
+        if (!ready && sv->edges[e].hard)
+            dependent->doomed = true;
+        dependent->released_by = sv;
+        dependent->pending--;
+    }
+}
+
+/* Add the hard prerequisites of every wanted service to the runlevel, then mark whatever needs no work as done:
+   the services that stay running when stopping, and the unwanted or already running ones when starting. Returns the
+   number of services left to start or stop. */
+static size_t plan(bool stop)
+{
+    bool grown = true;
+    while (grown) {
+        grown = false;
+        for (size_t i = 0; i < nsvcs; i++)
+            for (size_t e = 0; e < svcs[i].nedges && !svcs[i].wanted; e++)
+                if (svcs[i].edges[e].hard && svcs[svcs[i].edges[e].to].wanted)
+                    svcs[i].wanted = grown = true;
+    }
+
+    size_t left = 0;
+    for (size_t i = 0; i < nsvcs; i++) {
+        if (stop ? !svcs[i].wanted : svcs[i].wanted && !svcs[i].running)
+            left++;
+        else
+            svcs[i].state = SV_READY;
+    }
+    for (size_t i = 0; i < nsvcs && !stop; i++)
+        if (svcs[i].state == SV_READY)
+            release(&svcs[i], true);
+    return left;
+}
+
+// Record that a service has finished starting (or failed to) and release its dependents
+static void finish(struct service *sv, bool ready)
+{
+    if (sv->state == SV_RUNNING) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "svc:%s", sv->name);
+        profile(ready ? PROF_END : PROF_FAIL, name, NULL);
+    }
+    sv->state = ready ? SV_READY : SV_FAILED;
+    release(sv, ready);
+}
+
+/* Start the services whose prerequisites have all finished, as long as fewer than max_jobs are running. The most
+   urgent class goes first, then the service with the longest chain of dependents. Returns the number running. */
+static size_t dispatch(void)
+{
+    size_t running = 0;
+    for (size_t i = 0; i < nsvcs; i++)
+        if (svcs[i].state == SV_RUNNING)
+            running++;
+
+    for (;;) {
+        struct service *next = NULL;
+        bool doomed = false;
+        for (size_t i = 0; i < nsvcs; i++) {
+            struct service *sv = &svcs[i];
+            if (sv->state != SV_WAITING || sv->pending != 0)
+                continue;
+            if unlikely (sv->doomed) {
+                printf(RED "* %s was not started because one of its dependencies failed to start" RESET "\n",
+                       sv->name);
+                finish(sv, false);
+                doomed = true;
+            } else if (next == NULL || sv->class < next->class
+                       || (sv->class == next->class && sv->height > next->height))
+                next = sv;
+        }
+        if (doomed)
+            continue;
+        if (next == NULL || (max_jobs != 0 && running >= max_jobs))
+            return running;
+
+        if unlikely (!start_service(next))
+            finish(next, false);
+        else if (next->lazy && next->nlisten != 0) {
+            // It is started on its first connection, which may never come
+            finish(next, true);
+        } else {
+            // Connections to its sockets are queued until it is ready, so its dependents don't need to wait
+            if (next->nlisten != 0)
+                release(next, true);
+            running++;
+        }
+    }
+}
+
+// Return the current monotonic time in milliseconds
+static long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Stop a service in the background with `stop`, in its own process group so it can be killed at its deadline
+static bool stop_service(struct service *sv)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "stop:%s", sv->name);
+    profile(PROF_BEGIN, path, sv->released_by != NULL ? sv->released_by->name : NULL);
+    sv->state = SV_RUNNING;
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    snprintf(path, sizeof(path), SVC_DIR "/%s", sv->name);
+    char *stop_argv[] = { path, "stop", NULL };
+    int err = posix_spawn(&sv->pid, path, NULL, &attr, stop_argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if unlikely (err != 0) {
+        printf(RED "* Failed to execute %s" RESET "\n", path);
+        return false;
+    }
+    sv->deadline = now_ms() + (sv->stop_timeout + STOP_GRACE) * 1000LL;
+    if (stop_deadline != 0 && sv->deadline > stop_deadline)
+        sv->deadline = stop_deadline;
+
+    // Watch the stop script with a pidfd (or EVFILT_PROC), so its exit wakes up stop_all() straight away
+#if defined(__linux__)
+    sv->pidfd = (int)syscall(SYS_pidfd_open, sv->pid, 0);
+#else
+    struct kevent change;
+    EV_SET(&change, sv->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, sv);
+    kevent(stop_queue, &change, 1, NULL, 0, NULL);
+#endif
+    return true;
+}
+
+// Record that a service has stopped and release the services it depends on
+static void finish_stop(struct service *sv, bool stopped)
+{
+    if (sv->state == SV_RUNNING) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "stop:%s", sv->name);
+        profile(stopped ? PROF_END : PROF_FAIL, name, NULL);
+    }
+    if (sv->pidfd != -1) {
+        close(sv->pidfd);
+        sv->pidfd = -1;
+    }
+    sv->state = stopped ? SV_READY : SV_FAILED;
+
+    size_t index = (size_t)(sv - svcs);
+    for (size_t i = 0; i < nsvcs; i++)
+        for (size_t e = 0; e < svcs[i].nedges; e++)
+            if (svcs[i].edges[e].to == index && !svcs[i].edges[e].broken) {
+                svcs[i].released_by = sv;
+                svcs[i].pending--;
+            }
+}
+
+/* Kill a stop script that has passed its deadline along with everything left in the service's cgroup, which also
+   catches daemons that forked away from the PIDs in its .pid file. Those PIDs are only used without a cgroup. */
+static void kill_service(struct service *sv)
+{
+    printf(RED "* %s did not stop in time, sending SIGKILL..." RESET "\n", sv->name);
+    kill(-sv->pid, SIGKILL);
+    waitpid(sv->pid, NULL, 0);
+
+    char path[PATH_MAX];
+#if defined(__linux__)
+    if (service_cgroup(sv, path, sizeof(path))) {
+        // Freeze the cgroup so nothing in it can fork while being killed, as cgroup.kill requires Linux 5.14
+        if (!cgroup_write(path, "cgroup.kill", "1")) {
+            cgroup_write(path, "cgroup.freeze", "1");
+            char procs[PATH_MAX + sizeof("/cgroup.procs")], *pids, *list;
+            snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+            if ((list = pids = read_file(procs)) != NULL) {
+                for (pid_t pid; (pid = next_pid(&list)) != 0;)
+                    kill(pid, SIGKILL);
+                free(pids);
+            }
+        }
+
+        // The cgroup can only be removed once it has emptied
+        if (cgroup_wait(path, 1000))
+            rmdir(path);
+        finish_stop(sv, false);
+        return;
+    }
+#endif
+    snprintf(path, sizeof(path), "/var/run/leaninit/%s.pid", sv->name);
+    char *pids = read_file(path), *list = pids;
+    if (pids != NULL) {
+        for (pid_t pid; (pid = next_pid(&list)) != 0;)
+            kill(pid, SIGKILL);
+        free(pids);
+    }
+    finish_stop(sv, false);
+}
+
+// Stop every service whose dependents have all stopped, returning the number of stop scripts still running
+static size_t dispatch_stop(void)
+{
+    size_t running = 0;
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (size_t i = 0; i < nsvcs; i++)
+            if (svcs[i].state == SV_WAITING && svcs[i].pending == 0 && !stop_service(&svcs[i])) {
+                finish_stop(&svcs[i], false);
+                progress = true;
+            }
+    }
+
+    for (size_t i = 0; i < nsvcs; i++)
+        if (svcs[i].state == SV_RUNNING)
+            running++;
+    return running;
+}
+
+// Reap a stop script that has exited
+static void reap_stop(struct service *sv)
+{
+    int status;
+    if (waitpid(sv->pid, &status, WNOHANG) == sv->pid)
+        finish_stop(sv, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Stop all running services in reverse dependency order with as many stopping at once as possible
+static void stop_all(void)
+{
+    // In reverse, a service has to wait for each of its dependents that is being stopped instead of its prerequisites
+    for (size_t i = 0; i < nsvcs; i++) {
+        svcs[i].pending = 0;
+        for (size_t e = 0; e < svcs[i].nedges; e++)
+            svcs[i].pending += !svcs[i].edges[e].broken && svcs[svcs[i].edges[e].to].state == SV_WAITING;
+    }
+
+#if defined(__linux__)
+    struct pollfd *fds = malloc(nsvcs * sizeof(struct pollfd));
+    size_t *owners = malloc(nsvcs * sizeof(size_t));
+    if unlikely (fds == NULL || owners == NULL) {
+        printf(RED "* Memory allocation failed" RESET "\n");
+        return;
+    }
+#else
+    if unlikely ((stop_queue = kqueue()) == -1) {
+        perror(RED "* kqueue()" RESET);
+        return;
+    }
+#endif
+
+    while (dispatch_stop() != 0) {
+        // Sleep until a stop script exits or the nearest deadline passes
+        long long now = now_ms(), next = -1;
+        bool fallback = false;
+        for (size_t i = 0; i < nsvcs; i++) {
+            if (svcs[i].state != SV_RUNNING)
+                continue;
+            if (svcs[i].deadline <= now) {
+                kill_service(&svcs[i]);
+                next = now;
+            } else if (next == -1 || svcs[i].deadline < next)
+                next = svcs[i].deadline;
+#if defined(__linux__)
+            fallback |= svcs[i].pidfd == -1;
+#endif
+        }
+        if (next == now)
+            continue;
+        int timeout = (int)(next - now);
+
+#if defined(__linux__)
+        // Without pidfd_open(2) (Linux 5.3+), check the stop scripts every tenth of a second
+        if unlikely (fallback && timeout > 100)
+            timeout = 100;
+        nfds_t nfds = 0;
+        for (size_t i = 0; i < nsvcs; i++)
+            if (svcs[i].state == SV_RUNNING && svcs[i].pidfd != -1) {
+                fds[nfds] = (struct pollfd) { .fd = svcs[i].pidfd, .events = POLLIN, .revents = 0 };
+                owners[nfds++] = i;
+            }
+        if (poll(fds, nfds, timeout) > 0)
+            for (nfds_t f = 0; f < nfds; f++)
+                if (fds[f].revents != 0)
+                    reap_stop(&svcs[owners[f]]);
+        if unlikely (fallback)
+            for (size_t i = 0; i < nsvcs; i++)
+                if (svcs[i].state == SV_RUNNING && svcs[i].pidfd == -1)
+                    reap_stop(&svcs[i]);
+#else
+        (void)fallback;
+        struct kevent events[16];
+        struct timespec wait = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+        int count = kevent(stop_queue, NULL, 0, events, 16, &wait);
+        for (int e = 0; e < count; e++)
+            reap_stop(events[e].udata);
+#endif
+    }
+
+#if defined(__linux__)
+    free(fds);
+    free(owners);
+#else
+    close(stop_queue);
+#endif
+}
+
+// Read the value of a variable set in rc.conf(5), returning false if it isn't set
+static bool read_conf(const char *name, char *value, size_t size)
+{
+    FILE *conf = fopen(RC_CONF_PATH, "r");
+    if unlikely (conf == NULL)
+        return false;
+
+    bool found = false;
+    size_t len = strlen(name);
+    char line[256];
+    while (fgets(line, sizeof(line), conf) != NULL) {
+        if (strncmp(line, name, len) != 0 || line[len] != '=')
+            continue;
+        line[strcspn(line, "\n")] = 0;
+        snprintf(value, size, "%s", unquote(line + len + 1));
+        found = true;
+    }
+
+    fclose(conf);
+    return found;
+}
+
+// Return true if DELAY is set to true in rc.conf(5)
+static bool delay_enabled(void)
+{
+    char delay[16];
+    return read_conf("DELAY", delay, sizeof(delay)) && strcmp(delay, "true") == 0;
+}
+
+// The number of services started at once: JOBS in rc.conf(5), or twice the number of online CPUs
+static size_t default_jobs(void)
+{
+    char jobs[16];
+    if (read_conf("JOBS", jobs, sizeof(jobs)) && *jobs != '\0')
+        return (size_t)strtoul(jobs, NULL, 10);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus * 2 : 2;
+}
+
+// Copy a file, or remove the copy when the original doesn't exist
+static void copy_file(const char *from, const char *to)
+{
+    char *text = read_file(from);
+    if (text == NULL) {
+        unlink(to);
+        return;
+    }
+    int fd = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if likely (fd != -1) {
+        write(fd, text, strlen(text));
+        close(fd);
+    }
+    free(text);
+}
+
+// Record the compiled configuration in RC_CACHE as the one the running services have loaded
+static void save_snapshot(void)
+{
+    copy_file(RC_CACHE, SNAPSHOT_PATH);
+}
+
+// Compile RC_CACHE again with `leaninit-service --compile`, returning false if that failed
+static bool compile_cache(void)
+{
+    pid_t pid;
+    int status;
+    char *compile_argv[] = { SERVICE_BIN, "--compile", NULL };
+    return posix_spawn(&pid, SERVICE_BIN, NULL, NULL, compile_argv, environ) == 0 && waitpid(pid, &status, 0) == pid
+           && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Return true if a character can be part of a shell variable name
+static bool name_char(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Return the line after the given one, or NULL if it is the last
+static const char *next_line(const char *line)
+{
+    const char *end = strchr(line, '\n');
+    return end != NULL ? end + 1 : NULL;
+}
+
+// Return the length of a value single quoted by leaninit-service(8), which may span lines and contain '\''
+static size_t quoted_len(const char *value)
+{
+    if (*value != '\'')
+        return strcspn(value, "\n");
+    const char *end = value;
+    while ((end = strchr(end + 1, '\'')) != NULL && strncmp(end, "'\\''", 4) == 0)
+        end += 3;
+    return end != NULL ? (size_t)(end - value) + 1 : strlen(value);
+}
+
+/* Find the value of a variable exported by a compiled configuration (a line starting with `export NAME=`).
+   Returns NULL if the variable isn't exported. */
+static const char *assignment(const char *text, const char *name, size_t len, size_t *value_len)
+{
+    for (const char *line = text; line != NULL && *line; line = next_line(line))
+        if (strncmp(line, "export ", 7) == 0 && strncmp(line + 7, name, len) == 0 && line[7 + len] == '=') {
+            *value_len = quoted_len(line + 8 + len);
+            return line + 8 + len;
+        }
+    return NULL;
+}
+
+/* Add the variables exported by one compiled configuration whose value is different (or missing) in the other
+   to a list of names, separated and surrounded by spaces */
+static void diff_vars(const char *text, const char *other, char **changed)
+{
+    for (const char *line = text; line != NULL && *line; line = next_line(line)) {
+        if (strncmp(line, "export ", 7) != 0)
+            continue;
+        const char *name = line + 7;
+        size_t len = 0;
+        while (name_char(name[len]))
+            len++;
+        if (len == 0 || len > NAME_MAX || name[len] != '=')
+            continue;
+
+        char word[NAME_MAX + 3];
+        snprintf(word, sizeof(word), " %.*s ", (int)len, name);
+        size_t a_len = 0, b_len = 0;
+        const char *a = assignment(text, name, len, &a_len), *b = assignment(other, name, len, &b_len);
+        if (strstr(*changed, word) != NULL || (b != NULL && a_len == b_len && memcmp(a, b, a_len) == 0))
+            continue;
+        char *grown = realloc(*changed, strlen(*changed) + len + 2);
+        if unlikely (grown == NULL)
+            return;
+        *changed = grown;
+        strcat(*changed, word + 1);
+    }
+}
+
+// Return true if a script expands ($NAME or ${NAME...) any of the variables in a list made by diff_vars()
+static bool expands(const char *script, const char *changed)
+{
+    for (const char *dollar = strchr(script, '$'); dollar != NULL; dollar = strchr(dollar + 1, '$')) {
+        const char *name = dollar + 1 + (dollar[1] == '{');
+        size_t len = 0;
+        while (name_char(name[len]))
+            len++;
+        char word[NAME_MAX + 3];
+        if (len != 0 && len <= NAME_MAX) {
+            snprintf(word, sizeof(word), " %.*s ", (int)len, name);
+            if (strstr(changed, word) != NULL)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* Return true if a changed variable can't be pinned on the scripts that expand it: rc.svc(8) expands it for every
+   service, or no service script names it, so it could only be read by a daemon from its environment */
+static bool unattributed(const char *changed, char *const *scripts, const char *rc_svc)
+{
+    for (const char *name = changed + 1; *name; name += strcspn(name, " ") + 1) {
+        char word[NAME_MAX + 3];
+        snprintf(word, sizeof(word), " %.*s ", (int)strcspn(name, " "), name);
+        bool named = false;
+        for (size_t i = 0; i < nsvcs && !named; i++)
+            named = scripts[i] != NULL && expands(scripts[i], word);
+        if (!named || (rc_svc != NULL && expands(rc_svc, word)))
+            return true;
+    }
+    return false;
+}
+
+// Find the function a compiled configuration sets a service's rc.conf.d variables with, returning its length in len
+static const char *conf_function(const char *text, const char *conf, size_t *len)
+{
+    char head[NAME_MAX + 16];
+    snprintf(head, sizeof(head), "__conf_%s()\n", conf);
+    for (const char *line = text; line != NULL && *line; line = next_line(line))
+        if (strncmp(line, head, strlen(head)) == 0) {
+            const char *end = strstr(line, "\n    :\n}\n");
+            *len = end != NULL ? (size_t)(end - line) : strlen(line);
+            return line;
+        }
+    return NULL;
+}
+
+// Return true if a service's rc.conf.d variables are different in the two compiled configurations
+static bool conf_changed(const struct service *sv, const char *old, const char *new)
+{
+    if (!*sv->conf)
+        return false;
+    size_t old_len = 0, new_len = 0;
+    const char *a = conf_function(old, sv->conf, &old_len), *b = conf_function(new, sv->conf, &new_len);
+    return (a == NULL) != (b == NULL) || (a != NULL && (old_len != new_len || memcmp(a, b, old_len) != 0));
+}
+
+/* Reload (or restart, when they can't be reloaded) the running services whose configuration changed since they were
+   started or last reloaded, all at once, then record the new configuration as the one they have loaded. The
+   configuration is RC_CACHE, compiled again first, so it is exactly what rc.svc(8) will load. */
+static int reload_changed(void)
+{
+    char *old = read_file(SNAPSHOT_PATH);
+    if (old == NULL) {
+        printf(PURPLE "* " YELLOW "The configuration the services were started with is unknown, nothing to reload"
+                      RESET "\n");
+        compile_cache();
+        save_snapshot();
+        return 0;
+    }
+    bool everything = !compile_cache();
+    if unlikely (everything)
+        printf(RED "* " RC_CACHE " could not be compiled, reloading every running service" RESET "\n");
+    char *new = read_file(RC_CACHE), *changed = strdup(" ");
+    if unlikely (new == NULL || changed == NULL || load_services(true) != 0) {
+        free(old);
+        free(new);
+        free(changed);
+        return 1;
+    }
+    diff_vars(old, new, &changed);
+    diff_vars(new, old, &changed);
+
+    // A changed variable that no single service can be blamed for reloads them all
+    char path[PATH_MAX], **scripts = calloc(nsvcs + 1, sizeof(char *));
+    for (size_t i = 0; scripts != NULL && i < nsvcs; i++) {
+        snprintf(path, sizeof(path), SVC_DIR "/%s", svcs[i].name);
+        scripts[i] = read_file(path);
+    }
+    everything = everything || scripts == NULL;
+    if (strlen(changed) > 1 && !everything) {
+        char *rc_svc = read_file(RC_SVC_PATH);
+        everything = unattributed(changed, scripts, rc_svc);
+        free(rc_svc);
+    }
+
+    // Start every reload at once
+    size_t reloading = 0;
+    for (size_t i = 0; i < nsvcs; i++) {
+        struct service *sv = &svcs[i];
+        bool stale = everything || conf_changed(sv, old, new)
+                     || (scripts[i] != NULL && strlen(changed) > 1 && expands(scripts[i], changed));
+        if (!stale)
+            continue;
+        if (verbose)
+            printf(CYAN "* " WHITE "The configuration of %s has changed, reloading it..." RESET "\n", sv->name);
+        snprintf(path, sizeof(path), SVC_DIR "/%s", sv->name);
+        char *reload_argv[] = { path, "force-reload", NULL };
+        if likely (posix_spawn(&sv->pid, path, NULL, NULL, reload_argv, environ) == 0) {
+            sv->state = SV_RUNNING;
+            reloading++;
+        } else
+            printf(RED "* Failed to execute %s" RESET "\n", path);
+    }
+    for (size_t i = 0; scripts != NULL && i < nsvcs; i++)
+        free(scripts[i]);
+    free(scripts);
+    free(changed);
+    free(old);
+    free(new);
+
+    while (reloading != 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if unlikely (pid == -1 && errno != EINTR)
+            break;
+        for (size_t i = 0; i < nsvcs; i++) {
+            if (svcs[i].state != SV_RUNNING || svcs[i].pid != pid)
+                continue;
+            svcs[i].state = WIFEXITED(status) && WEXITSTATUS(status) == 0 ? SV_READY : SV_FAILED;
+            if unlikely (svcs[i].state == SV_FAILED)
+                printf(RED "* %s could not be reloaded" RESET "\n", svcs[i].name);
+            reloading--;
+        }
+    }
+
+    save_snapshot();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // Long options
+    struct option long_options[] = { { "jobs", required_argument, NULL, 'j' },
+                                     { "dry-run", no_argument, NULL, 'n' },
+                                     { "runlevel", required_argument, NULL, 'r' },
+                                     { "stop", no_argument, NULL, 's' },
+                                     { "timeout", required_argument, NULL, 't' },
+                                     { "wait", required_argument, NULL, 'w' },
+                                     { "reload", no_argument, NULL, 'R' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+    // Parse options
+    bool dry = false, stop = false, reload = false;
+    const char *wait_for = NULL;
+    unsigned long timeout = 0;
+    const char *jobs = NULL;
+    int args;
+    while ((args = getopt_long(argc, argv, "j:nr:st:w:R?", long_options, NULL)) != -1)
+        switch (args) {
+            case 'j':
+                jobs = optarg;
+                break;
+            case 'n':
+                dry = true;
+                break;
+            case 'r':
+                runlevel = optarg;
+                break;
+            case 's':
+                stop = true;
+                break;
+            case 't':
+                timeout = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                wait_for = optarg;
+                break;
+            case 'R':
+                reload = true;
+                break;
+            default:
+                usage(1);
+                __builtin_unreachable();
+        }
+    if (optind < argc && strcmp(argv[optind], "silent") == 0)
+        verbose = false;
+    if unlikely (runlevel != NULL && strcmp(runlevel, "single") != 0 && strcmp(runlevel, "multi") != 0) {
+        printf(RED "* Unknown runlevel '%s' (expected single or multi)" RESET "\n", runlevel);
+        return 1;
+    }
+
+    // Only root can start services
+    if unlikely (!dry && getuid() != 0) {
+        printf(RED "* Permission denied!" RESET "\n");
+        return 1;
+    }
+
+    // The pipe to the profiler is kept away from services
+    int profiler = profile_fd();
+    if (profiler != -1)
+        fcntl(profiler, F_SETFD, FD_CLOEXEC);
+    unsetenv("LEANINIT_PROFILE_FD");
+    setenv("OUTPUT_MODE", verbose ? "verbose" : "silent", 1);
+    if (reload)
+        return reload_changed();
+
+    // Build the dependency graph
+    if unlikely (load_services(stop) != 0 || build_graph() != 0)
+        return 1;
+    for (size_t i = 0; i < nsvcs; i++)
+        if (svcs[i].mark == 0)
+            break_cycles(i);
+    size_t left = plan(stop);
+    unsigned int waves = compute_waves();
+    for (size_t i = 0; i < nsvcs; i++)
+        compute_height(i);
+    max_jobs = jobs != NULL ? (size_t)strtoul(jobs, NULL, 10) : default_jobs();
+
+    // Stop the running services
+    if (stop && !dry) {
+        if (verbose)
+            printf(CYAN "* " WHITE "Stopping %zu services..." RESET "\n", left);
+        profile(PROF_BEGIN, "stop", NULL);
+        if (timeout != 0)
+            stop_deadline = now_ms() + (long long)timeout * 1000;
+        stop_all();
+        profile(PROF_END, "stop", NULL);
+        return 0;
+    }
+    if (dry) {
+        dry_run(waves);
+        return 0;
+    }
+
+    /* When waiting for a service, fork into the background and have the parent exit once the service has
+       started. The write end of the pipe is closed on exec so that services never hold it open. */
+    int ready_pipe[2];
+    if (wait_for != NULL && !delay_enabled()) {
+        if unlikely (pipe(ready_pipe) != 0) {
+            perror(RED "* pipe()" RESET);
+            return 1;
+        }
+        pid_t child = fork();
+        if unlikely (child == -1) {
+            perror(RED "* fork()" RESET);
+            return 1;
+        } else if (child != 0) {
+            char byte;
+            close(ready_pipe[1]);
+            while (read(ready_pipe[0], &byte, 1) == -1 && errno == EINTR)
+                ;
+            return 0;
+        }
+        close(ready_pipe[0]);
+        fcntl(ready_pipe[1], F_SETFD, FD_CLOEXEC);
+        if ((wait_target = resolve(wait_for, true)) != -1 && svcs[wait_target].state == SV_WAITING) {
+            ready_fd = ready_pipe[1];
+            make_critical((size_t)wait_target);
+        } else
+            close(ready_pipe[1]);
+    }
+
+    // Start the services once every socket is bound, recording the configuration they load for --reload
+    profile(PROF_BEGIN, "sched", NULL);
+    if (access(SNAPSHOT_PATH, F_OK) != 0)
+        save_snapshot();
+    bind_sockets();
+    if (verbose)
+        printf(CYAN "* " WHITE "Starting %zu services in %u waves..." RESET "\n", left, waves);
+    size_t running = dispatch();
+    while (running != 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if unlikely (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (size_t i = 0; i < nsvcs; i++) {
+            if (svcs[i].state != SV_RUNNING || svcs[i].pid != pid)
+                continue;
+            finish(&svcs[i], WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            reset_class(&svcs[i]);
+            break;
+        }
+        running = dispatch();
+    }
+
+    profile(PROF_END, "sched", NULL);
+    return 0;
+}
@@ -0,0 +1,648 @@
+/*
+ * Copyright © 2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * leaninit-spawn -- Start a daemon directly, without a shell in between
+ *
+ * The command is given as arguments, or as a single string with -c that is split into
+ * words once (commands using any other shell syntax are run by sh(1) instead). Limits,
+ * the umask, the working directory and environment files are applied to leaninit-spawn
+ * itself and inherited by the daemon, which is started with vfork(2) after dropping its
+ * credentials, so the PID written to the pidfile is the daemon's own. With -x the
+ * daemon is executed in place of leaninit-spawn instead.
+ *
+ * Daemons that support it can tell leaninit-spawn when they are ready to serve, either by
+ * writing to a pipe given to them as a file descriptor (-r) or by sending READY=1 to the
+ * datagram socket in $NOTIFY_SOCKET (-n). leaninit-spawn only returns once they have,
+ * which is what lets services be marked as started when their daemon is actually ready.
+ *
+ * Listening sockets given with -L are handed to the daemon the way sd_listen_fds(3) expects.
+ * Sockets that leaninit-sched(8) bound ahead of time are passed in $LEANINIT_LISTEN_FDS,
+ * and any that weren't are bound here.
+ */
+
+#include <leaninit.h>
+#include <grp.h>
+#include <pwd.h>
+
+#define MAX_WORDS     256 // Words in a command given with -c
+#define READY_TIMEOUT 7   // Seconds the daemon is given to become ready by default
+
+// Resource limits that can be set with -l
+static const struct {
+    const char *name;
+    int resource;
+} limits[] = { { "as", RLIMIT_AS },           { "core", RLIMIT_CORE },     { "cpu", RLIMIT_CPU },
+               { "data", RLIMIT_DATA },       { "fsize", RLIMIT_FSIZE },   { "memlock", RLIMIT_MEMLOCK },
+               { "nofile", RLIMIT_NOFILE },   { "nproc", RLIMIT_NPROC },   { "stack", RLIMIT_STACK } };
+
+// Credentials of the daemon, resolved before the daemon is started
+static struct {
+    bool set;
+    uid_t uid;
+    gid_t gid;
+    gid_t *groups;
+    int ngroups;
+} creds = { .uid = (uid_t)-1, .gid = (gid_t)-1 };
+
+// Set by the child when the daemon couldn't be started, which vfork(2) lets the parent see
+static volatile int spawn_errno = 0;
+
+// How the daemon announces that it's ready: the pipe it writes to (-r), or the socket it sends READY=1 to (-n)
+static int ready_fd = -1;     // The file descriptor the daemon is given the pipe as
+static int ready_pipe[2] = { -1, -1 };
+static int notify_sock = -1;
+static int chld_pipe[2] = { -1, -1 }; // Written to by sigchld(), so the daemon exiting wakes up wait_ready()
+
+// Listening sockets for the daemon, which are kept above the descriptors they are numbered as until it starts
+static int listen_fds[LISTEN_MAX];
+static int nlisten = 0;
+static char *listen_pid = NULL; // The value of $LISTEN_PID, filled in by the daemon's process
+
+// Show usage information
+static cold noreturn void usage(void)
+{
+    printf("Usage: %s [-asx] [-p pidfile] [-u user] [-g group] [-m umask] [-d dir] [-e file]\n"
+           "          [-l limit=soft[:hard]] [-r fd | -n socket] [-t timeout] [-L sockets] command [argument ...]\n"
+           "    or %s [options] -c command\n"
+           "  -p, --pidfile   Write the daemon's PID to the given file\n"
+           "  -a, --append    Add the PID to the pidfile instead of replacing its contents\n"
+           "  -s, --setsid    Start the daemon in a new session\n"
+           "  -u, --user      Run the daemon as the given user, with their groups\n"
+           "  -g, --group     Run the daemon with the given group\n"
+           "  -m, --umask     Set the file mode creation mask (in octal)\n"
+           "  -d, --chdir     Change to the given directory\n"
+           "  -e, --env       Add the NAME=value lines in the given file to the environment\n"
+           "  -l, --limit     Set a resource limit (as, core, cpu, data, fsize, memlock, nofile, nproc or stack)\n"
+           "  -c, --command   Split the given string into the command and its arguments\n"
+           "  -x, --exec      Execute the daemon in place of %s instead of in the background\n"
+           "  -r, --ready-fd  Wait for the daemon to write to the given file descriptor once it is ready\n"
+           "  -n, --notify    Wait for the daemon to send READY=1 to the given socket ($NOTIFY_SOCKET)\n"
+           "  -t, --timeout   Seconds to wait for the daemon to become ready (defaults to seven)\n"
+           "  -L, --listen    Pass the given listening sockets (tcp:port, unix:path, ...) to the daemon\n"
+           "  -?, --help      Show this usage information\n",
+           __progname, __progname, __progname);
+    exit(1);
+}
+
+// Parse a limit, which is a number or 'unlimited'
+static bool parse_limit(const char *text, rlim_t *limit)
+{
+    if (strcmp(text, "unlimited") == 0 || strcmp(text, "infinity") == 0) {
+        *limit = RLIM_INFINITY;
+        return true;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    *limit = (rlim_t)value;
+    return errno == 0 && end != text && *end == '\0';
+}
+
+// Set a resource limit given as name=soft[:hard], where the hard limit defaults to the soft one
+static bool set_limit(char *spec)
+{
+    char *soft = strchr(spec, '=');
+    if unlikely (soft == NULL)
+        return false;
+    *soft++ = '\0';
+    char *hard = strchr(soft, ':');
+    if (hard != NULL)
+        *hard++ = '\0';
+
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        if (strcmp(spec, limits[i].name) != 0)
+            continue;
+        struct rlimit limit;
+        if unlikely (!parse_limit(soft, &limit.rlim_cur) || !parse_limit(hard != NULL ? hard : soft, &limit.rlim_max))
+            return false;
+        return setrlimit(limits[i].resource, &limit) == 0;
+    }
+    return false;
+}
+
+// Add the NAME=value lines of a file to the environment, skipping blank lines and comments
+static bool read_env(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if unlikely (file == NULL)
+        return false;
+
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, file) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        char *name = line + strspn(line, " \t");
+        if (strncmp(name, "export ", 7) == 0)
+            name += 7;
+        char *value = strchr(name, '=');
+        if (*name == '#' || value == NULL || value == name)
+            continue;
+        *value++ = '\0';
+
+        // Remove the quotes around the value
+        size_t len = strlen(value);
+        if (len >= 2 && (value[0] == '"' || value[0] == '\'') && value[len - 1] == value[0]) {
+            value[len - 1] = '\0';
+            value++;
+        }
+        setenv(name, value, 1);
+    }
+
+    free(line);
+    fclose(file);
+    return true;
+}
+
+// Resolve the user and group the daemon runs as
+static bool resolve_creds(const char *user, const char *group)
+{
+    if (user != NULL) {
+        struct passwd *pw = getpwnam(user);
+        if unlikely (pw == NULL)
+            return false;
+        creds.uid = pw->pw_uid;
+        creds.gid = pw->pw_gid;
+
+        // The user's supplementary groups
+        int ngroups = 16;
+        do {
+            gid_t *grown = realloc(creds.groups, (size_t)ngroups * sizeof(gid_t));
+            if unlikely (grown == NULL)
+                return false;
+            creds.groups = grown;
+#if defined(__linux__)
+        } while (getgrouplist(pw->pw_name, pw->pw_gid, creds.groups, &ngroups) == -1);
+#else
+        } while (getgrouplist(pw->pw_name, (int)pw->pw_gid, (int *)creds.groups, &ngroups) == -1);
+#endif
+        creds.ngroups = ngroups;
+    }
+    if (group != NULL) {
+        struct group *gr = getgrnam(group);
+        if unlikely (gr == NULL)
+            return false;
+        creds.gid = gr->gr_gid;
+        if (user == NULL) {
+            creds.groups = &creds.gid;
+            creds.ngroups = 1;
+        }
+    }
+    creds.set = user != NULL || group != NULL;
+    return true;
+}
+
+// Drop to the daemon's credentials, which only makes system calls so it is safe in a vfork(2) child
+static bool drop_creds(void)
+{
+    if (!creds.set)
+        return true;
+    return setgroups((size_t)creds.ngroups, creds.groups) == 0 && setgid(creds.gid) == 0
+           && (creds.uid == (uid_t)-1 || setuid(creds.uid) == 0);
+}
+
+/* Write a PID to a pidfile by renaming a new file over it, so nobody ever reads a partial file. The directory
+   is locked while doing so, so several daemons of a service can add themselves to its pidfile at once. */
+static bool write_pidfile(const char *path, pid_t pid, bool append)
+{
+    char dir[PATH_MAX], tmp[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        memcpy(dir, ".", 2);
+    else
+        slash[slash == dir] = '\0';
+    int lock = open(dir, O_RDONLY | O_CLOEXEC);
+    if unlikely (lock == -1 || flock(lock, LOCK_EX) != 0 || snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= PATH_MAX)
+        goto fail;
+    int fd = mkstemp(tmp);
+    if unlikely (fd == -1)
+        goto fail;
+    fchmod(fd, 0644);
+
+    // Keep the PIDs already in the file when appending
+    bool ok = true;
+    int old = append ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (old != -1) {
+        char buf[4096];
+        ssize_t len;
+        while ((len = read(old, buf, sizeof(buf))) > 0)
+            ok &= write(fd, buf, (size_t)len) == len;
+        close(old);
+    }
+    ok &= dprintf(fd, "%d\n", pid) > 0;
+    ok &= close(fd) == 0;
+    if unlikely (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        goto fail;
+    }
+    close(lock);
+    return true;
+
+fail:
+    if (lock != -1)
+        close(lock);
+    return false;
+}
+
+/* Bind the sockets in a space separated list, or take the ones leaninit-sched(8) bound already, and set
+   $LISTEN_FDS. $LISTEN_PID is filled in by pass_listen() once the daemon's PID is known. */
+static bool setup_listen(char *specs)
+{
+    char *inherited = getenv("LEANINIT_LISTEN_FDS"), *spec;
+    while ((spec = strsep(&specs, " \t")) != NULL) {
+        if (*spec == '\0')
+            continue;
+        else if unlikely (nlisten == LISTEN_MAX) {
+            printf(RED "* Only %d listening sockets can be passed" RESET "\n", LISTEN_MAX);
+            return false;
+        }
+        char *fd = inherited != NULL ? strsep(&inherited, " ") : NULL;
+        int sock = fd != NULL && *fd != '\0' ? atoi(fd) : listen_socket(spec);
+        if unlikely (sock == -1) {
+            printf(RED "* Failed to bind %s: %s" RESET "\n", spec, strerror(errno));
+            return false;
+        }
+
+        // Daemons that drop their privileges have to be able to accept on it
+        if (creds.set && strncmp(spec, "unix:", 5) == 0)
+            chown(spec + 5, creds.uid, creds.gid);
+        listen_fds[nlisten] = fcntl(sock, F_DUPFD_CLOEXEC, 3 + LISTEN_MAX);
+        close(sock);
+        if unlikely (listen_fds[nlisten++] == -1)
+            return false;
+    }
+    unsetenv("LEANINIT_LISTEN_FDS");
+
+    char count[16];
+    snprintf(count, sizeof(count), "%d", nlisten);
+    if (setenv("LISTEN_FDS", count, 1) != 0 || setenv("LISTEN_PID", "0000000000", 1) != 0)
+        return false;
+    listen_pid = getenv("LISTEN_PID");
+    return true;
+}
+
+// Number the listening sockets from 3 and put the daemon's PID in $LISTEN_PID, which is safe in a vfork(2) child
+static bool pass_listen(void)
+{
+    if (listen_pid == NULL)
+        return true;
+    for (int i = 0; i < nlisten; i++)
+        if unlikely (dup2(listen_fds[i], 3 + i) == -1)
+            return false;
+
+    char digits[16];
+    int len = 0;
+    for (pid_t pid = getpid(); pid != 0 || len == 0; pid /= 10)
+        digits[len++] = (char)('0' + pid % 10);
+    for (int i = 0; i < len; i++)
+        listen_pid[i] = digits[len - 1 - i];
+    listen_pid[len] = '\0';
+    return true;
+}
+
+// Start the daemon in the background, returning its PID once it has been executed or -1 if it couldn't be
+static pid_t spawn(char *cmd_argv[], bool new_session)
+{
+    pid_t daemon = vfork();
+    if (daemon == 0) {
+        if (new_session)
+            setsid();
+        if unlikely (!pass_listen()) {
+            spawn_errno = errno;
+            _exit(127);
+        }
+
+        // dup2(2) clears FD_CLOEXEC, except when the pipe already has the descriptor the daemon expects
+        if (ready_fd != -1
+            && (ready_pipe[1] == ready_fd ? fcntl(ready_fd, F_SETFD, 0) : dup2(ready_pipe[1], ready_fd)) == -1) {
+            spawn_errno = errno;
+            _exit(127);
+        }
+        if likely (drop_creds())
+            execvp(cmd_argv[0], cmd_argv);
+        spawn_errno = errno;
+        _exit(127);
+    } else if unlikely (daemon == -1)
+        return -1;
+    else if unlikely (spawn_errno != 0) {
+        waitpid(daemon, NULL, 0);
+        errno = spawn_errno;
+        return -1;
+    }
+    return daemon;
+}
+
+// Wake up wait_ready() when the daemon exits
+static void sigchld(int signum)
+{
+    (void)signum;
+    int saved = errno;
+    write(chld_pipe[1], "", 1);
+    errno = saved;
+}
+
+// Create the pipe or socket the daemon announces it's ready through, before the daemon is started
+static bool setup_ready(const char *notify)
+{
+    if (ready_fd != -1) {
+        if (pipe2(ready_pipe, O_CLOEXEC) != 0)
+            return false;
+
+        // Keep the pipe clear of the descriptors the listening sockets are numbered as
+        int high = fcntl(ready_pipe[1], F_DUPFD_CLOEXEC, 3 + LISTEN_MAX);
+        close(ready_pipe[1]);
+        if ((ready_pipe[1] = high) == -1)
+            return false;
+    }
+    if (notify != NULL) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if unlikely (strlen(notify) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        strcpy(addr.sun_path, notify);
+        unlink(notify);
+        notify_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if unlikely (notify_sock == -1 || bind(notify_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+            return false;
+
+        // Daemons that drop their privileges have to be able to send to it
+        if (creds.set)
+            chown(notify, creds.uid, creds.gid);
+        setenv("NOTIFY_SOCKET", notify, 1);
+    }
+
+    // The daemon exiting before it is ready is noticed through a self-pipe
+    if (pipe2(chld_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+        return false;
+    struct sigaction action = { .sa_handler = sigchld, .sa_flags = SA_NOCLDSTOP };
+    return sigaction(SIGCHLD, &action, NULL) == 0;
+}
+
+// Return true if a datagram sent to the notify socket has a READY=1 line
+static bool read_notify(void)
+{
+    char msg[4096];
+    ssize_t len = recv(notify_sock, msg, sizeof(msg) - 1, MSG_DONTWAIT);
+    if (len <= 0)
+        return false;
+    msg[len] = '\0';
+    for (char *line = strtok(msg, "\n"); line != NULL; line = strtok(NULL, "\n"))
+        if (strcmp(line, "READY=1") == 0)
+            return true;
+    return false;
+}
+
+/* Wait until the daemon is ready, returning false if it exits with an error, closes the pipe or doesn't become
+   ready in time. Daemons that fork into the background exit successfully, so only their child is waited for. */
+static bool wait_ready(pid_t *daemon, int timeout)
+{
+    struct pollfd fds[2] = { { .fd = ready_fd != -1 ? ready_pipe[0] : notify_sock, .events = POLLIN },
+                             { .fd = chld_pipe[0], .events = POLLIN } };
+    struct timespec now, end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout;
+    for (;;) {
+        // The daemon exited before it was ready
+        int status;
+        if (*daemon != -1 && waitpid(*daemon, &status, WNOHANG) == *daemon) {
+            *daemon = -1;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                errno = ECHILD;
+                return false;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+        if unlikely (left <= 0) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+        if (poll(fds, 2, (int)left) == -1 && errno != EINTR)
+            return false;
+        if (fds[1].revents & POLLIN) {
+            char buf[16];
+            while (read(chld_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+
+        // Any byte written to the pipe means the daemon is ready, while EOF means it closed the pipe without being so
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            if (notify_sock != -1) {
+                if (read_notify())
+                    return true;
+                continue;
+            }
+            char byte;
+            ssize_t len = read(ready_pipe[0], &byte, 1);
+            if (len == 1)
+                return true;
+            else if (len == 0) {
+                errno = EPIPE;
+                return false;
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // Long options struct
+    struct option long_options[] = { { "pidfile", required_argument, NULL, 'p' },
+                                     { "append", no_argument, NULL, 'a' },
+                                     { "setsid", no_argument, NULL, 's' },
+                                     { "user", required_argument, NULL, 'u' },
+                                     { "group", required_argument, NULL, 'g' },
+                                     { "umask", required_argument, NULL, 'm' },
+                                     { "chdir", required_argument, NULL, 'd' },
+                                     { "env", required_argument, NULL, 'e' },
+                                     { "limit", required_argument, NULL, 'l' },
+                                     { "command", required_argument, NULL, 'c' },
+                                     { "exec", no_argument, NULL, 'x' },
+                                     { "ready-fd", required_argument, NULL, 'r' },
+                                     { "notify", required_argument, NULL, 'n' },
+                                     { "timeout", required_argument, NULL, 't' },
+                                     { "listen", required_argument, NULL, 'L' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+    // Parse the given options, stopping at the command; limits and environment files are applied right away
+    const char *pidfile = NULL, *user = NULL, *group = NULL, *dir = NULL, *notify = NULL;
+    char *command = NULL, *listen = NULL;
+    bool append = false, new_session = false, in_place = false;
+    int timeout = READY_TIMEOUT;
+    int args;
+    while ((args = getopt_long(argc, argv, "+p:asu:g:m:d:e:l:c:xr:n:t:L:?", long_options, NULL)) != -1) {
+        switch (args) {
+            case 'p':
+                pidfile = optarg;
+                break;
+            case 'a':
+                append = true;
+                break;
+            case 's':
+                new_session = true;
+                break;
+            case 'u':
+                user = optarg;
+                break;
+            case 'g':
+                group = optarg;
+                break;
+            case 'm': {
+                char *end;
+                unsigned long mask = strtoul(optarg, &end, 8);
+                if unlikely (end == optarg || *end != '\0' || mask > 0777)
+                    usage();
+                umask((mode_t)mask);
+                break;
+            }
+            case 'd':
+                dir = optarg;
+                break;
+            case 'e':
+                if unlikely (!read_env(optarg)) {
+                    printf(RED "* Failed to read the environment file %s: %s" RESET "\n", optarg, strerror(errno));
+                    return 1;
+                }
+                break;
+            case 'l':
+                if unlikely (!set_limit(optarg)) {
+                    printf(RED "* Invalid resource limit or failed to set it: %s" RESET "\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                command = optarg;
+                break;
+            case 'x':
+                in_place = true;
+                break;
+            case 'r':
+                ready_fd = atoi(optarg);
+                if unlikely (ready_fd <= STDERR_FILENO)
+                    usage();
+                break;
+            case 'n':
+                notify = optarg;
+                break;
+            case 't':
+                timeout = atoi(optarg);
+                if unlikely (timeout <= 0)
+                    usage();
+                break;
+            case 'L':
+                listen = optarg;
+                break;
+            case '?':
+                usage();
+                __builtin_unreachable();
+        }
+    }
+
+    // Split the command given with -c once, leaving commands that need a shell to sh(1)
+    static char *words[MAX_WORDS];
+    char **cmd_argv = argv + optind;
+    if (command != NULL) {
+        char *copy = strdup(command);
+        if unlikely (copy == NULL || split_command(copy, words, MAX_WORDS) == -1) {
+            words[0] = "/bin/sh";
+            words[1] = "-c";
+            words[2] = command;
+            words[3] = NULL;
+        }
+        cmd_argv = words;
+    }
+    bool wait = ready_fd != -1 || notify != NULL;
+    if unlikely (cmd_argv[0] == NULL || (in_place && wait) || (ready_fd != -1 && notify != NULL))
+        usage();
+
+    // Everything that can fail is done before the daemon is started
+    if unlikely (!resolve_creds(user, group)) {
+        printf(RED "* Unknown user or group: %s" RESET "\n", user != NULL ? user : group);
+        return 1;
+    } else if unlikely (dir != NULL && chdir(dir) != 0) {
+        printf(RED "* Failed to change to %s: %s" RESET "\n", dir, strerror(errno));
+        return 1;
+    } else if unlikely (listen != NULL && !setup_listen(listen)) {
+        return 1;
+    } else if unlikely (ready_fd != -1 && ready_fd < 3 + nlisten) {
+        printf(RED "* File descriptor %d is taken by the listening sockets" RESET "\n", ready_fd);
+        return 1;
+    }
+
+    // Become the daemon, recording this process as it while still able to write the pidfile
+    if (in_place) {
+        if unlikely (pidfile != NULL && !write_pidfile(pidfile, getpid(), append)) {
+            printf(RED "* Failed to write %s: %s" RESET "\n", pidfile, strerror(errno));
+            return 1;
+        }
+        if (new_session)
+            setsid();
+        if unlikely (!pass_listen() || !drop_creds()) {
+            perror(RED "* Failed to drop privileges" RESET);
+            return 1;
+        }
+        execvp(cmd_argv[0], cmd_argv);
+        printf(RED "* Failed to execute %s: %s" RESET "\n", cmd_argv[0], strerror(errno));
+        return 127;
+    }
+
+    // Start the daemon in the background
+    if unlikely (wait && !setup_ready(notify)) {
+        printf(RED "* Failed to set up readiness notification: %s" RESET "\n", strerror(errno));
+        return 1;
+    }
+    pid_t daemon = spawn(cmd_argv, new_session);
+    if unlikely (daemon == -1) {
+        printf(RED "* Failed to execute %s: %s" RESET "\n", cmd_argv[0], strerror(errno));
+        return 127;
+    }
+
+    // Record the daemon's PID
+    if (pidfile != NULL && !write_pidfile(pidfile, daemon, append)) {
+        printf(RED "* Failed to write %s: %s" RESET "\n", pidfile, strerror(errno));
+        return 1;
+    }
+    if (!wait)
+        return 0;
+
+    // Return once the daemon is ready, stopping it if it never becomes so
+    if (ready_fd != -1)
+        close(ready_pipe[1]);
+    bool ready = wait_ready(&daemon, timeout);
+    if (notify != NULL)
+        unlink(notify);
+    if unlikely (!ready) {
+        const char *why = errno == ETIMEDOUT ? "timed out"
+                          : errno == EPIPE   ? "it closed the pipe"
+                          : errno == ECHILD  ? "it exited"
+                                             : strerror(errno);
+        printf(RED "* %s did not become ready: %s" RESET "\n", cmd_argv[0], why);
+        if (daemon != -1)
+            kill(daemon, SIGTERM);
+        return 2;
+    }
+    return 0;
+}
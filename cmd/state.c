@@ -0,0 +1,384 @@
+/*
+ * Copyright © 2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * leaninit-state -- Record and show the state of services
+ *
+ * rc.svc(8) calls leaninit-state whenever the state of a service changes, which
+ * updates the service's entry in the table at STATE_PATH (see leaninit.h). The
+ * table is read with mmap(2), so the states of all services can be shown
+ * without running any of their scripts.
+ */
+
+#include <leaninit.h>
+
+// A row of the table printed by show()
+struct row {
+    char name[NAME_MAX + 1]; // The service's $NAME
+    bool enabled;
+    struct state_entry entry;
+    int procs;          // Processes in the service's cgroup, or -1 when it has none
+    long long memory;   // Memory used by the cgroup in bytes, or -1 when the memory controller isn't enabled
+    long long cpu_usec; // CPU time used by the cgroup
+};
+
+#if defined(__linux__)
+// Return the directory holding the cgroups of services when the unified (v2) cgroup hierarchy is mounted
+static const char *cgroup_dir(void)
+{
+    if (access("/sys/fs/cgroup/unified/cgroup.controllers", F_OK) == 0)
+        return "/sys/fs/cgroup/unified/leaninit";
+    else if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0)
+        return "/sys/fs/cgroup/leaninit";
+    return NULL;
+}
+
+// Read the number of processes, memory usage and CPU time of a service from its cgroup
+static void read_cgroup(const char *dir, const char *service, struct row *row)
+{
+    char path[PATH_MAX], line[64];
+    snprintf(path, sizeof(path), "%s/%s/cgroup.procs", dir, service);
+    FILE *file = fopen(path, "re");
+    if (file == NULL)
+        return;
+    row->procs = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+        row->procs++;
+    fclose(file);
+
+    snprintf(path, sizeof(path), "%s/%s/memory.current", dir, service);
+    if ((file = fopen(path, "re")) != NULL) {
+        if (fscanf(file, "%lld", &row->memory) != 1)
+            row->memory = -1;
+        fclose(file);
+    }
+    snprintf(path, sizeof(path), "%s/%s/cpu.stat", dir, service);
+    if ((file = fopen(path, "re")) != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL)
+            if (sscanf(line, "usage_usec %lld", &row->cpu_usec) == 1)
+                break;
+        fclose(file);
+    }
+}
+#endif
+
+// Show usage information
+static cold noreturn void usage(void)
+{
+    printf("Usage: %s [-a] [service]...\n"
+           "    or %s -s service state [-t type]\n"
+           "  -a, --all     Show every service in " SVC_DIR " (default)\n"
+           "  -s, --set     Record the state of a service (Started, Restarted, Reloaded, Paused, Continued,\n"
+           "                Failure, Listening or Stopped), along with the processes in its .pid file\n"
+           "  -t, --type    The type the service provides\n"
+           "  -?, --help    Show this usage information\n",
+           __progname, __progname);
+    exit(1);
+}
+
+// Read the processes in the service's .pid file into its entry
+static void read_pids(const char *service, struct state_entry *entry)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/var/run/leaninit/%s.pid", service);
+    FILE *pids = fopen(path, "r");
+    if (pids == NULL)
+        return;
+    while (entry->npids < STATE_PIDS && fscanf(pids, "%d", &entry->pids[entry->npids]) == 1)
+        entry->npids++;
+    fclose(pids);
+}
+
+// Update the entry of a service under the table's lock
+static int set_state(const char *service, const char *text, const char *type)
+{
+    uint8_t state = SVC_STOPPED;
+    if (strcmp(text, "Stopped") != 0) {
+        for (state = SVC_STARTED; state < SVC_STATES && strcmp(text, state_names[state]) != 0; state++)
+            ;
+        if unlikely (state == SVC_STATES) {
+            printf(RED "* Unknown state: %s" RESET "\n", text);
+            return 1;
+        }
+    }
+    if unlikely (strlen(service) >= sizeof(((struct state_entry *)NULL)->name)
+                 || (type != NULL && strlen(type) >= sizeof(((struct state_entry *)NULL)->type))) {
+        printf(RED "* The name of %s is too long for " STATE_PATH RESET "\n", service);
+        return 1;
+    }
+
+    int fd;
+    struct state_table *table = state_open(true, &fd);
+    if unlikely (table == NULL) {
+        printf(RED "* Could not open " STATE_PATH ": %s" RESET "\n", strerror(errno));
+        return 1;
+    }
+    struct state_entry *entry = state_find(table, service);
+    if unlikely (entry == NULL) {
+        printf(RED "* " STATE_PATH " is full" RESET "\n");
+        return 1;
+    }
+
+    // Fill in a copy first, so that the entry is only inconsistent for as long as the copy takes
+    struct state_entry next = *entry;
+    time_t now = time(NULL);
+    memcpy(next.name, service, strlen(service) + 1);
+    next.state = state;
+    next.changed = now;
+    if (state == SVC_STARTED || state == SVC_RESTARTED)
+        next.started = now;
+    if (state == SVC_RESTARTED)
+        next.restarts++;
+    next.npids = 0;
+    memset(next.pids, 0, sizeof(next.pids));
+    memset(next.type, 0, sizeof(next.type));
+    if (state != SVC_STOPPED && state != SVC_FAILED) {
+        read_pids(service, &next);
+        if (type != NULL)
+            memcpy(next.type, type, strlen(type) + 1);
+    }
+
+    uint32_t seq = entry->seq | 1; // Also recovers from a writer that died halfway through
+    __atomic_store_n(&entry->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)entry + sizeof(entry->seq), (char *)&next + sizeof(next.seq), sizeof(next) - sizeof(next.seq));
+    __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELEASE);
+
+    munmap(table, sizeof(*table));
+    close(fd);
+    return 0;
+}
+
+// Read the $NAME of a service from its script, falling back to the name of the script
+static void read_name(const char *service, char *name, size_t size)
+{
+    snprintf(name, size, "%s", service);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), SVC_DIR "/%s", service);
+    FILE *script = fopen(path, "r");
+    if unlikely (script == NULL)
+        return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), script) != NULL) {
+        char *text = line + strspn(line, " \t");
+        if (strncmp(text, "NAME=", 5) != 0)
+            continue;
+        text += 5;
+        text[strcspn(text, "\n")] = 0;
+        size_t len = strlen(text);
+        if (len >= 2 && (text[0] == '"' || text[0] == '\'') && text[len - 1] == text[0]) {
+            text[len - 1] = 0;
+            text++;
+        }
+        snprintf(name, size, "%s", text);
+        break;
+    }
+    fclose(script);
+}
+
+// Fall back to the .status file of a service when the table doesn't exist
+static void read_status_file(const char *service, struct state_entry *entry)
+{
+    char path[PATH_MAX], text[32] = "";
+    snprintf(path, sizeof(path), "/var/run/leaninit/%s.status", service);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    ssize_t len = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    text[len > 0 ? len : 0] = 0;
+    text[strcspn(text, "\n")] = 0;
+    for (uint8_t state = SVC_STARTED; state < SVC_STATES; state++)
+        if (strcmp(text, state_names[state]) == 0)
+            entry->state = state;
+    read_pids(service, entry);
+}
+
+// Order rows by $NAME
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(((const struct row *)a)->name, ((const struct row *)b)->name);
+}
+
+// Format how long ago a time was
+static void format_age(int64_t then, char *out, size_t size)
+{
+    long long age = (long long)(time(NULL) - then);
+    if (age < 0)
+        age = 0;
+    if (age >= 86400)
+        snprintf(out, size, "%lldd %lldh", age / 86400, age % 86400 / 3600);
+    else if (age >= 3600)
+        snprintf(out, size, "%lldh %lldm", age / 3600, age % 3600 / 60);
+    else if (age >= 60)
+        snprintf(out, size, "%lldm %llds", age / 60, age % 60);
+    else
+        snprintf(out, size, "%llds", age);
+}
+
+// Print the state of the given services, or of every service in SVC_DIR when there are none
+static int show(char *services[], int count)
+{
+    struct row *rows = NULL;
+    size_t nrows = 0;
+    DIR *dir = NULL;
+    if (count == 0 && (dir = opendir(SVC_DIR)) == NULL) {
+        printf(RED "* Could not open " SVC_DIR ": %s" RESET "\n", strerror(errno));
+        return 1;
+    }
+    struct state_table *table = state_open(false, NULL);
+#if defined(__linux__)
+    const char *cgroups = cgroup_dir();
+#endif
+    bool usage = false;
+
+    // Collect a row for each service
+    struct dirent *ent;
+    int i = 0;
+    while (true) {
+        const char *service;
+        if (dir != NULL) {
+            if ((ent = readdir(dir)) == NULL)
+                break;
+            else if (ent->d_name[0] == '.')
+                continue;
+            service = ent->d_name;
+        } else if (i < count)
+            service = services[i++];
+        else
+            break;
+
+        struct row *grown = realloc(rows, (nrows + 1) * sizeof(struct row));
+        if unlikely (grown == NULL) {
+            printf(RED "* Memory allocation failed" RESET "\n");
+            return 1;
+        }
+        rows = grown;
+        struct row *row = &rows[nrows++];
+        memset(row, 0, sizeof(*row));
+        row->procs = -1;
+        row->memory = -1;
+#if defined(__linux__)
+        if (cgroups != NULL)
+            read_cgroup(cgroups, service, row);
+#endif
+        usage = usage || row->procs != -1;
+        read_name(service, row->name, sizeof(row->name));
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), ENABLED_DIR "/%s", service);
+        row->enabled = access(path, F_OK) == 0;
+        if (table == NULL || !state_read(table, service, &row->entry)) {
+            memset(&row->entry, 0, sizeof(row->entry));
+            if (table == NULL)
+                read_status_file(service, &row->entry);
+        }
+    }
+    if (dir != NULL)
+        closedir(dir);
+    qsort(rows, nrows, sizeof(struct row), by_name);
+
+    // Line up the columns
+    int name_width = 4, state_width = 5, pids_width = 4;
+    char (*pids)[STATE_PIDS * 12] = calloc(nrows ? nrows : 1, sizeof(*pids));
+    if unlikely (pids == NULL)
+        return 1;
+    for (size_t r = 0; r < nrows; r++) {
+        int len = (int)strlen(rows[r].name);
+        name_width = len > name_width ? len : name_width;
+        len = (int)strlen(state_names[rows[r].entry.state]);
+        state_width = len > state_width ? len : state_width;
+        size_t used = 0;
+        for (uint8_t p = 0; p < rows[r].entry.npids; p++)
+            used += (size_t)snprintf(pids[r] + used, sizeof(pids[r]) - used, p ? " %d" : "%d", rows[r].entry.pids[p]);
+        len = (int)used;
+        pids_width = len > pids_width ? len : pids_width;
+    }
+
+    printf(WHITE "%-*s | %-8s | %-*s | %-*s | %-7s | Restarts%s" RESET "\n", name_width, "Name", "Enabled", state_width,
+           "State", pids_width, "PIDs", "Up", usage ? " | Procs | Memory    | CPU" : "");
+    for (size_t r = 0; r < nrows; r++) {
+        const struct state_entry *entry = &rows[r].entry;
+        char up[32] = "";
+        if (entry->state != SVC_STOPPED && entry->state != SVC_FAILED && entry->state != SVC_LISTENING
+            && entry->started != 0)
+            format_age(entry->started, up, sizeof(up));
+        const char *color = entry->state == SVC_FAILED ? RED : entry->state == SVC_STOPPED ? RESET : GREEN;
+        printf("%-*s | %-8s | %s%-*s" RESET " | %-*s | %-7s | ", name_width, rows[r].name,
+               rows[r].enabled ? "Enabled" : "Disabled", color, state_width, state_names[entry->state], pids_width,
+               pids[r], up);
+        if (!usage) {
+            printf("%u\n", entry->restarts);
+            continue;
+        }
+
+        // Show the usage of the service's cgroup
+        char procs[12] = "", memory[24] = "", cpu[24] = "";
+        if (rows[r].procs != -1) {
+            snprintf(procs, sizeof(procs), "%d", rows[r].procs);
+            snprintf(cpu, sizeof(cpu), "%lld.%llds", rows[r].cpu_usec / 1000000, rows[r].cpu_usec / 100000 % 10);
+        }
+        if (rows[r].memory != -1)
+            snprintf(memory, sizeof(memory), "%lld MiB", rows[r].memory / 1048576);
+        printf("%-8u | %-5s | %-9s | %s\n", entry->restarts, procs, memory, cpu);
+    }
+
+    free(pids);
+    free(rows);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // Long options
+    struct option long_options[] = { { "all", no_argument, NULL, 'a' },
+                                     { "set", no_argument, NULL, 's' },
+                                     { "type", required_argument, NULL, 't' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+    // Parse options
+    bool set = false;
+    const char *type = NULL;
+    int args;
+    while ((args = getopt_long(argc, argv, "ast:?", long_options, NULL)) != -1)
+        switch (args) {
+            case 'a':
+                break;
+            case 's':
+                set = true;
+                break;
+            case 't':
+                type = optarg;
+                break;
+            default:
+                usage();
+                __builtin_unreachable();
+        }
+
+    if (set) {
+        if unlikely (argc - optind != 2)
+            usage();
+        return set_state(argv[optind], argv[optind + 1], type);
+    }
+    return show(argv + optind, argc - optind);
+}
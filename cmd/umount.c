@@ -0,0 +1,350 @@
+/*
+ * Copyright © 2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * leaninit-umount -- Flush and unmount every file system at shutdown
+ *
+ * The mount tree is read from /proc/self/mountinfo. Every file system is flushed with syncfs(2) in a
+ * process of its own, so independent file systems are written back in parallel, then each mount is
+ * unmounted as soon as it has been flushed and everything mounted below it is gone, so all the leaves
+ * of the tree are unmounted at once. A mount that can't be unmounted because it is busy is remounted
+ * read-only, and one that is still being flushed or unmounted after the timeout (a stuck NFS or FUSE
+ * server) is detached lazily instead of holding up the rest of the shutdown.
+ */
+
+#include <leaninit.h>
+
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+#define UMOUNT_TIMEOUT 10 // Default seconds a file system gets to be flushed, then again to be unmounted
+
+// States of a mount
+#define MT_KEPT       0 // Never unmounted, the pseudo file systems rc.shutdown(8) and init(8) rely on
+#define MT_FLUSHING   1 // Being flushed with syncfs(2)
+#define MT_FLUSHED    2 // Waiting for the mounts below it to be unmounted
+#define MT_UNMOUNTING 3
+#define MT_REMOUNTING 4 // Being remounted read-only, since something below it has to stay mounted
+#define MT_DONE       5
+
+// Exit statuses of the process unmounting a file system
+#define UNMOUNTED 0
+#define FAILED    1
+#define REMOUNTED 2
+
+#if defined(__linux__)
+// File systems that are left mounted (the same ones `umount -a` used to be told to skip)
+static const char *const kept_types[] = { "devtmpfs", "tmpfs", "proc", "sysfs", NULL };
+
+// File systems that are only kept in memory, which have nothing to flush
+static const char *const memory_types[] = { "autofs",      "binfmt_misc", "bpf",         "cgroup",      "cgroup2",
+                                            "configfs",    "debugfs",     "devpts",      "devtmpfs",    "efivarfs",
+                                            "fusectl",     "hugetlbfs",   "mqueue",      "nsfs",        "proc",
+                                            "pstore",      "ramfs",       "rpc_pipefs",  "securityfs",  "sysfs",
+                                            "tmpfs",       "tracefs",     NULL };
+
+struct mount {
+    char *path;
+    char type[32];
+    int id, parent_id;
+    unsigned int major, minor;
+    bool bind;       // Only part of the file system is mounted, so remounting it read-only must not touch the rest
+    ssize_t parent;  // Index of the mount it is mounted on, or -1
+    size_t children; // Mounts below it that are still mounted
+    uint8_t state;
+    pid_t pid;          // The process flushing, unmounting or remounting it
+    long long deadline; // When that process is given up on
+};
+
+static struct mount *mounts = NULL;
+static size_t nmounts = 0;
+static bool verbose = true, sync_only = false;
+static unsigned int timeout = UMOUNT_TIMEOUT;
+static size_t unmounted = 0, remounted = 0, detached = 0, failed = 0;
+#endif
+
+// Show usage information
+static cold noreturn void usage(void)
+{
+    printf("Usage: %s [-s?] [-t seconds] [silent|verbose]\n"
+           "  -s, --sync     Only flush the file systems, leaving them mounted\n"
+           "  -t, --timeout  Seconds each file system gets to be flushed and unmounted (default %d)\n"
+           "  -?, --help     Show this usage information\n",
+           __progname, UMOUNT_TIMEOUT);
+    exit(1);
+}
+
+#if defined(__linux__)
+static long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static bool listed(const char *const *list, const char *name)
+{
+    for (; *list != NULL; list++)
+        if (strcmp(*list, name) == 0)
+            return true;
+    return false;
+}
+
+// Decode the octal escapes (\040 for a space and so on) mountinfo uses in paths, in place
+static void unescape(char *path)
+{
+    char *out = path;
+    for (char *in = path; *in; out++)
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7' && in[3] >= '0'
+            && in[3] <= '7') {
+            *out = (char)(((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+            in += 4;
+        } else
+            *out = *in++;
+    *out = 0;
+}
+
+// Read the mount tree, linking every mount to the one it is mounted on
+static bool read_mounts(void)
+{
+    FILE *mountinfo = fopen(MOUNTINFO_PATH, "re");
+    if unlikely (mountinfo == NULL) {
+        perror(RED "* Could not open " MOUNTINFO_PATH RESET);
+        return false;
+    }
+
+    char *line = NULL, root[PATH_MAX], path[PATH_MAX];
+    size_t size = 0;
+    while (getline(&line, &size, mountinfo) != -1) {
+        struct mount mnt = { .parent = -1 };
+        char *fields = strstr(line, " - ");
+        if unlikely (fields == NULL
+                     || sscanf(line, "%d %d %u:%u %4095s %4095s", &mnt.id, &mnt.parent_id, &mnt.major,
+                               &mnt.minor, root, path)
+                            != 6
+                     || sscanf(fields, " - %31s", mnt.type) != 1)
+            continue;
+        unescape(path);
+        mnt.bind = strcmp(root, "/") != 0;
+        mnt.path = strdup(path);
+        struct mount *grown = realloc(mounts, (nmounts + 1) * sizeof(struct mount));
+        if unlikely (mnt.path == NULL || grown == NULL) {
+            free(mnt.path);
+            mounts = grown != NULL ? grown : mounts;
+            break;
+        }
+        mounts = grown;
+        mounts[nmounts++] = mnt;
+    }
+    free(line);
+    fclose(mountinfo);
+
+    for (size_t i = 0; i < nmounts; i++)
+        for (size_t p = 0; p < nmounts; p++)
+            if (p != i && mounts[p].id == mounts[i].parent_id) {
+                mounts[i].parent = (ssize_t)p;
+                mounts[p].children++;
+                break;
+            }
+    return nmounts != 0;
+}
+
+// Check whether a process is flushing, unmounting or remounting a mount
+static bool busy(const struct mount *mnt)
+{
+    return mnt->state == MT_FLUSHING || mnt->state == MT_UNMOUNTING || mnt->state == MT_REMOUNTING;
+}
+
+// Flush, unmount or remount a file system in a process of its own, so a stuck one can be given up on
+static void start(struct mount *mnt, uint8_t state)
+{
+    mnt->state = state;
+    mnt->deadline = now_ms() + timeout * 1000LL;
+    mnt->pid = fork();
+    if (mnt->pid == 0) {
+        if (state == MT_FLUSHING) {
+            int fd = open(mnt->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            _exit(fd != -1 && syncfs(fd) == 0 ? UNMOUNTED : FAILED);
+        }
+        if (state == MT_UNMOUNTING && umount2(mnt->path, UMOUNT_NOFOLLOW) == 0)
+            _exit(UNMOUNTED);
+        unsigned long flags = MS_REMOUNT | MS_RDONLY | (mnt->bind ? MS_BIND : 0);
+        _exit(mount(NULL, mnt->path, NULL, flags, NULL) == 0 ? REMOUNTED : FAILED);
+    } else if unlikely (mnt->pid == -1) {
+        mnt->pid = 0;
+        mnt->deadline = 0; // Handled as if it timed out
+    }
+}
+
+// Record what became of a mount once its process exited (status -1 when it was given up on)
+static void finish(struct mount *mnt, int status)
+{
+    uint8_t state = mnt->state;
+    mnt->pid = 0;
+    if (state == MT_FLUSHING && (status != -1 || sync_only || mnt->children != 0)) {
+        if unlikely (status == -1)
+            printf(RED "* %s was not flushed within %u seconds" RESET "\n", mnt->path, timeout);
+        mnt->state = MT_FLUSHED;
+        return;
+    }
+
+    mnt->state = MT_DONE;
+    if (mnt->parent != -1)
+        mounts[mnt->parent].children--;
+    if (status == UNMOUNTED)
+        unmounted++;
+    else if (status == REMOUNTED) {
+        remounted++;
+        if (state == MT_UNMOUNTING && verbose)
+            printf(CYAN "* " WHITE "%s is busy, so it was remounted read-only" RESET "\n", mnt->path);
+    } else if (status == -1 && state != MT_REMOUNTING) {
+        // Waiting on it again to unmount it would most likely get stuck just the same
+        printf(RED "* %s did not respond within %u seconds, detaching it lazily" RESET "\n", mnt->path, timeout);
+        umount2(mnt->path, MNT_DETACH | UMOUNT_NOFOLLOW);
+        detached++;
+    } else {
+        printf(RED "* %s could not be unmounted or remounted read-only" RESET "\n", mnt->path);
+        failed++;
+    }
+}
+
+// Start everything that is ready, returning the number of processes still running
+static size_t dispatch(void)
+{
+    size_t running = 0;
+    for (size_t i = 0; i < nmounts; i++) {
+        if (!sync_only && mounts[i].state == MT_FLUSHED && mounts[i].children == 0)
+            start(&mounts[i], MT_UNMOUNTING);
+        running += busy(&mounts[i]);
+    }
+    if (running != 0 || sync_only)
+        return running;
+
+    // Whatever is left has something kept mounted below it (like / and /dev), so remount it read-only
+    for (size_t i = 0; i < nmounts; i++)
+        if (mounts[i].state == MT_FLUSHED) {
+            start(&mounts[i], MT_REMOUNTING);
+            running++;
+        }
+    return running;
+}
+
+// Wait for the processes to exit until the nearest deadline, giving up on those that are past theirs
+static void wait_jobs(const sigset_t *sigchld)
+{
+    long long now = now_ms(), next = -1;
+    for (size_t i = 0; i < nmounts; i++)
+        if (busy(&mounts[i]) && (next == -1 || mounts[i].deadline < next))
+            next = mounts[i].deadline;
+    if (next > now) {
+        struct timespec wait = { .tv_sec = (next - now) / 1000, .tv_nsec = ((next - now) % 1000) * 1000000L };
+        sigtimedwait(sigchld, NULL, &wait);
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        for (size_t i = 0; i < nmounts; i++)
+            if (mounts[i].pid == pid) {
+                finish(&mounts[i], WIFEXITED(status) ? WEXITSTATUS(status) : FAILED);
+                break;
+            }
+
+    now = now_ms();
+    for (size_t i = 0; i < nmounts; i++)
+        if (busy(&mounts[i]) && mounts[i].deadline <= now)
+            finish(&mounts[i], -1);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    struct option long_options[] = { { "sync", no_argument, NULL, 's' },
+                                     { "timeout", required_argument, NULL, 't' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+#if !defined(__linux__)
+    bool sync_only = false;
+#endif
+    unsigned int seconds = UMOUNT_TIMEOUT;
+    int args;
+    while ((args = getopt_long(argc, argv, "st:?", long_options, NULL)) != -1)
+        switch (args) {
+            case 's':
+                sync_only = true;
+                break;
+            case 't':
+                seconds = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+                __builtin_unreachable();
+        }
+
+#if defined(__linux__)
+    timeout = seconds != 0 ? seconds : UMOUNT_TIMEOUT;
+    if (optind < argc && strcmp(argv[optind], "silent") == 0)
+        verbose = false;
+    if unlikely (getuid() != 0 && !sync_only) {
+        printf(RED "* Permission denied" RESET "\n");
+        return 1;
+    }
+    if unlikely (!read_mounts()) {
+        sync();
+        return 1;
+    }
+
+    // Flush each file system once (bind mounts share theirs), except those that only live in memory
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+    size_t flushing = 0;
+    for (size_t i = 0; i < nmounts; i++) {
+        bool shared = false;
+        for (size_t j = 0; j < i && !shared; j++)
+            shared = mounts[j].major == mounts[i].major && mounts[j].minor == mounts[i].minor;
+        mounts[i].state = listed(kept_types, mounts[i].type) && !sync_only ? MT_KEPT : MT_FLUSHED;
+        if (!shared && !listed(memory_types, mounts[i].type)) {
+            start(&mounts[i], MT_FLUSHING);
+            flushing++;
+        }
+    }
+    if (verbose)
+        printf(CYAN "* " WHITE "Flushing %zu file systems%s..." RESET "\n", flushing,
+               sync_only ? "" : " and unmounting the mount tree");
+
+    while (dispatch() != 0)
+        wait_jobs(&sigchld);
+
+    if (verbose && !sync_only)
+        printf(CYAN "* " WHITE "Unmounted %zu file systems (%zu remounted read-only, %zu detached lazily)" RESET "\n",
+               unmounted, remounted, detached);
+    return failed != 0 || detached != 0;
+#else
+    (void)seconds;
+    sync();
+    if (sync_only)
+        return 0;
+    printf(RED "* Unmounting the mount tree needs /proc/self/mountinfo, which is only available on Linux" RESET "\n");
+    return 1;
+#endif
+}
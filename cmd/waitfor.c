@@ -0,0 +1,289 @@
+/*
+ * Copyright © 2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * leaninit-waitfor -- Wait for a file to be created or processes to exit without polling
+ *
+ * The deepest existing directory on the path to the file is watched with
+ * inotify(7) on Linux and kqueue(2) on FreeBSD and NetBSD. Whenever it changes,
+ * the watch is moved further down the path until the file itself appears.
+ * Processes are waited on with pidfds on Linux and EVFILT_PROC elsewhere, and the
+ * processes of a cgroup by polling its cgroup.events until it reports "populated 0".
+ */
+
+#include <leaninit.h>
+
+// Show usage information
+static cold noreturn void usage(void)
+{
+    printf("Usage: %s [-t seconds] file\n"
+           "    or %s -p [-t seconds] pid...\n"
+#if defined(__linux__)
+           "    or %s -c [-t seconds] cgroup\n"
+           "  -c, --cgroup    Wait for every process in the given cgroup directory to exit instead of a file\n"
+#endif
+           "  -p, --pid       Wait for the given processes to exit instead of a file\n"
+           "  -t, --timeout   Give up after the given number of seconds (defaults to 7)\n"
+           "  -?, --help      Show this usage information\n",
+           __progname, __progname
+#if defined(__linux__)
+           , __progname
+#endif
+    );
+    exit(1);
+}
+
+// Return the number of milliseconds left until the deadline
+static int remaining(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+// Copy the deepest existing directory leading to the given file into dir
+static void nearest_dir(const char *file, char *dir)
+{
+    memcpy(dir, file, strlen(file) + 1);
+    while (true) {
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL) {
+            memcpy(dir, ".", 2);
+            return;
+        } else if (slash == dir) {
+            dir[1] = 0;
+            return;
+        }
+        *slash = 0;
+        if (access(dir, F_OK) == 0)
+            return;
+    }
+}
+
+#if defined(__linux__)
+// Check whether a process has exited, which only ESRCH means since kill(2) fails with EPERM for other users' processes
+static bool exited(pid_t pid)
+{
+    return kill(pid, 0) != 0 && errno == ESRCH;
+}
+#endif
+
+// Wait for every given process to exit, returning 0 if they all did before the deadline
+static int wait_for_pids(char *pids[], int count, const struct timespec *deadline)
+{
+    int left = 0;
+#if defined(__linux__)
+    struct pollfd *fds = calloc((size_t)count, sizeof(struct pollfd));
+    if unlikely (fds == NULL)
+        return 1;
+    for (int i = 0; i < count; i++)
+        fds[i] = (struct pollfd) { .fd = -1, .events = POLLIN, .revents = 0 };
+    for (int i = 0; i < count; i++) {
+        pid_t pid = (pid_t)strtol(pids[i], NULL, 10);
+        if unlikely (pid <= 0 || exited(pid))
+            continue;
+        fds[i].fd = (int)syscall(SYS_pidfd_open, pid, 0);
+        left++;
+
+        // Without pidfd_open(2) (Linux 5.3+), check the processes every tenth of a second
+        if unlikely (fds[i].fd == -1) {
+            while (!exited(pid)) {
+                int ms = remaining(deadline);
+                if (ms == 0)
+                    goto out;
+                struct timespec delay = { .tv_sec = 0, .tv_nsec = (ms < 100 ? ms : 100) * 1000000L };
+                nanosleep(&delay, NULL);
+            }
+            left--;
+        }
+    }
+
+    while (left != 0) {
+        int ms = remaining(deadline);
+        if (ms == 0)
+            break;
+        else if (poll(fds, (nfds_t)count, ms) <= 0)
+            continue;
+        for (int i = 0; i < count; i++)
+            if (fds[i].fd != -1 && fds[i].revents != 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                left--;
+            }
+    }
+
+out:
+    for (int i = 0; i < count; i++)
+        if (fds[i].fd != -1)
+            close(fds[i].fd);
+    free(fds);
+#else
+    int queue = kqueue();
+    if unlikely (queue == -1)
+        return 1;
+    for (int i = 0; i < count; i++) {
+        struct kevent change;
+        EV_SET(&change, (pid_t)strtol(pids[i], NULL, 10), EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+        if (kevent(queue, &change, 1, NULL, 0, NULL) == 0)
+            left++; // ESRCH means the process has already exited
+    }
+
+    while (left != 0) {
+        int ms = remaining(deadline);
+        if (ms == 0)
+            break;
+        struct kevent event;
+        struct timespec wait = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+        if (kevent(queue, NULL, 0, &event, 1, &wait) == 1)
+            left--;
+    }
+    close(queue);
+#endif
+    return left != 0;
+}
+
+#if defined(__linux__)
+// Wait for every process in a cgroup to exit, returning 0 if its cgroup.events reported "populated 0" in time
+static int wait_for_cgroup(const char *cgroup, const struct timespec *deadline)
+{
+    return !cgroup_wait(cgroup, remaining(deadline));
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    // Long options
+    struct option long_options[] = {
+#if defined(__linux__)
+        { "cgroup", no_argument, NULL, 'c' },
+#endif
+        { "pid", no_argument, NULL, 'p' },
+        { "timeout", required_argument, NULL, 't' },
+        { "help", no_argument, NULL, '?' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    // Parse options
+    double timeout = 7;
+    bool pids = false, cgroup = false;
+#if defined(__linux__)
+    const char *opts = "cpt:?";
+#else
+    const char *opts = "pt:?";
+#endif
+    int args;
+    while ((args = getopt_long(argc, argv, opts, long_options, NULL)) != -1)
+        switch (args) {
+#if defined(__linux__)
+            case 'c':
+                cgroup = true;
+                break;
+#endif
+            case 'p':
+                pids = true;
+                break;
+            case 't':
+                timeout = strtod(optarg, NULL);
+                break;
+            default:
+                usage();
+                __builtin_unreachable();
+        }
+    if unlikely (optind >= argc || strlen(argv[optind]) >= PATH_MAX) {
+        usage();
+        __builtin_unreachable();
+    }
+    const char *file = argv[optind];
+
+    // Calculate the deadline
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)timeout;
+    deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1000000000);
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    if (pids)
+        return wait_for_pids(argv + optind, argc - optind, &deadline);
+#if defined(__linux__)
+    else if (cgroup)
+        return wait_for_cgroup(file, &deadline);
+#else
+    (void)cgroup;
+#endif
+
+    char dir[PATH_MAX];
+#if defined(__linux__)
+    int notify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    int watch = -1;
+#else
+    int notify = kqueue();
+    int watch = -1;
+#endif
+
+    while (true) {
+        // Move the watch to the deepest existing directory before checking for the file to avoid missing it
+        nearest_dir(file, dir);
+#if defined(__linux__)
+        if (watch != -1)
+            inotify_rm_watch(notify, watch);
+        if likely (notify != -1)
+            watch = inotify_add_watch(notify, dir, IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+#else
+        if (watch != -1)
+            close(watch); // This also removes the kevent
+        watch = notify != -1 ? open(dir, O_RDONLY | O_CLOEXEC) : -1;
+        if (watch != -1) {
+            struct kevent change;
+            EV_SET(&change, watch, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+            kevent(notify, &change, 1, NULL, 0, NULL);
+        }
+#endif
+        if (access(file, F_OK) == 0)
+            return 0;
+
+        // Wait for the directory to change (or a tenth of a second when it can't be watched)
+        int ms = remaining(&deadline);
+        if (ms == 0)
+            return 1;
+        else if unlikely (watch == -1) {
+            struct timespec delay = { .tv_sec = 0, .tv_nsec = (ms < 100 ? ms : 100) * 1000000L };
+            nanosleep(&delay, NULL);
+            continue;
+        }
+#if defined(__linux__)
+        struct pollfd pfd = { .fd = notify, .events = POLLIN, .revents = 0 };
+        if (poll(&pfd, 1, ms) > 0) {
+            char events[4096];
+            while (read(notify, events, sizeof(events)) > 0)
+                ;
+        }
+#else
+        struct kevent event;
+        struct timespec wait = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+        kevent(notify, NULL, 0, &event, 1, &wait);
+#endif
+    }
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright © 2018-2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * bench -- Measure how long LeanInit takes to boot and shut down a synthetic system
+ *
+ * Every run builds a fresh synthetic root (see sandbox.h) and boots it with leaninit as PID 1 of
+ * a new PID namespace, then powers it off.
+ */
+
+#include <leaninit.h>
+#ifdef __linux__
+#include "sandbox.h"
+
+#define MAX_SAMPLES 256 // Maximum number of runs
+
+// Measurements taken during a single run, in milliseconds since leaninit was started
+struct sample {
+    double rc_exit;     // rc has finished
+    double first_getty; // The first getty has been spawned
+    double boot;        // Every service has started
+    double shutdown;    // Time from SIGUSR2 until the namespace's init has exited
+    long forks_boot;    // PIDs allocated before the first getty was spawned
+    long forks_total;   // PIDs allocated until the end of the run
+};
+static bool json = false;
+
+// Show usage information
+static cold noreturn void usage(void)
+{
+    printf("Usage: %s [-nflgrstoj?] ...\n"
+           "  -n, --services  Number of generated services (default 32)\n"
+           "  -f, --fanout    Number of earlier services each service needs (default 2)\n"
+           "  -l, --latency   Milliseconds each service takes to start (default 10)\n"
+           "  -g, --gettys    Number of fake gettys (default 2)\n"
+           "  -r, --runs      Number of runs (default 5, max %d)\n"
+           "  -s, --seed      Seed used to pick the dependencies of each service (default 1)\n"
+           "  -t, --timeout   Seconds to wait for a boot or shutdown to finish (default 60)\n"
+           "  -o, --out       Directory holding the LeanInit build (default ../out)\n"
+           "  -j, --json      Only output one JSON object per run and one for the summary\n"
+           "  -?, --help      Show this usage information\n",
+           __progname, MAX_SAMPLES);
+    exit(1);
+}
+
+// Boot and shut down the synthetic system once
+static bool run(unsigned int n, struct sample *sample)
+{
+    int master = build_root();
+    if (master == -1)
+        return false;
+
+    // Keep the FIFO open for writing as well, so a getty exiting never leaves a reader at EOF
+    int events = open(in_root(EVENTS), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if unlikely (events == -1) {
+        close(master);
+        return false;
+    }
+
+    // Start leaninit and wait for the system to boot
+    double start = now_ms();
+    pid_t init   = start_init();
+    if unlikely (init == -1) {
+        close(events);
+        close(master);
+        return false;
+    }
+    int status;
+    struct pollfd fds[1] = { { .fd = master, .events = POLLIN } };
+    bool ok = wait_for_boot(&init, master, events, start, &sample->first_getty, &sample->forks_boot, &sample->boot);
+    if (!ok)
+        fprintf(stderr, RED "* Run %u failed" RESET "\n", n);
+
+    // rc's end is recorded by the boot profiler on the same clock
+    struct profile_record *records = calloc(PROFILE_SLOTS, sizeof(struct profile_record));
+    size_t count = records != NULL
+                       ? read_ring(PROFILE_PATH, PROFILE_MAGIC, records, sizeof(*records), PROFILE_SLOTS)
+                       : 0;
+    sample->rc_exit = -1;
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].kind == PROF_END && strcmp(records[i].name, "rc") == 0) {
+            sample->rc_exit = (double)records[i].ns / 1000000.0 - start;
+            break;
+        }
+    }
+    free(records);
+
+    // Power off, which ends the PID namespace once every process has been stopped
+    if (init != -1) {
+        double halt = now_ms();
+        kill(init, SIGUSR2);
+        while (now_ms() - halt < timeout * 1000.0) {
+            poll(fds, 1, POLL_MS);
+            drain(master);
+            if (waitpid(init, &status, WNOHANG) == init) {
+                sample->shutdown = now_ms() - halt;
+                init             = -1;
+                break;
+            }
+        }
+        if unlikely (init != -1) {
+            fprintf(stderr, RED "* Run %u: timed out waiting for the system to shut down" RESET "\n", n);
+            kill(init, SIGKILL);
+            waitpid(init, &status, 0);
+            ok = false;
+        }
+    }
+
+    // Every process reaped by leaninit is recorded with its PID, so the highest one counts the forks
+    struct exit_record exits[EXITS_SLOTS];
+    count               = read_ring(EXITS_PATH, EXITS_MAGIC, exits, sizeof(exits[0]), EXITS_SLOTS);
+    sample->forks_total = sample->forks_boot;
+    for (size_t i = 0; i < count; i++)
+        if (exits[i].pid > sample->forks_total)
+            sample->forks_total = exits[i].pid;
+
+    close(events);
+    close(master);
+    return ok && sample->rc_exit >= 0;
+}
+
+// Sort samples by a single field
+static size_t field;
+static int by_field(const void *a, const void *b)
+{
+    double x = *(const double *)((const char *)a + field), y = *(const double *)((const char *)b + field);
+    return (x > y) - (x < y);
+}
+
+// Show the minimum, median and maximum of a field across all runs
+static void summarize(struct sample *samples, unsigned int runs, const char *name, size_t offset, bool last)
+{
+    field = offset;
+    qsort(samples, runs, sizeof(*samples), by_field);
+    double min = *(double *)((char *)&samples[0] + offset), max = *(double *)((char *)&samples[runs - 1] + offset);
+    double median = *(double *)((char *)&samples[runs / 2] + offset);
+    if (runs % 2 == 0)
+        median = (median + *(double *)((char *)&samples[runs / 2 - 1] + offset)) / 2;
+    if (json)
+        printf("\"%s\":{\"min\":%.3f,\"median\":%.3f,\"max\":%.3f}%s", name, min, median, max, last ? "}\n" : ",");
+    else
+        printf(CYAN "* " WHITE "%-12s %10.3f %10.3f %10.3f" RESET "\n", name, min, median, max);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+#ifndef __linux__
+    (void)argc;
+    (void)argv;
+    printf(RED "* bench requires Linux namespaces!" RESET "\n");
+    return 1;
+#else
+    // This program must be run as root
+    if very_unlikely (getuid() != 0) {
+        printf(RED "* Permission denied!" RESET "\n");
+        return 1;
+    }
+
+    // Long options struct
+    struct option long_options[] = { { "services", required_argument, NULL, 'n' },
+                                     { "fanout", required_argument, NULL, 'f' },
+                                     { "latency", required_argument, NULL, 'l' },
+                                     { "gettys", required_argument, NULL, 'g' },
+                                     { "runs", required_argument, NULL, 'r' },
+                                     { "seed", required_argument, NULL, 's' },
+                                     { "timeout", required_argument, NULL, 't' },
+                                     { "out", required_argument, NULL, 'o' },
+                                     { "json", no_argument, NULL, 'j' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+    // Parse the given options
+    unsigned int runs = 5;
+    int args;
+    while ((args = getopt_long(argc, argv, "n:f:l:g:r:s:t:o:j?", long_options, NULL)) != -1) {
+        switch (args) {
+            case 'n':
+                services = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                fanout = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                latency = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'g':
+                gettys = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                runs = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                timeout = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            case 'j':
+                json = true;
+                break;
+            case '?':
+                usage();
+                __builtin_unreachable();
+        }
+    }
+    if unlikely (runs == 0 || runs > MAX_SAMPLES || services == 0 || services > 999 || gettys == 0 || timeout == 0)
+        usage();
+
+    // Work in a private mount namespace so nothing leaks onto the host
+    if (!sandbox_create())
+        return 1;
+
+    // Boot the synthetic system the requested number of times
+    static struct sample samples[MAX_SAMPLES];
+    bool failed = false;
+    if (!json)
+        printf(CYAN "* " WHITE "Booting %u services (fan-out %u, %u ms each) and %u gettys %u times..." RESET "\n",
+               services, fanout, latency, gettys, runs);
+    for (unsigned int i = 0; i < runs; i++) {
+        struct sample *s = &samples[i];
+        if (!run(i + 1, s))
+            failed = true;
+        umount2(root, MNT_DETACH);
+        if (failed)
+            break;
+        if (json)
+            printf("{\"run\":%u,\"services\":%u,\"fanout\":%u,\"latency_ms\":%u,\"gettys\":%u,\"rc_exit_ms\":%.3f,"
+                   "\"first_getty_ms\":%.3f,\"boot_ms\":%.3f,\"shutdown_ms\":%.3f,\"forks_boot\":%ld,"
+                   "\"forks_total\":%ld}\n",
+                   i + 1, services, fanout, latency, gettys, s->rc_exit, s->first_getty, s->boot, s->shutdown,
+                   s->forks_boot, s->forks_total);
+        else
+            printf(CYAN "* " WHITE "Run %u: rc exited at %.1f ms, first getty at %.1f ms, booted at %.1f ms, "
+                        "shut down in %.1f ms, %ld/%ld forks" RESET "\n",
+                   i + 1, s->rc_exit, s->first_getty, s->boot, s->shutdown, s->forks_boot, s->forks_total);
+        fflush(stdout);
+    }
+    rmdir(root);
+    if (failed) {
+        printf(RED "* The benchmark failed!" RESET "\n");
+        return 1;
+    }
+
+    // Summary of every run; the fork counts are deterministic, so only the times are summarized
+    if (json)
+        printf("{\"summary\":true,\"runs\":%u,", runs);
+    else
+        printf(CYAN "* " WHITE "%-12s %10s %10s %10s" RESET "\n", "ms", "min", "median", "max");
+    summarize(samples, runs, "rc_exit", offsetof(struct sample, rc_exit), false);
+    summarize(samples, runs, "first_getty", offsetof(struct sample, first_getty), false);
+    summarize(samples, runs, "boot", offsetof(struct sample, boot), false);
+    summarize(samples, runs, "shutdown", offsetof(struct sample, shutdown), true);
+    return 0;
+#endif
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright © 2018-2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * footprint -- Check that a build of LeanInit stays within its size, startup time and memory budgets
+ *
+ * The build (out/leaninit-minimal by default, see `make minimal`) is installed as /sbin/leaninit in a
+ * synthetic root (see sandbox.h) and booted as PID 1 of a new PID namespace. The time until rc is
+ * executed comes from the boot profiler, and the resident set of PID 1 is read from /proc once every
+ * service has started and the system has settled. Any measurement over its budget fails the check.
+ */
+
+#include <leaninit.h>
+#ifdef __linux__
+#include "sandbox.h"
+
+#define MAX_RUNS  64
+#define SETTLE_MS 500 // Milliseconds the system gets to settle after booting before PID 1's memory is measured
+
+// Measurements taken during a single run
+struct sample {
+    double startup; // Milliseconds from starting leaninit until rc was executed
+    long rss;       // Resident set of PID 1 in KiB
+    long pages;     // Resident pages of PID 1
+    long private;   // Resident pages of PID 1 that aren't shared with anything else
+};
+
+// Budgets, where zero means no budget
+static long size_budget = 0, rss_budget = 0, pages_budget = 0;
+static double startup_budget = 0;
+
+// Show usage information
+static cold noreturn void usage(void)
+{
+    printf("Usage: %s [-inrtoSTRP?] ...\n"
+           "  -i, --init     Build of LeanInit to measure (default leaninit-minimal)\n"
+           "  -n, --services Number of generated services (default 8)\n"
+           "  -r, --runs     Number of runs (default 3, max %d)\n"
+           "  -t, --timeout  Seconds to wait for a boot or shutdown to finish (default 60)\n"
+           "  -o, --out      Directory holding the LeanInit build (default ../out)\n"
+           "  -S, --size     Budget for the size of the binary in KiB\n"
+           "  -T, --startup  Budget for the time until rc is executed in milliseconds (median of all runs)\n"
+           "  -R, --rss      Budget for the resident set of PID 1 in KiB (highest of all runs)\n"
+           "  -P, --pages    Budget for the number of resident pages of PID 1 (highest of all runs)\n"
+           "  -?, --help     Show this usage information\n",
+           __progname, MAX_RUNS);
+    exit(1);
+}
+
+// Read the resident pages of a process from /proc/PID/statm
+static bool read_statm(pid_t pid, struct sample *sample)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+    FILE *statm = fopen(path, "re");
+    if unlikely (statm == NULL)
+        return false;
+    long size, shared;
+    bool ok = fscanf(statm, "%ld %ld %ld", &size, &sample->pages, &shared) == 3;
+    fclose(statm);
+    sample->private = sample->pages - shared;
+    sample->rss = sample->pages * (sysconf(_SC_PAGESIZE) / 1024);
+    return ok;
+}
+
+// Boot the synthetic system, measure it once it has settled, then power it off
+static bool run(unsigned int n, struct sample *sample)
+{
+    int master = build_root();
+    if (master == -1)
+        return false;
+    int events = open(in_root(EVENTS), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if unlikely (events == -1) {
+        close(master);
+        return false;
+    }
+
+    double start = now_ms(), first_getty, booted;
+    long getty_pid;
+    pid_t init = start_init();
+    bool ok = init != -1 && wait_for_boot(&init, master, events, start, &first_getty, &getty_pid, &booted);
+
+    // Let everything started during boot finish, then take PID 1's resident set
+    struct pollfd fds[1] = { { .fd = master, .events = POLLIN } };
+    for (double settle = now_ms(); ok && now_ms() - settle < SETTLE_MS;) {
+        poll(fds, 1, POLL_MS);
+        drain(master);
+    }
+    ok = ok && read_statm(init, sample);
+
+    // rc being executed is recorded by the boot profiler on the same clock
+    struct profile_record *records = calloc(PROFILE_SLOTS, sizeof(struct profile_record));
+    size_t count = records != NULL
+                       ? read_ring(PROFILE_PATH, PROFILE_MAGIC, records, sizeof(*records), PROFILE_SLOTS)
+                       : 0;
+    sample->startup = -1;
+    for (size_t i = 0; i < count; i++)
+        if (records[i].kind == PROF_BEGIN && strcmp(records[i].name, "rc") == 0) {
+            sample->startup = (double)records[i].ns / 1000000.0 - start;
+            break;
+        }
+    free(records);
+
+    // Power off, which ends the PID namespace once every process has been stopped
+    if (init != -1) {
+        int status;
+        double halt = now_ms();
+        kill(init, SIGUSR2);
+        while (now_ms() - halt < timeout * 1000.0) {
+            poll(fds, 1, POLL_MS);
+            drain(master);
+            if (waitpid(init, &status, WNOHANG) == init) {
+                init = -1;
+                break;
+            }
+        }
+        if unlikely (init != -1) {
+            fprintf(stderr, RED "* Run %u: timed out waiting for the system to shut down" RESET "\n", n);
+            kill(init, SIGKILL);
+            waitpid(init, &status, 0);
+            ok = false;
+        }
+    }
+    if (!ok)
+        fprintf(stderr, RED "* Run %u failed" RESET "\n", n);
+    close(events);
+    close(master);
+    return ok && sample->startup >= 0;
+}
+
+static int by_startup(const void *a, const void *b)
+{
+    double x = ((const struct sample *)a)->startup, y = ((const struct sample *)b)->startup;
+    return (x > y) - (x < y);
+}
+
+// Print a measurement along with its budget, returning false if it is over budget
+static bool check(const char *name, double value, double budget, const char *unit)
+{
+    if (budget == 0) {
+        printf(CYAN "* " WHITE "%-8s %10.1f %-5s (no budget)" RESET "\n", name, value, unit);
+        return true;
+    } else if (value <= budget) {
+        printf(CYAN "* " WHITE "%-8s %10.1f %-5s (budget %.1f)" RESET "\n", name, value, unit, budget);
+        return true;
+    }
+    printf(RED "* %-8s %10.1f %-5s is over its budget of %.1f" RESET "\n", name, value, unit, budget);
+    return false;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+#ifndef __linux__
+    (void)argc;
+    (void)argv;
+    printf(RED "* footprint requires Linux namespaces!" RESET "\n");
+    return 1;
+#else
+    // This program must be run as root
+    if very_unlikely (getuid() != 0) {
+        printf(RED "* Permission denied!" RESET "\n");
+        return 1;
+    }
+
+    // Long options struct
+    struct option long_options[] = { { "init", required_argument, NULL, 'i' },
+                                     { "services", required_argument, NULL, 'n' },
+                                     { "runs", required_argument, NULL, 'r' },
+                                     { "timeout", required_argument, NULL, 't' },
+                                     { "out", required_argument, NULL, 'o' },
+                                     { "size", required_argument, NULL, 'S' },
+                                     { "startup", required_argument, NULL, 'T' },
+                                     { "rss", required_argument, NULL, 'R' },
+                                     { "pages", required_argument, NULL, 'P' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+    // Parse the given options
+    unsigned int runs = 3;
+    services = 8;
+    init_name = "leaninit-minimal";
+    int args;
+    while ((args = getopt_long(argc, argv, "i:n:r:t:o:S:T:R:P:?", long_options, NULL)) != -1) {
+        switch (args) {
+            case 'i':
+                init_name = optarg;
+                break;
+            case 'n':
+                services = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                runs = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                timeout = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            case 'S':
+                size_budget = strtol(optarg, NULL, 10);
+                break;
+            case 'T':
+                startup_budget = strtod(optarg, NULL);
+                break;
+            case 'R':
+                rss_budget = strtol(optarg, NULL, 10);
+                break;
+            case 'P':
+                pages_budget = strtol(optarg, NULL, 10);
+                break;
+            case '?':
+                usage();
+                __builtin_unreachable();
+        }
+    }
+    if unlikely (runs == 0 || runs > MAX_RUNS || services == 0 || services > 999 || timeout == 0)
+        usage();
+
+    // The size of the binary doesn't need a boot
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", outdir, init_name);
+    if unlikely (stat(path, &st) != 0) {
+        fprintf(stderr, RED "* Failed to find %s: %s (was it built?)" RESET "\n", path, strerror(errno));
+        return 1;
+    }
+
+    // Work in a private mount namespace so nothing leaks onto the host
+    if (!sandbox_create())
+        return 1;
+
+    // Boot the synthetic system the requested number of times
+    static struct sample samples[MAX_RUNS];
+    bool failed = false;
+    printf(CYAN "* " WHITE "Booting %s with %u services %u times..." RESET "\n", init_name, services, runs);
+    for (unsigned int i = 0; i < runs && !failed; i++) {
+        failed = !run(i + 1, &samples[i]);
+        umount2(root, MNT_DETACH);
+        fflush(stdout);
+    }
+    rmdir(root);
+    if (failed) {
+        printf(RED "* The footprint check failed!" RESET "\n");
+        return 1;
+    }
+
+    // Startup time is noisy, so its median is checked, along with the most memory PID 1 used in any run
+    long rss = 0, pages = 0, private = 0;
+    for (unsigned int i = 0; i < runs; i++) {
+        rss = samples[i].rss > rss ? samples[i].rss : rss;
+        pages = samples[i].pages > pages ? samples[i].pages : pages;
+        private = samples[i].private > private ? samples[i].private : private;
+    }
+    qsort(samples, runs, sizeof(*samples), by_startup);
+    double startup = samples[runs / 2].startup;
+    if (runs % 2 == 0)
+        startup = (startup + samples[runs / 2 - 1].startup) / 2;
+
+    bool ok = check("size", (double)st.st_size / 1024, (double)size_budget, "KiB");
+    ok &= check("startup", startup, startup_budget, "ms");
+    ok &= check("rss", (double)rss, (double)rss_budget, "KiB");
+    ok &= check("pages", (double)pages, (double)pages_budget, "pages");
+    printf(CYAN "* " WHITE "%ld of the %ld resident pages of PID 1 are private" RESET "\n", private, pages);
+    if (!ok) {
+        printf(RED "* %s is over budget!" RESET "\n", init_name);
+        return 1;
+    }
+    printf(CYAN "* " WHITE "%s is within its budgets" RESET "\n", init_name);
+    return 0;
+#endif
+}
@@ -0,0 +1,381 @@
+/*
+ * Copyright © 2018-2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * sandbox.h -- A synthetic system booted by LeanInit as PID 1 of a new PID namespace, used by bench and storm
+ *
+ * The synthetic root lives on a tmpfs and holds the LeanInit binaries and scripts from ../out,
+ * a number of generated services and fake gettys. The host's /bin, /lib and /usr are bound
+ * read-only so the generated services can use the host's shell and utilities.
+ *
+ * leaninit.h must be included first (it has no include guard).
+ */
+
+#ifndef SANDBOX_H
+#define SANDBOX_H
+
+#include <sched.h>
+
+#define EVENTS  "/.bench" // FIFO the fake gettys report to
+#define POLL_MS 10        // Interval used to check whether every service has started
+
+// Settings for the synthetic system
+static unsigned int services = 32;
+static unsigned int fanout   = 2;
+static unsigned int latency  = 10;
+static unsigned int gettys   = 2;
+static unsigned int timeout  = 60;
+static unsigned int seed     = 1;
+static const char *outdir    = "../out";
+static const char *init_name = "leaninit"; // The build of LeanInit installed as /sbin/leaninit
+static char root[64];
+
+// Directories bound from the host, the binaries installed in the synthetic /sbin and the scripts in /etc/leaninit
+static const char *host_dirs[] = { "bin", "sbin", "lib", "lib32", "lib64", "libx32", "usr" };
+static const char *binaries[]  = { "leaninit",       "leaninit-sched", "leaninit-waitfor",   "leaninit-state",
+                                   "leaninit-logd",  "leaninit-halt",  "leaninit-readahead", "leaninit-analyze",
+                                   "leaninit-umount", "rc/leaninit-service" };
+static const char *scripts[]   = { "rc", "rc.svc", "rc.shutdown", "rc.conf" };
+static const char *dev_nodes[] = { "null", "zero", "full", "random", "urandom", "tty" };
+
+// Milliseconds on CLOCK_MONOTONIC
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+// Build a path inside the synthetic root
+static const char *in_root(const char *path)
+{
+    static char buf[2][PATH_MAX + sizeof(root)];
+    static int which = 0;
+    which ^= 1;
+    snprintf(buf[which], sizeof(buf[which]), "%s/%s", root, path[0] == '/' ? path + 1 : path);
+    return buf[which];
+}
+
+// Create a file inside the synthetic root with the given contents
+static bool write_file(const char *path, mode_t mode, const char *text)
+{
+    int fd = open(in_root(path), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if unlikely (fd == -1) {
+        fprintf(stderr, RED "* Failed to create %s: %s" RESET "\n", path, strerror(errno));
+        return false;
+    }
+    size_t len = strlen(text);
+    bool ok    = write(fd, text, len) == (ssize_t)len;
+    close(fd);
+    return ok;
+}
+
+// Copy a file from the host into the synthetic root
+static bool copy_file(const char *src, const char *dst, mode_t mode)
+{
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if unlikely (in == -1) {
+        fprintf(stderr, RED "* Failed to open %s: %s (was LeanInit built?)" RESET "\n", src, strerror(errno));
+        return false;
+    }
+    int out = open(in_root(dst), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if unlikely (out == -1) {
+        fprintf(stderr, RED "* Failed to create %s: %s" RESET "\n", dst, strerror(errno));
+        close(in);
+        return false;
+    }
+    char buf[65536];
+    ssize_t len;
+    bool ok = true;
+    while ((len = read(in, buf, sizeof(buf))) > 0)
+        ok &= write(out, buf, (size_t)len) == len;
+    close(in);
+    close(out);
+    return ok && len == 0;
+}
+
+// Bind a host path onto a path in the synthetic root, optionally read-only
+static bool bind_path(const char *src, const char *dst, bool readonly)
+{
+    if unlikely (mount(src, in_root(dst), NULL, MS_BIND | MS_REC, NULL) != 0
+                 || (readonly && mount(NULL, in_root(dst), NULL, MS_BIND | MS_REMOUNT | MS_RDONLY, NULL) != 0)) {
+        fprintf(stderr, RED "* Failed to bind %s: %s" RESET "\n", src, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Generate the services; each one needs up to fanout of the services before it and takes latency ms to start
+static bool make_services(void)
+{
+    char name[24], path[64], text[8192];
+    srand(seed);
+    for (unsigned int i = 0; i <= services; i++) {
+        if (i == 0) {
+            // rc waits for the settings service before returning to init
+            snprintf(name, sizeof(name), "settings");
+            if (!write_file(SVC_DIR "/settings", 0755, "#!/bin/sh\nNAME=settings\n__svcname=${0##*/}\nmain() { :; }\n"
+                                        ". /etc/leaninit/rc.svc\n"))
+                return false;
+        } else {
+            snprintf(name, sizeof(name), "bench-%03u", i);
+            int len = snprintf(text, sizeof(text), "#!/bin/sh\nNAME=%s\n__svcname=${0##*/}\nNEED=\"", name);
+            unsigned int need = fanout < i - 1 ? fanout : i - 1;
+            unsigned int base = (unsigned int)rand() % (i - need);
+            for (unsigned int d = 0; d < need && len < (int)sizeof(text) - 64; d++)
+                len += snprintf(text + len, sizeof(text) - (size_t)len, "%sbench-%03u", d ? " " : "", base + d + 1);
+            snprintf(text + len, sizeof(text) - (size_t)len,
+                     "\"\nmain() {\n    sleep 86400 &\n    sleep %u.%03u\n}\n. /etc/leaninit/rc.svc\n", latency / 1000,
+                     latency % 1000);
+            snprintf(path, sizeof(path), SVC_DIR "/%s", name);
+            if (!write_file(path, 0755, text))
+                return false;
+        }
+
+        // Enable the service
+        char enabled[64];
+        snprintf(path, sizeof(path), SVC_DIR "/%s", name);
+        snprintf(enabled, sizeof(enabled), ENABLED_DIR "/%s", name);
+        if unlikely (symlink(path, in_root(enabled)) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Build the synthetic root, returning the master side of the pseudo-terminal bound onto its DEFAULT_TTY
+static int build_root(void)
+{
+    if unlikely (mount("tmpfs", root, "tmpfs", 0, "mode=0755") != 0) {
+        perror(RED "* Failed to mount the tmpfs for the synthetic root" RESET);
+        return -1;
+    }
+
+    // Bind the host's binaries and libraries, keeping symlinks such as /bin -> usr/bin intact
+    for (size_t i = 0; i < sizeof(host_dirs) / sizeof(host_dirs[0]); i++) {
+        char src[PATH_MAX], target[PATH_MAX];
+        struct stat st;
+        snprintf(src, sizeof(src), "/%s", host_dirs[i]);
+        if (lstat(src, &st) != 0)
+            continue;
+        if (S_ISLNK(st.st_mode)) {
+            ssize_t len = readlink(src, target, sizeof(target) - 1);
+            if (len < 0)
+                continue;
+            target[len] = '\0';
+            if unlikely (symlink(target, in_root(src)) != 0)
+                return -1;
+        } else if (S_ISDIR(st.st_mode) && (mkdir(in_root(src), 0755) != 0 || !bind_path(src, src, true))) {
+            return -1;
+        }
+    }
+
+    // Put an overlay on top of /sbin so the LeanInit build can be installed over the host's
+    char sbin[PATH_MAX], opts[PATH_MAX * 4];
+    if unlikely (realpath("/sbin", sbin) == NULL || mkdir(in_root("/.upper"), 0755) != 0
+                 || mkdir(in_root("/.work"), 0755) != 0) {
+        perror(RED "* Failed to prepare the overlay for /sbin" RESET);
+        return -1;
+    }
+    snprintf(opts, sizeof(opts), "lowerdir=%s,upperdir=%s/.upper,workdir=%s/.work", sbin, root, root);
+    if unlikely (mount("overlay", in_root(sbin), "overlay", 0, opts) != 0) {
+        perror(RED "* Failed to mount an overlay on /sbin" RESET);
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(binaries) / sizeof(binaries[0]); i++) {
+        char src[PATH_MAX], dst[PATH_MAX + 64];
+        const char *name = strrchr(binaries[i], '/');
+        snprintf(src, sizeof(src), "%s/%s", outdir, strcmp(binaries[i], "leaninit") == 0 ? init_name : binaries[i]);
+        snprintf(dst, sizeof(dst), "%s/%s", sbin, name != NULL ? name + 1 : binaries[i]);
+        if (!copy_file(src, dst, 0755))
+            return -1;
+    }
+
+    // The rest of the file system
+    const char *dirs[] = { "/dev", "/proc", "/sys", "/tmp", "/run", "/root", "/etc", "/etc/leaninit",
+                           SVC_DIR, "/var", "/var/lib", "/var/lib/leaninit", ENABLED_DIR, "/var/lib/leaninit/types",
+                           "/var/log", LOG_DIR };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        if unlikely (mkdir(in_root(dirs[i]), 0755) != 0) {
+            fprintf(stderr, RED "* Failed to create %s: %s" RESET "\n", dirs[i], strerror(errno));
+            return -1;
+        }
+    }
+    if unlikely (symlink("../run", in_root("/var/run")) != 0 || mkfifo(in_root(EVENTS), 0666) != 0)
+        return -1;
+    for (size_t i = 0; i < sizeof(scripts) / sizeof(scripts[0]); i++) {
+        char src[PATH_MAX], dst[PATH_MAX];
+        snprintf(src, sizeof(src), "%s/rc/%s", outdir, scripts[i]);
+        snprintf(dst, sizeof(dst), "/etc/leaninit/%s", scripts[i]);
+        if (!copy_file(src, dst, 0755))
+            return -1;
+    }
+    if (!write_file("/etc/profile", 0644, "") || !write_file("/etc/fstab", 0644, "")
+        || !write_file("/etc/passwd", 0644, "root:x:0:0:root:/root:/bin/sh\n")
+        || !write_file("/etc/group", 0644, "root:x:0:\n") || !make_services())
+        return -1;
+
+    // Fake gettys report their PID (the number of PIDs allocated so far) through the FIFO
+    char ttys[8192] = "";
+    for (unsigned int i = 0, len = 0; i < gettys && len < sizeof(ttys) - 128; i++)
+        len += (unsigned int)snprintf(ttys + len, sizeof(ttys) - len,
+                                      "/bin/sh -c 'echo $$ > " EVENTS "; exec sleep 86400':" DEFAULT_TTY "\n");
+    if (!write_file("/etc/leaninit/ttys", 0644, ttys))
+        return -1;
+
+    // A minimal /dev made of the host's device nodes, plus a pseudo-terminal in place of the console
+    if unlikely (mount("tmpfs", in_root("/dev"), "tmpfs", MS_NOSUID, "mode=0755") != 0)
+        return -1;
+    for (size_t i = 0; i < sizeof(dev_nodes) / sizeof(dev_nodes[0]); i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "/dev/%s", dev_nodes[i]);
+        if (!write_file(path, 0644, "") || !bind_path(path, path, false))
+            return -1;
+    }
+    if unlikely (symlink("/proc/self/fd", in_root("/dev/fd")) != 0)
+        return -1;
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if unlikely (master == -1 || grantpt(master) != 0 || unlockpt(master) != 0 || !write_file(DEFAULT_TTY, 0620, "")
+                 || !bind_path(ptsname(master), DEFAULT_TTY, false)) {
+        perror(RED "* Failed to create a pseudo-terminal" RESET);
+        return -1;
+    }
+    fcntl(master, F_SETFL, O_NONBLOCK);
+
+    // Real pseudo file systems (/proc is mounted from inside the new PID namespace)
+    if unlikely (!bind_path("/sys", "/sys", true) || mount("tmpfs", in_root("/tmp"), "tmpfs", 0, "mode=1777") != 0
+                 || mount("tmpfs", in_root("/run"), "tmpfs", 0, "mode=0755") != 0) {
+        perror(RED "* Failed to mount the pseudo file systems" RESET);
+        close(master);
+        return -1;
+    }
+    return master;
+}
+
+// Read a ring buffer kept by LeanInit, returning the number of records copied into records
+static size_t read_ring(const char *path, uint32_t magic, void *records, size_t size, size_t max)
+{
+    struct ring_header header;
+    int fd = open(in_root(path), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    size_t count = 0;
+    if (read(fd, &header, sizeof(header)) == sizeof(header) && header.magic == magic) {
+        count = (size_t)(header.count < header.slots ? header.count : header.slots);
+        count = count < max ? count : max;
+        ssize_t len = read(fd, records, count * size);
+        count = len > 0 ? (size_t)len / size : 0;
+    }
+    close(fd);
+    return count;
+}
+
+// Check whether every generated service has recorded its status
+static bool services_started(void)
+{
+    char path[PATH_MAX];
+    for (unsigned int i = 1; i <= services; i++) {
+        snprintf(path, sizeof(path), "/var/run/leaninit/bench-%03u.status", i);
+        if (access(in_root(path), F_OK) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Read everything leaninit has written to the pseudo-terminal so it never blocks
+static void drain(int master)
+{
+    char buf[4096];
+    while (read(master, buf, sizeof(buf)) > 0)
+        continue;
+}
+
+
+// Create a private mount namespace and the directory the synthetic root is mounted on
+static bool sandbox_create(void)
+{
+    if unlikely (unshare(CLONE_NEWNS) != 0 || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+        perror(RED "* Failed to create a mount namespace" RESET);
+        return false;
+    }
+    snprintf(root, sizeof(root), "/tmp/leaninit-bench.XXXXXX");
+    if unlikely (mkdtemp(root) == NULL) {
+        perror(RED "* Failed to create a directory for the synthetic root" RESET);
+        return false;
+    }
+    return true;
+}
+
+/* Start leaninit as PID 1 of a new PID namespace (a raw clone(2) behaves like fork(2) here). It gets a mount
+   namespace of its own once /proc is mounted, so rc.shutdown(8) can't unmount anything the caller uses. */
+static pid_t start_init(void)
+{
+    pid_t init = (pid_t)syscall(SYS_clone, CLONE_NEWPID | SIGCHLD, 0, 0, 0, 0);
+    if (init == 0) {
+        char *envp[] = { "PATH=/bin:/sbin:/usr/bin:/usr/sbin", "TERM=linux", NULL };
+        int null     = open("/dev/null", O_RDWR);
+        if (mount("proc", in_root("/proc"), "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) != 0
+            || unshare(CLONE_NEWNS) != 0 || chroot(root) != 0 || chdir("/") != 0 || null == -1)
+            _exit(1);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execle("/sbin/leaninit", "leaninit", NULL, envp);
+        _exit(1);
+    } else if unlikely (init == -1)
+        perror(RED "* clone() failed with" RESET);
+    return init;
+}
+
+/* Wait for the first getty and for every service to start, setting when the first getty was spawned (and the PID it
+   reported) and when every service had started in milliseconds since start. Returns false when leaninit exited or
+   the system didn't boot in time, setting *init to -1 in the former case. */
+static bool wait_for_boot(pid_t *init, int master, int events, double start, double *first_getty, long *getty_pid,
+                          double *booted)
+{
+    int status;
+    struct pollfd fds[2] = { { .fd = master, .events = POLLIN }, { .fd = events, .events = POLLIN } };
+    *first_getty         = -1;
+    while (now_ms() - start < timeout * 1000.0) {
+        poll(fds, 2, POLL_MS);
+        drain(master);
+        char line[64];
+        ssize_t len = read(events, line, sizeof(line) - 1);
+        if (len > 0 && *first_getty < 0) {
+            line[len]    = '\0';
+            *first_getty = now_ms() - start;
+            *getty_pid   = atol(line);
+        }
+        if (*first_getty >= 0 && services_started()) {
+            *booted = now_ms() - start;
+            return true;
+        }
+        if (waitpid(*init, &status, WNOHANG) == *init) {
+            fprintf(stderr, RED "* leaninit exited during boot" RESET "\n");
+            *init = -1;
+            return false;
+        }
+    }
+    fprintf(stderr, RED "* Timed out waiting for the system to boot" RESET "\n");
+    return false;
+}
+
+#endif
@@ -0,0 +1,491 @@
+/*
+ * Copyright © 2018-2021 Johnothan King. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * storm -- Flood a namespaced LeanInit with orphans and runlevel requests
+ *
+ * Boots a synthetic system (see sandbox.h), then hands batches of orphans to LeanInit, which
+ * must reap all of them, and sends a storm of runlevel signals and control socket requests
+ * mixed at random. Every control request must be answered and the last runlevel requested must
+ * be the one running once the storm is over; storm exits with 1 when a request was lost.
+ */
+
+#include <leaninit.h>
+#ifdef __linux__
+#include "sandbox.h"
+
+// Results of the orphan floods and of the storm
+static struct {
+    double reap_max;            // Longest time from releasing a batch of orphans until the last one was reaped
+    double reap_total;          // Sum of those times, for the average
+    long zombies_max;           // Most zombies seen at once
+    long orphans_lost;          // Orphans that were never reaped
+    long sent;                  // Requests sent during the storm
+    long sent_runlevel;         // Of those, the ones switching the runlevel
+    long replies[CTL_DONE + 1]; // Replies to the control requests, by result
+    long lost;                  // Control requests without a reply, plus a wrong final runlevel
+    long transitions;           // Runlevel switches performed
+    double storm_ms;            // Time until LeanInit had handled the whole storm
+    double cpu_ms;              // CPU time used by LeanInit during the floods and the storm
+    double wall_ms;             // Wall time of the floods and the storm
+} result;
+
+static bool json = false;
+
+// Show usage information
+static cold noreturn void usage(void)
+{
+    printf("Usage: %s [-zbSRmnstoj?] ...\n"
+           "  -z, --orphans   Number of orphans in each flood (default 1000)\n"
+           "  -b, --batches   Number of floods (default 5)\n"
+           "  -S, --signals   Number of runlevel requests in the storm (default 500)\n"
+           "  -R, --rate      Requests sent per second, or 0 for as fast as possible (default 0)\n"
+           "  -m, --mix       Percentage of requests sent through the control socket instead of signals (default 50)\n"
+           "  -n, --services  Number of generated services (default 4)\n"
+           "  -s, --seed      Seed used to pick the requests (default 1)\n"
+           "  -t, --timeout   Seconds to wait for LeanInit to boot, reap or answer (default 60)\n"
+           "  -o, --out       Directory holding the LeanInit build (default ../out)\n"
+           "  -j, --json      Only output the results as a JSON object\n"
+           "  -?, --help      Show this usage information\n",
+           __progname);
+    exit(1);
+}
+
+// CPU time used by a process in milliseconds
+static double cpu_ms(pid_t pid)
+{
+    char path[32], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    // utime and stime are the 12th and 13th fields after the command name
+    unsigned long utime = 0, stime = 0;
+    char *fields = strrchr(buf, ')');
+    if (fields == NULL
+        || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+    return (double)(utime + stime) * 1000.0 / (double)sysconf(_SC_CLK_TCK);
+}
+
+// Number of records written to a ring buffer kept by LeanInit so far
+static uint64_t ring_count(const char *path)
+{
+    struct ring_header header = { 0 };
+    int fd = open(in_root(path), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        if (read(fd, &header, sizeof(header)) != sizeof(header))
+            header.count = 0;
+        close(fd);
+    }
+    return header.count;
+}
+
+// Count the runlevel switches and reloads the profiler has recorded since *seen, which is then updated
+static long transitions(uint64_t *seen)
+{
+    struct ring_header header;
+    struct profile_record record;
+    long count = 0;
+    int fd     = open(in_root(PROFILE_PATH), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    if (read(fd, &header, sizeof(header)) == sizeof(header) && header.magic == PROFILE_MAGIC) {
+        uint64_t i = header.count > *seen + header.slots ? header.count - header.slots : *seen;
+        for (; i < header.count; i++) {
+            off_t offset = (off_t)(sizeof(header) + (i % header.slots) * sizeof(record));
+            if (pread(fd, &record, sizeof(record), offset) == sizeof(record) && record.kind == PROF_BEGIN
+                && (strcmp(record.name, "shutdown") == 0 || strcmp(record.name, "switch") == 0
+                    || strcmp(record.name, "reload") == 0))
+                count++;
+        }
+        *seen = header.count;
+    }
+    close(fd);
+    return count;
+}
+
+// Sort exit times
+static int by_time(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Hand a batch of orphans to LeanInit. A helper in the PID namespace forks them and exits, so they
+   are reparented to LeanInit, then they are all released at once and LeanInit has to reap them.
+   Orphans record when they exit, which compared with the number of processes LeanInit has reaped
+   at the same time gives the number of zombies waiting. */
+#define SAMPLES 65536
+static bool flood(unsigned int orphans)
+{
+    int go[2];
+    double *exited = mmap(NULL, orphans * sizeof(double), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if unlikely (exited == MAP_FAILED)
+        return false;
+    if unlikely (pipe(go) != 0) {
+        munmap(exited, orphans * sizeof(double));
+        return false;
+    }
+    uint64_t before = ring_count(EXITS_PATH);
+    pid_t helper    = fork();
+    if (helper == 0) {
+        close(go[1]);
+        for (unsigned int i = 0; i < orphans; i++) {
+            pid_t orphan = fork();
+            if (orphan == 0) {
+                char byte;
+                while (read(go[0], &byte, 1) == -1 && errno == EINTR)
+                    continue;
+                exited[i] = now_ms();
+                _exit(0);
+            } else if unlikely (orphan == -1)
+                _exit(1);
+        }
+        _exit(0);
+    } else if unlikely (helper == -1) {
+        perror(RED "* fork() failed with" RESET);
+        close(go[0]);
+        close(go[1]);
+        munmap(exited, orphans * sizeof(double));
+        return false;
+    }
+
+    /* Release the orphans once they all belong to LeanInit. This runs with a real-time priority until they
+       have been reaped, or thousands of orphans waking up at once would keep the sampling from running. */
+    int status;
+    struct sched_param param = { .sched_priority = 1 }, normal = { .sched_priority = 0 };
+    close(go[0]);
+    waitpid(helper, &status, 0);
+    sched_setscheduler(0, SCHED_FIFO, &param);
+    double released = now_ms();
+    close(go[1]);
+    if unlikely (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, RED "* Failed to fork %u orphans" RESET "\n", orphans);
+        sched_setscheduler(0, SCHED_OTHER, &normal);
+        munmap(exited, orphans * sizeof(double));
+        return false;
+    }
+
+    // Wait for every orphan to be reaped, sampling how many have been reaped so far
+    static struct {
+        double time;
+        uint64_t reaped;
+    } samples[SAMPLES];
+    size_t nsamples = 0;
+    uint64_t reaped = 0;
+    while (now_ms() - released < timeout * 1000.0) {
+        reaped = ring_count(EXITS_PATH) - before;
+        if (nsamples < SAMPLES) {
+            samples[nsamples].time     = now_ms();
+            samples[nsamples++].reaped = reaped;
+        }
+        if (reaped >= orphans)
+            break;
+        usleep(100);
+    }
+    sched_setscheduler(0, SCHED_OTHER, &normal);
+
+    // The most orphans that had exited but not been reaped yet at any sample
+    qsort(exited, orphans, sizeof(double), by_time);
+    for (size_t i = 0, done = 0; i < nsamples; i++) {
+        while (done < orphans && exited[done] != 0 && exited[done] <= samples[i].time)
+            done++;
+        long waiting = (long)done - (long)samples[i].reaped;
+        if (waiting > result.zombies_max)
+            result.zombies_max = waiting;
+    }
+    munmap(exited, orphans * sizeof(double));
+    if unlikely (reaped < orphans) {
+        result.orphans_lost += (long)(orphans - reaped);
+        return true;
+    }
+
+    // The last record is the last orphan reaped, recorded on the same clock
+    struct exit_record exits[EXITS_SLOTS];
+    size_t count = read_ring(EXITS_PATH, EXITS_MAGIC, exits, sizeof(exits[0]), EXITS_SLOTS);
+    double last  = released;
+    for (size_t i = 0; i < count; i++)
+        if ((double)exits[i].ns / 1000000.0 > last)
+            last = (double)exits[i].ns / 1000000.0;
+    result.reap_total += last - released;
+    if (last - released > result.reap_max)
+        result.reap_max = last - released;
+    return true;
+}
+
+// Send a request through the control socket, returning its connection or -1 if it wasn't answered
+static int control(uint8_t type, struct control_reply *reply)
+{
+    struct control_request request = { .magic = CONTROL_MAGIC, .type = type };
+    struct sockaddr_un addr         = { .sun_family = AF_UNIX };
+    struct timeval wait             = { .tv_sec = timeout };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", in_root(CONTROL_PATH));
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if unlikely (fd == -1)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || write(fd, &request, sizeof(request)) != sizeof(request) || read(fd, reply, sizeof(*reply)) != sizeof(*reply)
+        || reply->magic != CONTROL_MAGIC) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send a runlevel request through the control socket, counting its reply
+static void request(uint8_t type)
+{
+    struct control_reply reply;
+    int fd = control(type, &reply);
+    if unlikely (fd == -1)
+        result.lost++;
+    else {
+        result.replies[reply.result <= CTL_DONE ? reply.result : 0]++;
+        close(fd);
+    }
+}
+
+// Send runlevel signals and control requests to LeanInit as fast as requested, then check that none were lost
+static void storm(pid_t init, int master, unsigned int requests, unsigned int rate, unsigned int mix)
+{
+    static const int signals[]   = { SIGTERM, SIGILL, SIGHUP };
+    static const uint8_t types[] = { CTL_SINGLE, CTL_MULTI, CTL_RELOAD };
+    uint64_t seen = ring_count(PROFILE_PATH);
+    double start  = now_ms();
+    for (unsigned int i = 0; i < requests; i++) {
+        if (rate != 0) {
+            double delay = start + i * 1000.0 / rate - now_ms();
+            if (delay > 0)
+                usleep((useconds_t)(delay * 1000));
+        }
+        drain(master);
+
+        // Single-user, multi-user or reload, sent as a signal or through the control socket
+        int which = rand() % 3;
+        if (which != 2)
+            result.sent_runlevel++;
+        result.sent++;
+        if (rand() % 100 < (int)mix)
+            request(types[which]);
+        else
+            kill(init, signals[which]);
+        result.transitions += transitions(&seen);
+    }
+
+    /* Signals that are pending at once are delivered in numerical order rather than the order they were
+       sent, so the storm ends with a runlevel request through the control socket, which has to win */
+    uint8_t expected = rand() % 2 == 0 ? CTL_SINGLE : CTL_MULTI;
+    result.sent++;
+    result.sent_runlevel++;
+    request(expected);
+
+    // LeanInit only answers once it is back in its event loop, so wait until nothing is pending
+    struct control_reply reply = { 0 };
+    while (now_ms() - start < timeout * 1000.0) {
+        drain(master);
+        int fd = control(CTL_STATUS, &reply);
+        if (fd != -1)
+            close(fd);
+        result.transitions += transitions(&seen);
+        if (fd != -1 && reply.pending == 0)
+            break;
+        usleep(POLL_MS * 1000);
+    }
+    result.storm_ms = now_ms() - start;
+    if unlikely (reply.magic != CONTROL_MAGIC || reply.pending != 0) {
+        fprintf(stderr, RED "* LeanInit did not finish handling the storm in time" RESET "\n");
+        result.lost++;
+    } else if unlikely (reply.runlevel != expected) {
+        fprintf(stderr, RED "* The last runlevel requested was lost" RESET "\n");
+        result.lost++;
+    }
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+#ifndef __linux__
+    (void)argc;
+    (void)argv;
+    printf(RED "* storm requires Linux namespaces!" RESET "\n");
+    return 1;
+#else
+    // This program must be run as root
+    if very_unlikely (getuid() != 0) {
+        printf(RED "* Permission denied!" RESET "\n");
+        return 1;
+    }
+
+    // Long options struct
+    struct option long_options[] = { { "orphans", required_argument, NULL, 'z' },
+                                     { "batches", required_argument, NULL, 'b' },
+                                     { "signals", required_argument, NULL, 'S' },
+                                     { "rate", required_argument, NULL, 'R' },
+                                     { "mix", required_argument, NULL, 'm' },
+                                     { "services", required_argument, NULL, 'n' },
+                                     { "seed", required_argument, NULL, 's' },
+                                     { "timeout", required_argument, NULL, 't' },
+                                     { "out", required_argument, NULL, 'o' },
+                                     { "json", no_argument, NULL, 'j' },
+                                     { "help", no_argument, NULL, '?' },
+                                     { NULL, 0, NULL, 0 } };
+
+    // Parse the given options, the synthetic system is kept small so its boot doesn't dominate
+    unsigned int orphans = 1000, batches = 5, requests = 500, rate = 0, mix = 50;
+    services = 4;
+    latency  = 0;
+    gettys   = 1;
+    int args;
+    while ((args = getopt_long(argc, argv, "z:b:S:R:m:n:s:t:o:j?", long_options, NULL)) != -1) {
+        switch (args) {
+            case 'z':
+                orphans = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                batches = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                requests = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                rate = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                mix = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                services = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                timeout = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            case 'j':
+                json = true;
+                break;
+            case '?':
+                usage();
+                __builtin_unreachable();
+        }
+    }
+    if unlikely (services == 0 || services > 999 || mix > 100 || timeout == 0)
+        usage();
+
+    // Boot the synthetic system
+    if (!sandbox_create())
+        return 1;
+    int master = build_root(), events = master != -1 ? open(in_root(EVENTS), O_RDWR | O_NONBLOCK | O_CLOEXEC) : -1;
+    double start = now_ms(), first_getty, booted;
+    long getty_pid;
+    pid_t init = events != -1 ? start_init() : -1;
+    if unlikely (init == -1 || !wait_for_boot(&init, master, events, start, &first_getty, &getty_pid, &booted)) {
+        if (init != -1) {
+            kill(init, SIGKILL);
+            waitpid(init, NULL, 0);
+        }
+        umount2(root, MNT_DETACH);
+        rmdir(root);
+        return 1;
+    }
+    if (!json)
+        printf(CYAN "* " WHITE "LeanInit booted %u services in %.1f ms" RESET "\n", services, booted);
+
+    // Fork the orphans inside LeanInit's PID namespace
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/ns/pid", init);
+    int ns = open(path, O_RDONLY | O_CLOEXEC);
+    if unlikely (ns == -1 || setns(ns, CLONE_NEWPID) != 0) {
+        perror(RED "* Failed to enter LeanInit's PID namespace" RESET);
+        batches = 0;
+    }
+    srand(seed);
+    double cpu = cpu_ms(init), wall = now_ms();
+    for (unsigned int i = 0; i < batches; i++) {
+        if (!flood(orphans)) {
+            result.orphans_lost += orphans;
+            break;
+        }
+        drain(master);
+    }
+    storm(init, master, requests, rate, mix);
+    result.cpu_ms  = cpu_ms(init) - cpu;
+    result.wall_ms = now_ms() - wall;
+
+    // Power off
+    kill(init, SIGUSR2);
+    double halt = now_ms();
+    while (waitpid(init, NULL, WNOHANG) != init) {
+        if (now_ms() - halt > timeout * 1000.0) {
+            kill(init, SIGKILL);
+            waitpid(init, NULL, 0);
+            break;
+        }
+        drain(master);
+        usleep(POLL_MS * 1000);
+    }
+    umount2(root, MNT_DETACH);
+    rmdir(root);
+
+    // Show the results
+    long merged = result.sent_runlevel - result.transitions;
+    double reap_avg = batches != 0 ? result.reap_total / batches : 0;
+    if (json) {
+        printf("{\"orphans\":%u,\"batches\":%u,\"reap_avg_ms\":%.3f,\"reap_max_ms\":%.3f,\"zombies_max\":%ld,"
+               "\"orphans_lost\":%ld,\"requests\":%ld,\"runlevel_requests\":%ld,\"transitions\":%ld,\"merged\":%ld,"
+               "\"queued\":%ld,\"replies_merged\":%ld,\"current\":%ld,\"lost\":%ld,\"storm_ms\":%.3f,"
+               "\"cpu_ms\":%.3f,\"wall_ms\":%.3f}\n",
+               orphans, batches, reap_avg, result.reap_max, result.zombies_max, result.orphans_lost, result.sent,
+               result.sent_runlevel, result.transitions, merged, result.replies[CTL_QUEUED],
+               result.replies[CTL_MERGED], result.replies[CTL_CURRENT], result.lost, result.storm_ms, result.cpu_ms,
+               result.wall_ms);
+    } else {
+        printf(CYAN "* " WHITE "Orphans: %u x %u reaped in %.1f ms on average (%.1f ms at most), %ld zombies at most, "
+                    "%ld lost" RESET "\n",
+               batches, orphans, reap_avg, result.reap_max, result.zombies_max, result.orphans_lost);
+        printf(CYAN "* " WHITE "Storm: %ld requests (%ld runlevel switches) handled in %.1f ms, %ld switches "
+                    "performed, %ld merged" RESET "\n",
+               result.sent, result.sent_runlevel, result.storm_ms, result.transitions, merged);
+        printf(CYAN "* " WHITE "Control replies: %ld queued, %ld merged, %ld already running, %ld lost" RESET "\n",
+               result.replies[CTL_QUEUED], result.replies[CTL_MERGED], result.replies[CTL_CURRENT], result.lost);
+        printf(CYAN "* " WHITE "LeanInit used %.1f ms of CPU time in %.1f ms (%.1f%%)" RESET "\n", result.cpu_ms,
+               result.wall_ms, result.wall_ms > 0 ? result.cpu_ms * 100.0 / result.wall_ms : 0);
+    }
+    if (result.lost != 0 || result.orphans_lost != 0) {
+        printf(RED "* Requests were lost!" RESET "\n");
+        return 1;
+    }
+    return 0;
+#endif
+}
@@ -30,24 +30,45 @@
 #endif
 
 // Include files
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
-#include <pthread.h>
+#include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/reboot.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <linux/reboot.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mount.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#else
+#include <sys/event.h>
+#endif
 #if defined(__FreeBSD__)
 #include <efivar.h>
 #endif
@@ -61,6 +82,8 @@
 #define SYS_POWEROFF RB_POWER_OFF
 #define SYS_REBOOT   RB_AUTOBOOT
 #define SYS_HALT     RB_HALT_SYSTEM
+#define SYS_KEXEC    LINUX_REBOOT_CMD_KEXEC // Jump into the kernel loaded with kexec_file_load(2)
+#define SIGKEXEC     (SIGRTMIN + 6)         // Sent to init(8) for a kexec reboot (not a constant expression)
 #elif defined(__FreeBSD__)
 #define DEFAULT_TTY  "/dev/ttyv0"
 #define SYS_POWEROFF RB_POWEROFF
@@ -73,6 +96,28 @@
 #define SYS_HALT     RB_HALT, NULL
 #endif
 
+// Paths shared between init(8) and the RC system
+#define SCHED_PATH     "/sbin/leaninit-sched"
+#define WAITFOR_PATH   "/sbin/leaninit-waitfor"
+#define ANALYZE_PATH   "/sbin/leaninit-analyze"
+#define LOGD_PATH      "/sbin/leaninit-logd"
+#define UMOUNT_PATH    "/sbin/leaninit-umount"
+#define READAHEAD_PATH "/sbin/leaninit-readahead"
+#define SPAWN_PATH     "/sbin/leaninit-spawn"
+#define READAHEAD_PACK "/var/lib/leaninit/readahead.pack" // Files read during boot, see leaninit-readahead(8)
+#define PROFILE_PATH   "/var/run/leaninit/profile"
+#define EXITS_PATH     "/var/run/leaninit/exits"
+#define CONTROL_PATH   "/var/run/leaninit/control"
+#define STATE_PATH     "/var/run/leaninit/state"
+#define STATE_BIN      "/sbin/leaninit-state"
+#define LOG_PATH       "/var/run/leaninit/log"       // FIFO read by leaninit-logd(8)
+#define LOG_QUERY      "/var/run/leaninit/log.query" // Socket used to flush a service's log before it is shown
+#define LOG_DIR        "/var/log/leaninit"
+#define SVC_DIR        "/etc/leaninit/svc"
+#define ENABLED_DIR    "/var/lib/leaninit/svc"
+#define SINGLE_DIR     "/var/lib/leaninit/single" // Services run in single user mode
+#define RC_CONF_PATH   "/etc/leaninit/rc.conf"
+
 // Colors
 #define RESET  "\x1b[m"
 #define RED    "\x1b[1;31m"
@@ -109,3 +154,551 @@ extern char **environ;   // This is used with execve(2)
 #define unlikely(x)      (__builtin_expect((x), 0))
 #define very_unlikely(x) (__builtin_expect((x), 0))
 #endif
+
+#if defined(MINIMAL)
+#include <stdarg.h>
+
+/* The minimal build of init(8) (make minimal) leaves stdio out of the static binary. Its console output is fixed
+   strings with a few integers and names in them, so printf(3) and friends are replaced with a formatter that only
+   knows %s, %c, %d, %u, %ld, %lu and %%, writing with write(2). */
+static inline int lean_vformat(char *buf, size_t size, const char *format, va_list args)
+{
+    size_t len = 0;
+    for (; *format; format++) {
+        char number[24], *text = number;
+        size_t text_len = 1;
+        bool is_long = false;
+        if (*format != '%' || format[1] == 0)
+            number[0] = *format;
+        else {
+            if (*++format == 'l') {
+                is_long = true;
+                format++;
+            }
+            if (*format == 's') {
+                text = va_arg(args, char *);
+                text_len = strlen(text);
+            } else if (*format == 'c')
+                number[0] = (char)va_arg(args, int);
+            else if (*format == 'd' || *format == 'u') {
+                unsigned long value;
+                bool negative = false;
+                if (*format == 'd') {
+                    long signed_value = is_long ? va_arg(args, long) : va_arg(args, int);
+                    negative = signed_value < 0;
+                    value = negative ? 0UL - (unsigned long)signed_value : (unsigned long)signed_value;
+                } else
+                    value = is_long ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+                text = number + sizeof(number);
+                do
+                    *--text = (char)('0' + value % 10);
+                while ((value /= 10) != 0);
+                if (negative)
+                    *--text = '-';
+                text_len = (size_t)(number + sizeof(number) - text);
+            } else
+                number[0] = *format;
+        }
+        for (size_t i = 0; i < text_len; i++, len++)
+            if (len + 1 < size)
+                buf[len] = text[i];
+    }
+    if (size != 0)
+        buf[len < size ? len : size - 1] = 0;
+    return (int)len;
+}
+
+static inline int lean_snprintf(char *buf, size_t size, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = lean_vformat(buf, size, format, args);
+    va_end(args);
+    return len;
+}
+
+static inline int lean_dprintf(int fd, const char *format, ...)
+{
+    char buf[1024];
+    va_list args;
+    va_start(args, format);
+    int len = lean_vformat(buf, sizeof(buf), format, args);
+    va_end(args);
+    return (int)write(fd, buf, len < (int)sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+}
+
+static inline void lean_perror(const char *message)
+{
+    const char *error = strerror(errno);
+    struct iovec iov[] = { { (void *)message, strlen(message) }, { ": ", 2 }, { (void *)error, strlen(error) },
+                           { "\n", 1 } };
+    writev(STDERR_FILENO, iov, 4);
+}
+
+#define printf(...)   lean_dprintf(STDOUT_FILENO, __VA_ARGS__)
+#define snprintf(...) lean_snprintf(__VA_ARGS__)
+#define dprintf(...)  lean_dprintf(__VA_ARGS__)
+#define perror(...)   lean_perror(__VA_ARGS__)
+#endif
+
+// Boot profiler records (see leaninit-analyze(8))
+#define PROFILE_MAGIC 0x4c504631 // "LPF1"
+#define PROFILE_SLOTS 1024       // Size of the ring buffer in PROFILE_PATH
+#define PROF_BEGIN    1          // A phase has started
+#define PROF_END      2          // A phase has finished (for services, the service is ready)
+#define PROF_FAIL     3          // A phase has failed
+#define PROF_MARK     4          // A single point in time, such as a getty being spawned
+
+/* Records are sent to init(8) through the pipe in $LEANINIT_PROFILE_FD, which keeps them in a ring buffer
+   following a ring_header in PROFILE_PATH. A record is smaller than PIPE_BUF, so writes never interleave. */
+struct profile_record {
+    uint64_t ns; // CLOCK_MONOTONIC
+    int32_t pid;
+    uint8_t kind;
+    uint8_t pad[3];
+    char name[56];
+    char cause[56]; // For services, the prerequisite whose start released it
+};
+struct ring_header {
+    uint32_t magic;
+    uint32_t slots;
+    uint64_t count; // Records written so far, the oldest ones are overwritten once this exceeds slots
+};
+
+// Every process reaped by init(8) is recorded in a ring buffer in EXITS_PATH (see leaninit-analyze(8))
+#define EXITS_MAGIC 0x4c455831 // "LEX1"
+#define EXITS_SLOTS 256
+struct exit_record {
+    uint64_t ns;       // When the process was reaped (CLOCK_MONOTONIC)
+    uint64_t utime_us; // User CPU time
+    uint64_t stime_us; // System CPU time
+    int64_t maxrss;    // Maximum resident set size in kilobytes
+    int32_t pid;
+    int32_t status; // Exit status, or zero when the process was killed
+    int32_t signal; // Signal that killed the process, or zero when it exited
+    int32_t pad;
+};
+
+// Return the pipe to init(8)'s profiler, or -1 when nothing is listening
+static inline int profile_fd(void)
+{
+    static int fd = -2;
+    if unlikely (fd == -2) {
+        const char *env = getenv("LEANINIT_PROFILE_FD");
+        struct stat st;
+        fd = env != NULL ? atoi(env) : -1;
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+            fd = -1;
+    }
+    return fd;
+}
+
+// Timestamp an event and send it to the profiler
+static inline void profile(uint8_t kind, const char *name, const char *cause)
+{
+    int fd = profile_fd();
+    if (fd == -1)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct profile_record record = { .ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec,
+                                     .pid = getpid(),
+                                     .kind = kind };
+    strncpy(record.name, name, sizeof(record.name) - 1);
+    if (cause != NULL)
+        strncpy(record.cause, cause, sizeof(record.cause) - 1);
+    write(fd, &record, sizeof(record));
+}
+
+/* Requests sent to init(8) through the socket at CONTROL_PATH. Every request is answered with one reply, and
+   requests that change the runlevel are followed by a CTL_PROGRESS reply for each phase of the shutdown. */
+#define CONTROL_MAGIC 0x4c435431 // "LCT1"
+#define CTL_HALT      1
+#define CTL_POWEROFF  2
+#define CTL_REBOOT    3
+#define CTL_SINGLE    4
+#define CTL_MULTI     5
+#define CTL_RELOAD    6
+#define CTL_STATUS    7 // Query the runlevel and the request waiting to be handled
+#define CTL_SERVICE   8 // Query the state of the service in name
+#define CTL_KEXEC     9 // Reboot into the kernel loaded with kexec_file_load(2), or reboot normally without one
+
+// Results
+#define CTL_QUEUED   1 // The request was queued
+#define CTL_MERGED   2 // The request was merged with one that is already waiting
+#define CTL_CURRENT  3 // The requested runlevel is already running
+#define CTL_DENIED   4 // Only root can change the runlevel
+#define CTL_INVALID  5 // The request was malformed
+#define CTL_ANSWER   6 // The reply to a query
+#define CTL_PROGRESS 7 // A phase of the shutdown has started
+#define CTL_DONE     8 // The new runlevel has been started
+
+// Phases reported with CTL_PROGRESS
+#define PHASE_STOP     1 // Stopping services
+#define PHASE_KILL     2 // Killing the remaining processes
+#define PHASE_SHUTDOWN 3 // Running rc.shutdown(8)
+#define PHASE_FINAL    4 // Halting, powering off or rebooting
+#define PHASE_START    5 // Starting the new runlevel
+#define PHASE_SWITCH   6 // Stopping the services the new runlevel doesn't need
+
+struct control_request {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t pad[3];
+    uint32_t deadline; // Seconds services get to stop when shutting down, or zero for their own STOP_TIMEOUT
+    char name[NAME_MAX + 1];
+};
+struct control_reply {
+    uint32_t magic;
+    uint8_t result;
+    uint8_t phase;    // With CTL_PROGRESS
+    uint8_t runlevel; // CTL_SINGLE or CTL_MULTI
+    uint8_t pending;  // The request that will be handled next, or zero
+    uint8_t enabled;  // CTL_SERVICE: the service is enabled
+    uint8_t pad[3];
+    int32_t pid;   // The runlevel process, or the service's first process
+    char text[64]; // CTL_SERVICE: the contents of the service's .status file
+};
+
+// Send a request to init(8), returning the connection to read further replies from or -1 if it is not listening
+static inline int control_send(const struct control_request *request, struct control_reply *reply)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if unlikely (fd == -1)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = CONTROL_PATH };
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || write(fd, request, sizeof(*request)) != sizeof(*request)
+        || read(fd, reply, sizeof(*reply)) != sizeof(*reply) || reply->magic != CONTROL_MAGIC) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Print a reply from init(8), returning false if the request failed
+static inline bool control_print(const struct control_reply *reply)
+{
+    static const char *const phases[] = { [PHASE_STOP] = "Stopping all services...",
+                                          [PHASE_KILL] = "Stopping all remaining processes...",
+                                          [PHASE_SHUTDOWN] = "Running rc.shutdown...",
+                                          [PHASE_FINAL] = "The system is going down NOW!",
+                                          [PHASE_START] = "Starting the new runlevel...",
+                                          [PHASE_SWITCH] = "Stopping the services the new runlevel doesn't need..." };
+    switch (reply->result) {
+        case CTL_QUEUED:
+            printf(CYAN "* " WHITE "LeanInit has queued the request" RESET "\n");
+            break;
+        case CTL_MERGED:
+            printf(PURPLE "* " YELLOW "The request was merged with one that is already waiting" RESET "\n");
+            break;
+        case CTL_CURRENT:
+            printf(PURPLE "* " YELLOW "The requested runlevel is already running" RESET "\n");
+            break;
+        case CTL_DENIED:
+            printf(RED "* Permission denied!" RESET "\n");
+            return false;
+        case CTL_PROGRESS:
+            if likely (reply->phase >= PHASE_STOP && reply->phase <= PHASE_SWITCH)
+                printf(CYAN "* " WHITE "%s" RESET "\n", phases[reply->phase]);
+            break;
+        case CTL_DONE:
+            printf(CYAN "* " WHITE "The new runlevel has been started" RESET "\n");
+            break;
+        case CTL_ANSWER:
+            break;
+        default:
+            printf(RED "* LeanInit could not handle the request" RESET "\n");
+            return false;
+    }
+    return true;
+}
+
+// Print every reply from init(8) until it closes the connection
+static inline int control_follow(int fd, struct control_reply *reply)
+{
+    bool ok = control_print(reply);
+    while (ok && read(fd, reply, sizeof(*reply)) == sizeof(*reply))
+        ok = control_print(reply);
+    close(fd);
+    return !ok;
+}
+
+/* The state of every service is kept in a table of fixed-size entries in STATE_PATH, which is mapped with mmap(2)
+   by anything that reads it. Entries are found by hashing the service's name and probing linearly, and are never
+   removed. leaninit-state(8) writes them under flock(2), bumping seq before and after each change so that readers
+   can copy an entry without locking and retry when it changed underneath them. */
+#define STATE_MAGIC 0x4c535431 // "LST1"
+#define STATE_SLOTS 512
+#define STATE_PIDS  8
+
+// States (the text in the .status file of a service)
+#define SVC_STOPPED   0
+#define SVC_STARTED   1
+#define SVC_RESTARTED 2
+#define SVC_RELOADED  3
+#define SVC_PAUSED    4
+#define SVC_CONTINUED 5
+#define SVC_FAILED    6
+#define SVC_LISTENING 7 // Its sockets are bound and it is started on the first connection (or is starting)
+#define SVC_STATES    8
+static const char *const state_names[] = { "Not Running", "Started",   "Restarted", "Reloaded",
+                                           "Paused",      "Continued", "Failure",   "Listening" };
+
+struct state_header {
+    uint32_t magic;
+    uint32_t slots;
+};
+struct state_entry {
+    uint32_t seq; // Odd while the entry is being written
+    uint8_t state;
+    uint8_t npids;
+    uint8_t pad[2];
+    uint32_t restarts;
+    int32_t pids[STATE_PIDS]; // The first processes in the service's .pid file
+    int64_t started;          // When the service last started (seconds since the epoch)
+    int64_t changed;          // When its state last changed
+    char name[64];
+    char type[64]; // The type the service provides while it is running
+};
+struct state_table {
+    struct state_header header;
+    struct state_entry entries[STATE_SLOTS];
+};
+
+// Map STATE_PATH, returning NULL if it doesn't exist (or can't be created when writable is true)
+static inline struct state_table *state_open(bool writable, int *fd_out)
+{
+    int fd = open(STATE_PATH, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return NULL;
+
+    // The first writer sizes the file, which reads back as zeroes (every entry empty)
+    struct stat st;
+    if (writable) {
+        flock(fd, LOCK_EX);
+        if (fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(struct state_table)) {
+            struct state_header header = { .magic = STATE_MAGIC, .slots = STATE_SLOTS };
+            if (ftruncate(fd, sizeof(struct state_table)) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+                close(fd);
+                return NULL;
+            }
+        }
+    } else if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct state_table)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct state_table *table = mmap(NULL, sizeof(struct state_table), writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                                     MAP_SHARED, fd, 0);
+    if (table == MAP_FAILED || table->header.magic != STATE_MAGIC || table->header.slots != STATE_SLOTS) {
+        if (table != MAP_FAILED)
+            munmap(table, sizeof(struct state_table));
+        close(fd);
+        return NULL;
+    }
+    if (fd_out != NULL)
+        *fd_out = fd; // Closing it releases the lock
+    else
+        close(fd);
+    return table;
+}
+
+// Return the entry for the given service, or the empty slot it would be put in (NULL when the table is full)
+static inline struct state_entry *state_find(struct state_table *table, const char *name)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const char *c = name; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    for (uint32_t i = 0; i < STATE_SLOTS; i++) {
+        struct state_entry *entry = &table->entries[(hash + i) % STATE_SLOTS];
+        if (entry->name[0] == 0 || strncmp(entry->name, name, sizeof(entry->name)) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// Copy an entry without tearing it, returning false if the service has no entry
+static inline bool state_read(struct state_table *table, const char *name, struct state_entry *copy)
+{
+    struct state_entry *entry = state_find(table, name);
+    if (entry == NULL)
+        return false;
+    for (int tries = 0; tries < 1000; tries++) {
+        uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(copy, entry, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq)
+            return copy->name[0] != 0;
+    }
+    return false;
+}
+
+/* Split a command into words in place, handling quotes and backslashes the way sh(1) does. Returns the number of
+   words (argv is terminated with NULL), or -1 when the command uses any other shell syntax (variables, globs,
+   redirections, pipes or lists) or has more than max - 1 words, in which case it has to be run by sh(1). */
+static inline int split_command(char *cmd, char **argv, int max)
+{
+    int argc = 0;
+    char *in = cmd, *out = cmd;
+    while (true) {
+        while (*in == ' ' || *in == '\t')
+            in++;
+        if (*in == '\0')
+            break;
+        else if unlikely (argc == max - 1)
+            return -1;
+
+        // Copy the word over itself without its quotes and escapes
+        argv[argc++] = out;
+        char quote = 0;
+        for (; *in != '\0' && (quote != 0 || (*in != ' ' && *in != '\t')); in++) {
+            if (quote == '\'') {
+                if (*in == '\'')
+                    quote = 0;
+                else
+                    *out++ = *in;
+            } else if (*in == '"' && quote == '"')
+                quote = 0;
+            else if (strchr(quote == '"' ? "$`" : "$`;&|<>()*?[]{}~#=\n", *in) != NULL && (*in != '=' || argc == 1))
+                return -1;
+            else if (*in == '\\' && in[1] != '\0') {
+                if (quote == '"' && strchr("$`\"\\", in[1]) == NULL)
+                    *out++ = *in;
+                *out++ = *++in;
+            } else if (quote == 0 && (*in == '\'' || *in == '"'))
+                quote = *in;
+            else
+                *out++ = *in;
+        }
+        if unlikely (quote != 0)
+            return -1;
+        if (*in != '\0')
+            in++;
+        *out++ = '\0';
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+/* Sockets bound ahead of time for services that declare them in $LISTEN, which are given to the daemon as file
+   descriptors 3 onwards with $LISTEN_FDS and $LISTEN_PID set the way sd_listen_fds(3) expects. */
+#define LISTEN_MAX 16
+
+/* Bind a listening socket given as tcp:[address:]port, tcp6:[[address]:]port, udp:[address:]port,
+   udp6:[[address]:]port or unix:path. The socket is closed on exec, and -1 is returned if it couldn't be bound. */
+static inline int listen_socket(const char *spec)
+{
+    char copy[PATH_MAX];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    char *addr = strchr(copy, ':');
+    if unlikely (addr == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    *addr++ = '\0';
+    int type = strncmp(copy, "udp", 3) == 0 ? SOCK_DGRAM : SOCK_STREAM;
+
+    int fd = -1;
+    if (strcmp(copy, "unix") == 0) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if unlikely (strlen(addr) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, addr);
+        unlink(addr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if unlikely (fd == -1 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+            goto fail;
+    } else {
+        int family = AF_UNSPEC;
+        if (strcmp(copy, "tcp") == 0 || strcmp(copy, "udp") == 0)
+            family = AF_INET;
+        else if (strcmp(copy, "tcp6") == 0 || strcmp(copy, "udp6") == 0)
+            family = AF_INET6;
+        else {
+            errno = EINVAL;
+            return -1;
+        }
+
+        // The port comes after the last colon, and IPv6 addresses are written in brackets
+        char *host = NULL, *port = strrchr(addr, ':');
+        if (port != NULL) {
+            *port++ = '\0';
+            host = addr;
+            if (*host == '[') {
+                host++;
+                host[strcspn(host, "]")] = '\0';
+            }
+        } else
+            port = addr;
+        struct addrinfo hints = { .ai_flags = AI_PASSIVE | AI_NUMERICSERV, .ai_family = family, .ai_socktype = type };
+        struct addrinfo *res;
+        if unlikely (getaddrinfo(host, port, &hints, &res) != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        int one = 1;
+        fd = socket(res->ai_family, type | SOCK_CLOEXEC, 0);
+        bool bound = fd != -1 && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0
+                     && bind(fd, res->ai_addr, res->ai_addrlen) == 0;
+        freeaddrinfo(res);
+        if unlikely (!bound)
+            goto fail;
+    }
+    if (type == SOCK_STREAM && listen(fd, SOMAXCONN) != 0)
+        goto fail;
+    return fd;
+
+fail:
+    if (fd != -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return -1;
+}
+
+#if defined(__linux__)
+/* Wait for every process in a cgroup to exit, returning true once its cgroup.events reports "populated 0" within the
+   given number of milliseconds. Every change to cgroup.events wakes poll(2) with POLLPRI, and a change after the last
+   read is never missed. */
+static inline bool cgroup_wait(const char *cgroup, int timeout)
+{
+    char path[PATH_MAX + sizeof("/cgroup.events")];
+    snprintf(path, sizeof(path), "%s/cgroup.events", cgroup);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if unlikely (fd == -1)
+        return false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long end = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + timeout;
+    bool empty = false;
+    while (true) {
+        char events[256];
+        ssize_t len = pread(fd, events, sizeof(events) - 1, 0);
+        if unlikely (len <= 0)
+            break;
+        events[len] = 0;
+        if (strstr(events, "populated 0") != NULL) {
+            empty = true;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long ms = end - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+        if (ms <= 0)
+            break;
+        struct pollfd pfd = { .fd = fd, .events = POLLPRI, .revents = 0 };
+        poll(&pfd, 1, (int)ms);
+    }
+    close(fd);
+    return empty;
+}
+#endif